@@ -481,6 +481,17 @@ int32_t ide_pio_readwrite(uint8_t rw, uint8_t drive, uint64_t lba,
   return (words * 2);
 }
 
+/* Transfers are done by polling, so a request is complete when the
+   read or write function returns. An asynchronous caller (request->sem
+   set) is still signalled, as the gbd interface promises. */
+static void ide_request_done(gbd_request_t *request, int result)
+{
+  if(request->sem != NULL) {
+    request->return_value = (result > 0) ? 0 : -1;
+    semaphore_V(request->sem);
+  }
+}
+
 int ide_read_block(gbd_t *gbd, gbd_request_t *request)
 {
   /* Get disk */
@@ -489,15 +500,19 @@ int ide_read_block(gbd_t *gbd, gbd_request_t *request)
   uint8_t *buf = (uint8_t*)(uint64_t)request->buf;
   uint64_t sector = (uint64_t)request->block;
 
+  int r;
+
   /* Sanity checks */
   if(drive > 3 || ide_devices[drive].present == 0)
-    return -6;
-  if(sector > ide_devices[drive].totalsectors ||
-     ide_devices[drive].type != 0)
-    return -5;
-
-  /* Ok things seems in order, gogo */
-  return ide_pio_readwrite(IDE_READ, drive, sector, buf, 1);
+    r = -6;
+  else if(sector > ide_devices[drive].totalsectors ||
+          ide_devices[drive].type != 0)
+    r = -5;
+  else /* Ok things seems in order, gogo */
+    r = ide_pio_readwrite(IDE_READ, drive, sector, buf, 1);
+
+  ide_request_done(request, r);
+  return r;
 }
 
 int ide_write_block(gbd_t *gbd, gbd_request_t *request)
@@ -508,15 +523,19 @@ int ide_write_block(gbd_t *gbd, gbd_request_t *request)
   uint8_t *buf = (uint8_t*)(uint64_t)request->buf;
   uint64_t sector = (uint64_t)request->block;
 
+  int r;
+
   /* Sanity checks */
   if(drive > 3 || ide_devices[drive].present == 0)
-    return -1;
-  if(sector > ide_devices[drive].totalsectors ||
-     ide_devices[drive].type != 0)
-    return -2;
-
-  /* Ok things seem in order, gogo */
-  return ide_pio_readwrite(IDE_WRITE, drive, sector, buf, 1);
+    r = -1;
+  else if(sector > ide_devices[drive].totalsectors ||
+          ide_devices[drive].type != 0)
+    r = -2;
+  else /* Ok things seem in order, gogo */
+    r = ide_pio_readwrite(IDE_WRITE, drive, sector, buf, 1);
+
+  ide_request_done(request, r);
+  return r;
 }
 
 /** @} */
@@ -20,12 +20,13 @@
  * @{
  */
 
-/** Get number of timer ticks elapsed since system startup from the
- * system RTC. Returns the number of timer ticks since system startup
+/** Get number of milliseconds elapsed since system startup. There
+ * is no RTC device, so this is derived from the PIT tick count and
+ * has a resolution of one tick.
  *
- * @return Number of timer ticks elapsed
+ * @return Number of milliseconds elapsed
  */
 uint32_t rtc_get_msec()
 {
-    return get_clock(); /* MSEC @0x00 */
+    return get_clock() * (1000 / PIT_FREQUENCY);
 }
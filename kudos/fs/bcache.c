@@ -0,0 +1,540 @@
+/*
+ * Block buffer cache.
+ */
+
+#include "fs/bcache.h"
+#include "kernel/semaphore.h"
+#include "kernel/assert.h"
+#include "lib/libc.h"
+#include "vm/memory.h"
+
+/** @name Block buffer cache
+ *
+ * Caches blocks of generic block devices for the filesystem drivers.
+ * A block is looked up by its device and block number in a hash
+ * table. Unreferenced blocks are replaced in least recently used
+ * order. Writes only mark a block dirty; dirty blocks are written to
+ * the disk when they are replaced, and by bcache_sync() when a
+ * filesystem is unmounted.
+ *
+ * Whole blocks of file data can be read with bcache_read_direct(),
+ * which transfers blocks that are not cached straight into the
+ * caller's buffer, and does not fill the cache with them.
+ *
+ * A single semaphore protects the cache and is held during disk
+ * operations, so misses are served one at a time. Read-ahead with
+ * bcache_prefetch() instead starts an asynchronous read and returns;
+ * the first user of the block waits for the read to complete.
+ *
+ * @{
+ */
+
+/** The buffers, and the memory for their contents */
+static bcache_buf_t bcache_bufs[BCACHE_BUFFERS];
+static uint32_t bcache_data[BCACHE_BUFFERS][BCACHE_BLOCK_SIZE / 4];
+
+/** Hash chains of buffers in use */
+static bcache_buf_t *bcache_hash[BCACHE_HASH_SIZE];
+
+/** Most and least recently used buffers */
+static bcache_buf_t *bcache_mru;
+static bcache_buf_t *bcache_lru;
+
+/** An asynchronous read into a buffer */
+typedef struct bcache_io_struct {
+  gbd_request_t req;
+  /* The buffer being filled, NULL if the request is unused */
+  bcache_buf_t *buf;
+} bcache_io_t;
+
+/** Read-ahead requests */
+static bcache_io_t bcache_ios[BCACHE_PREFETCH];
+
+/** Lock for everything above */
+static semaphore_t *bcache_sem;
+
+/* Returns the hash chain of a block. */
+static bcache_buf_t **bcache_chain(gbd_t *disk, uint32_t block)
+{
+  return &bcache_hash[(((uintptr_t)disk >> 4) + block) % BCACHE_HASH_SIZE];
+}
+
+/* Unlinks buf from the LRU list. */
+static void bcache_lru_remove(bcache_buf_t *buf)
+{
+  if (buf->lru_prev != NULL) {
+    buf->lru_prev->lru_next = buf->lru_next;
+  } else {
+    bcache_mru = buf->lru_next;
+  }
+
+  if (buf->lru_next != NULL) {
+    buf->lru_next->lru_prev = buf->lru_prev;
+  } else {
+    bcache_lru = buf->lru_prev;
+  }
+}
+
+/* Moves buf to the most recently used end of the LRU list. */
+static void bcache_touch(bcache_buf_t *buf)
+{
+  bcache_lru_remove(buf);
+
+  buf->lru_prev = NULL;
+  buf->lru_next = bcache_mru;
+  if (bcache_mru != NULL) {
+    bcache_mru->lru_prev = buf;
+  } else {
+    bcache_lru = buf;
+  }
+  bcache_mru = buf;
+}
+
+/* Removes buf from its hash chain, if it is on one. */
+static void bcache_unhash(bcache_buf_t *buf)
+{
+  bcache_buf_t **link;
+
+  if (buf->disk == NULL) {
+    return;
+  }
+
+  for (link = bcache_chain(buf->disk, buf->block); *link != buf;
+       link = &(*link)->hash_next);
+  *link = buf->hash_next;
+  buf->disk = NULL;
+}
+
+/* Waits for the read-ahead of buf to complete, if there is one in
+   progress. A failed read drops the block from the cache. */
+static void bcache_finish(bcache_buf_t *buf)
+{
+  bcache_io_t *io = buf->io;
+
+  if (io == NULL) {
+    return;
+  }
+
+  semaphore_P(io->req.sem);
+  io->buf = NULL;
+  buf->io = NULL;
+
+  if (io->req.return_value != 0) {
+    kprintf("bcache: read-ahead error at block %d\n", buf->block);
+    bcache_unhash(buf);
+  }
+}
+
+/* Finishes the read-aheads that are complete, freeing their requests
+   and unpinning their buffers also if the blocks are never looked up.
+   Only the cache waits on the request semaphores, under bcache_sem,
+   so a positive value means bcache_finish() will not block. */
+static void bcache_reap(void)
+{
+  int i;
+
+  for (i = 0; i < BCACHE_PREFETCH; i++) {
+    if (bcache_ios[i].buf != NULL && bcache_ios[i].req.sem->value > 0) {
+      bcache_finish(bcache_ios[i].buf);
+    }
+  }
+}
+
+/* Reads or writes the contents of buf. Returns nonzero on success. */
+static int bcache_io(bcache_buf_t *buf, int write)
+{
+  gbd_request_t req;
+  int r;
+
+  req.block = buf->block;
+  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)buf->data);
+  req.sem = NULL;
+  if (write) {
+    r = buf->disk->write_block(buf->disk, &req);
+  } else {
+    r = buf->disk->read_block(buf->disk, &req);
+  }
+
+  return r > 0;
+}
+
+/* Writes buf to the disk if it is dirty. Returns nonzero on
+   success. */
+static int bcache_writeback(bcache_buf_t *buf)
+{
+  if (buf->dirty) {
+    if (!bcache_io(buf, 1)) {
+      kprintf("bcache: write error at block %d\n", buf->block);
+      return 0;
+    }
+    buf->dirty = 0;
+  }
+
+  return 1;
+}
+
+/* Returns the cached block, after any read-ahead into it is complete,
+   or NULL if the block is not cached. */
+static bcache_buf_t *bcache_find(gbd_t *disk, uint32_t block)
+{
+  bcache_buf_t *buf;
+
+  for (buf = *bcache_chain(disk, block); buf != NULL; buf = buf->hash_next) {
+    if (buf->disk == disk && buf->block == block) {
+      bcache_finish(buf);
+      /* The block is gone if the read-ahead failed. */
+      return buf->disk != NULL ? buf : NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns the least recently used buffer which is not in use, and
+   which can be written back if it is dirty, removed from its hash
+   chain. Returns NULL if there is none. */
+static bcache_buf_t *bcache_victim(gbd_t *disk)
+{
+  bcache_buf_t *buf;
+
+  KERNEL_ASSERT(disk->block_size(disk) <= BCACHE_BLOCK_SIZE);
+
+  bcache_reap();
+
+  for (buf = bcache_lru; buf != NULL; buf = buf->lru_prev) {
+    if (buf->refs == 0 && buf->io == NULL && bcache_writeback(buf)) {
+      bcache_unhash(buf);
+      return buf;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Initializes the block buffer cache. Must be called after
+ * semaphore_init() and before any filesystem is mounted.
+ */
+void bcache_init(void)
+{
+  int i;
+
+  bcache_sem = semaphore_create(1);
+  KERNEL_ASSERT(bcache_sem != NULL);
+
+  bcache_mru = NULL;
+  bcache_lru = NULL;
+  for (i = 0; i < BCACHE_HASH_SIZE; i++) {
+    bcache_hash[i] = NULL;
+  }
+
+  for (i = 0; i < BCACHE_PREFETCH; i++) {
+    bcache_ios[i].buf = NULL;
+    bcache_ios[i].req.sem = semaphore_create(0);
+    KERNEL_ASSERT(bcache_ios[i].req.sem != NULL);
+  }
+
+  for (i = 0; i < BCACHE_BUFFERS; i++) {
+    memoryset(&bcache_bufs[i], 0, sizeof(bcache_buf_t));
+    bcache_bufs[i].data = bcache_data[i];
+    bcache_bufs[i].lru_next = bcache_mru;
+    if (bcache_mru != NULL) {
+      bcache_mru->lru_prev = &bcache_bufs[i];
+    } else {
+      bcache_lru = &bcache_bufs[i];
+    }
+    bcache_mru = &bcache_bufs[i];
+  }
+}
+
+/* Returns a referenced buffer for the block, reading it from the disk
+   if fill is set and it is not cached. Returns NULL if the block
+   could not be read or all buffers are in use. */
+static bcache_buf_t *bcache_lookup(gbd_t *disk, uint32_t block, int fill)
+{
+  bcache_buf_t **chain = bcache_chain(disk, block);
+  bcache_buf_t *buf;
+
+  semaphore_P(bcache_sem);
+
+  buf = bcache_find(disk, block);
+  if (buf != NULL) {
+    buf->refs++;
+    bcache_touch(buf);
+    semaphore_V(bcache_sem);
+    return buf;
+  }
+
+  buf = bcache_victim(disk);
+  if (buf == NULL) {
+    semaphore_V(bcache_sem);
+    return NULL;
+  }
+
+  buf->disk = disk;
+  buf->block = block;
+  if (fill && !bcache_io(buf, 0)) {
+    buf->disk = NULL;
+    semaphore_V(bcache_sem);
+    return NULL;
+  }
+
+  buf->hash_next = *chain;
+  *chain = buf;
+  buf->refs = 1;
+  bcache_touch(buf);
+
+  semaphore_V(bcache_sem);
+  return buf;
+}
+
+/**
+ * Gets a block from the cache, reading it from the disk if it is not
+ * cached. The block must be released with bcache_put().
+ *
+ * @param disk The device
+ *
+ * @param block The block number on the device
+ *
+ * @return The buffer, or NULL if the block could not be read.
+ */
+bcache_buf_t *bcache_get(gbd_t *disk, uint32_t block)
+{
+  return bcache_lookup(disk, block, 1);
+}
+
+/**
+ * Gets a block from the cache without reading it from the disk. The
+ * contents are undefined unless the block was cached, so the caller
+ * must overwrite all of it. The block must be released with
+ * bcache_put().
+ *
+ * @param disk The device
+ *
+ * @param block The block number on the device
+ *
+ * @return The buffer, or NULL if no buffer was free.
+ */
+bcache_buf_t *bcache_get_empty(gbd_t *disk, uint32_t block)
+{
+  return bcache_lookup(disk, block, 0);
+}
+
+/**
+ * Starts reading a block into the cache in the background, if it is
+ * not cached. Nothing is done if all read-ahead requests or buffers
+ * are in use.
+ *
+ * @param disk The device
+ *
+ * @param block The block number on the device
+ */
+void bcache_prefetch(gbd_t *disk, uint32_t block)
+{
+  bcache_buf_t **chain = bcache_chain(disk, block);
+  bcache_io_t *io = NULL;
+  bcache_buf_t *buf;
+  int i;
+
+  semaphore_P(bcache_sem);
+
+  for (buf = *chain; buf != NULL; buf = buf->hash_next) {
+    if (buf->disk == disk && buf->block == block) {
+      semaphore_V(bcache_sem);
+      return;
+    }
+  }
+
+  bcache_reap();
+  for (i = 0; i < BCACHE_PREFETCH && io == NULL; i++) {
+    if (bcache_ios[i].buf == NULL) {
+      io = &bcache_ios[i];
+    }
+  }
+  buf = (io != NULL) ? bcache_victim(disk) : NULL;
+  if (buf == NULL) {
+    semaphore_V(bcache_sem);
+    return;
+  }
+
+  buf->disk = disk;
+  buf->block = block;
+  buf->hash_next = *chain;
+  *chain = buf;
+  buf->io = io;
+  bcache_touch(buf);
+
+  /* The driver signals io->req.sem when the read is complete, also
+     if it fails, so the return value can be ignored here. */
+  io->buf = buf;
+  io->req.block = block;
+  io->req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)buf->data);
+  disk->read_block(disk, &io->req);
+
+  semaphore_V(bcache_sem);
+}
+
+/**
+ * Releases a block got with bcache_get() or bcache_get_empty().
+ *
+ * @param buf The buffer
+ *
+ * @param dirty Nonzero if the contents were changed.
+ */
+void bcache_put(bcache_buf_t *buf, int dirty)
+{
+  semaphore_P(bcache_sem);
+
+  KERNEL_ASSERT(buf->refs > 0);
+  buf->refs--;
+  if (dirty) {
+    buf->dirty = 1;
+  }
+
+  semaphore_V(bcache_sem);
+}
+
+/**
+ * Reads a block through the cache. Like the read_block function of a
+ * gbd, but always synchronous.
+ *
+ * @param disk The device
+ *
+ * @param block The block number on the device
+ *
+ * @param buffer Kernel address of a buffer of the block size
+ *
+ * @return 1 on success, 0 on error.
+ */
+int bcache_read(gbd_t *disk, uint32_t block, void *buffer)
+{
+  bcache_buf_t *buf = bcache_get(disk, block);
+
+  if (buf == NULL) {
+    return 0;
+  }
+
+  memcopy(disk->block_size(disk), buffer, buf->data);
+  bcache_put(buf, 0);
+  return 1;
+}
+
+/**
+ * Reads a block into a buffer without caching it. A cached block is
+ * copied from the cache, since it may be newer than the disk;
+ * otherwise the disk driver transfers the block straight into the
+ * buffer, saving a copy for large reads. The disk takes 32 bit
+ * physical addresses, so a buffer above 4 GiB is read through the
+ * cache instead.
+ *
+ * @param disk The device
+ *
+ * @param block The block number on the device
+ *
+ * @param buffer Kernel address of a word aligned buffer of the block
+ * size
+ *
+ * @return 1 on success, 0 on error.
+ */
+int bcache_read_direct(gbd_t *disk, uint32_t block, void *buffer)
+{
+  gbd_request_t req;
+  bcache_buf_t *buf;
+  physaddr_t phys = ADDR_KERNEL_TO_PHYS((uintptr_t)buffer);
+  int r;
+
+  if ((uint64_t)phys + disk->block_size(disk) > 0x100000000ULL) {
+    return bcache_read(disk, block, buffer);
+  }
+
+  semaphore_P(bcache_sem);
+
+  buf = bcache_find(disk, block);
+  if (buf != NULL) {
+    memcopy(disk->block_size(disk), buffer, buf->data);
+    bcache_touch(buf);
+    semaphore_V(bcache_sem);
+    return 1;
+  }
+
+  /* The lock is held during the transfer, so that the block cannot
+     be cached and written meanwhile. */
+  req.block = block;
+  req.buf = phys;
+  req.sem = NULL;
+  r = disk->read_block(disk, &req);
+
+  semaphore_V(bcache_sem);
+  return r > 0;
+}
+
+/**
+ * Writes a block through the cache. The block reaches the disk when
+ * it is replaced in the cache or synchronized.
+ *
+ * @param disk The device
+ *
+ * @param block The block number on the device
+ *
+ * @param buffer Kernel address of a buffer of the block size
+ *
+ * @return 1 on success, 0 on error.
+ */
+int bcache_write(gbd_t *disk, uint32_t block, const void *buffer)
+{
+  bcache_buf_t *buf = bcache_get_empty(disk, block);
+
+  if (buf == NULL) {
+    return 0;
+  }
+
+  memcopy(disk->block_size(disk), buf->data, buffer);
+  bcache_put(buf, 1);
+  return 1;
+}
+
+/**
+ * Writes all dirty blocks of a device to the disk.
+ *
+ * @param disk The device
+ *
+ * @return 1 on success, 0 if some block could not be written.
+ */
+int bcache_sync(gbd_t *disk)
+{
+  int i, ok = 1;
+
+  semaphore_P(bcache_sem);
+  for (i = 0; i < BCACHE_BUFFERS; i++) {
+    if (bcache_bufs[i].disk == disk && !bcache_writeback(&bcache_bufs[i])) {
+      ok = 0;
+    }
+  }
+  semaphore_V(bcache_sem);
+
+  return ok;
+}
+
+/**
+ * Drops the unreferenced blocks of a device from the cache, after
+ * writing the dirty ones to the disk.
+ *
+ * @param disk The device
+ */
+void bcache_invalidate(gbd_t *disk)
+{
+  int i;
+
+  semaphore_P(bcache_sem);
+  for (i = 0; i < BCACHE_BUFFERS; i++) {
+    if (bcache_bufs[i].disk == disk && bcache_bufs[i].refs == 0) {
+      bcache_finish(&bcache_bufs[i]);
+      bcache_writeback(&bcache_bufs[i]);
+      bcache_bufs[i].dirty = 0;
+      bcache_unhash(&bcache_bufs[i]);
+    }
+  }
+  semaphore_V(bcache_sem);
+}
+
+/** @} */
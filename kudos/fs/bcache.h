@@ -0,0 +1,57 @@
+/*
+ * Block buffer cache.
+ */
+
+#ifndef KUDOS_FS_BCACHE_H
+#define KUDOS_FS_BCACHE_H
+
+#include "lib/types.h"
+#include "drivers/gbd.h"
+
+/* Number of blocks in the cache */
+#define BCACHE_BUFFERS    128
+/* Largest block size of a cached device */
+#define BCACHE_BLOCK_SIZE 512
+/* Number of hash chains */
+#define BCACHE_HASH_SIZE  64
+/* Number of read-ahead requests in progress at the same time */
+#define BCACHE_PREFETCH   8
+
+/* A cached block. The contents in data may be used between
+   bcache_get() and bcache_put(). */
+typedef struct bcache_buf_struct {
+  /* Device and block number, disk is NULL for an unused buffer */
+  gbd_t *disk;
+  uint32_t block;
+
+  /* The contents of the block */
+  void *data;
+
+  /* Number of bcache_get() calls not yet matched by bcache_put() */
+  int refs;
+  /* Nonzero if data has not been written to the disk */
+  int dirty;
+  /* Read-ahead request filling data, or NULL */
+  struct bcache_io_struct *io;
+
+  /* Hash chain, and the LRU list (most recently used first) */
+  struct bcache_buf_struct *hash_next;
+  struct bcache_buf_struct *lru_prev;
+  struct bcache_buf_struct *lru_next;
+} bcache_buf_t;
+
+void bcache_init(void);
+
+bcache_buf_t *bcache_get(gbd_t *disk, uint32_t block);
+bcache_buf_t *bcache_get_empty(gbd_t *disk, uint32_t block);
+void bcache_put(bcache_buf_t *buf, int dirty);
+
+int bcache_read(gbd_t *disk, uint32_t block, void *buffer);
+int bcache_read_direct(gbd_t *disk, uint32_t block, void *buffer);
+void bcache_prefetch(gbd_t *disk, uint32_t block);
+int bcache_write(gbd_t *disk, uint32_t block, const void *buffer);
+
+int bcache_sync(gbd_t *disk);
+void bcache_invalidate(gbd_t *disk);
+
+#endif // KUDOS_FS_BCACHE_H
@@ -0,0 +1,1264 @@
+/*
+ * Extent Filesystem (EFS).
+ */
+
+#include "kernel/assert.h"
+#include "kernel/semaphore.h"
+#include "vm/memory.h"
+#include "drivers/gbd.h"
+#include "fs/vfs.h"
+#include "fs/efs.h"
+#include "lib/libc.h"
+#include "fs/bcache.h"
+
+/**@name Extent Filesystem (EFS)
+ *
+ * This module contains implementation for EFS, the successor of TFS
+ * for large files. Space is allocated in 4 KiB blocks, and the blocks
+ * of a file are a list of extents (runs of consecutive blocks), so
+ * reading a file reads few long runs of sectors. The allocation
+ * bitmap may span several blocks, and the directory is stored like a
+ * file which grows when it is full.
+ *
+ * Metadata is used a sector at a time in place in the block cache.
+ * One lock protects the directory and the allocation bitmap. A file
+ * keeps its extents from creation until removal, so reads take no
+ * lock; writes to a file hold the lock of its inode, and removing
+ * the file waits for them.
+ *
+ * @{
+ */
+
+/* Number of inode locks per filesystem. Inodes share the locks by
+   their number. */
+#define EFS_INODE_LOCKS 8
+
+/* Number of blocks one bitmap sector keeps track of. */
+#define EFS_BITS_PER_SECTOR (8*EFS_SECTOR_SIZE)
+
+/* Data structure used internally by EFS filesystem. It is initialized
+   during efs_init(). The locks are taken in the order they are listed
+   here. */
+typedef struct {
+  /* First sector of the volume on the disk */
+  uint32_t       startsector;
+
+  /* Values from the header block */
+  uint32_t       totalblocks;
+  uint32_t       bitmapblocks;
+  uint32_t       directory;
+
+  /* Pointer to gbd device performing efs */
+  gbd_t          *disk;
+
+  /* lock for the directory and the allocation bitmap */
+  semaphore_t    *lock;
+  /* locks for writing files, see efs_inode_lock() */
+  semaphore_t    *inode_locks[EFS_INODE_LOCKS];
+} efs_t;
+
+/**
+ * Returns the disk sector number of a sector of a block.
+ *
+ * @param efs The filesystem
+ * @param block Block number
+ * @param n Sector of the block, 0 to EFS_SECTORS_PER_BLOCK - 1
+ *
+ * @return The sector number
+ */
+static uint32_t efs_sector(efs_t *efs, uint32_t block, uint32_t n)
+{
+  return efs->startsector + block * EFS_SECTORS_PER_BLOCK + n;
+}
+
+/**
+ * Returns the lock which serializes writing and removing a file.
+ *
+ * @param efs The filesystem
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return The lock
+ */
+static semaphore_t *efs_inode_lock(efs_t *efs, uint32_t fileid)
+{
+  return efs->inode_locks[fileid % EFS_INODE_LOCKS];
+}
+
+/**
+ * Checks that a file id can be the inode block of a file.
+ *
+ * @param efs The filesystem
+ * @param fileid File id
+ *
+ * @return 1 if it can, 0 if not.
+ */
+static int efs_valid_inode(efs_t *efs, int fileid)
+{
+  return fileid > (int)efs->directory && (uint32_t)fileid < efs->totalblocks;
+}
+
+/**
+ * Gets the inode sector holding an extent. The sector must be
+ * released with bcache_put().
+ *
+ * @param efs The filesystem
+ * @param inode Inode block number
+ * @param i Index of the extent
+ * @param ext Where to store a pointer to the extent in the sector
+ *
+ * @return The sector, or NULL if it could not be read.
+ */
+static bcache_buf_t *efs_extent_get(efs_t *efs, uint32_t inode, uint32_t i,
+                                    efs_extent_t **ext)
+{
+  bcache_buf_t *buf;
+
+  /* The size and extent count take the place of one extent. */
+  buf = bcache_get(efs->disk,
+                   efs_sector(efs, inode, (i + 1) / EFS_EXTENTS_PER_SECTOR));
+  if(buf != NULL)
+    *ext = &((efs_extent_t *)buf->data)[(i + 1) % EFS_EXTENTS_PER_SECTOR];
+
+  return buf;
+}
+
+/**
+ * Reads the file size and the number of extents of an inode.
+ *
+ * @param efs The filesystem
+ * @param inode Inode block number
+ * @param filesize Where to store the file size
+ * @param extents Where to store the number of extents, or NULL
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+static int efs_inode_size(efs_t *efs, uint32_t inode, uint32_t *filesize,
+                          uint32_t *extents)
+{
+  bcache_buf_t *buf;
+  efs_inode_t *ondisk;
+  int r = VFS_OK;
+
+  buf = bcache_get(efs->disk, efs_sector(efs, inode, 0));
+  if(buf == NULL)
+    return VFS_ERROR;
+
+  ondisk = (efs_inode_t *)buf->data;
+  *filesize = from_big_endian32(ondisk->filesize);
+  if(from_big_endian32(ondisk->extents) > EFS_EXTENTS_MAX)
+    r = VFS_ERROR;
+  else if(extents != NULL)
+    *extents = from_big_endian32(ondisk->extents);
+
+  bcache_put(buf, 0);
+  return r;
+}
+
+/**
+ * Finds the disk block holding a block of a file.
+ *
+ * @param efs The filesystem
+ * @param inode Inode block number of the file
+ * @param fblock Block number within the file
+ * @param block Where to store the disk block number
+ * @param run Where to store the number of consecutive blocks of the
+ * file starting from the block, at least 1
+ *
+ * @return VFS_OK, or VFS_ERROR if the block is not in the file or
+ * error occured. The blocks found are always inside the volume.
+ */
+static int efs_map(efs_t *efs, uint32_t inode, uint32_t fblock,
+                   uint32_t *block, uint32_t *run)
+{
+  bcache_buf_t *buf;
+  efs_extent_t *ext;
+  uint32_t i, extents, filesize, length;
+
+  if(efs_inode_size(efs, inode, &filesize, &extents) != VFS_OK)
+    return VFS_ERROR;
+
+  for(i = 0; i < extents; i++) {
+    buf = efs_extent_get(efs, inode, i, &ext);
+    if(buf == NULL)
+      return VFS_ERROR;
+
+    length = from_big_endian32(ext->length);
+    if(from_big_endian32(ext->start) >= efs->totalblocks ||
+       length > efs->totalblocks - from_big_endian32(ext->start)) {
+      /* The extent is not inside the volume. */
+      bcache_put(buf, 0);
+      return VFS_ERROR;
+    }
+    if(fblock < length) {
+      *block = from_big_endian32(ext->start) + fblock;
+      *run = length - fblock;
+      bcache_put(buf, 0);
+      return VFS_OK;
+    }
+    fblock -= length;
+    bcache_put(buf, 0);
+  }
+
+  return VFS_ERROR;
+}
+
+/**
+ * Adds blocks to the end of a file. They extend the last extent if
+ * they follow it on the disk. The file size is not changed.
+ *
+ * @param efs The filesystem
+ * @param inode Inode block number of the file
+ * @param start First block to add
+ * @param length Number of blocks to add
+ *
+ * @return VFS_OK, or VFS_ERROR if the inode has no room for another
+ * extent or error occured.
+ */
+static int efs_inode_append(efs_t *efs, uint32_t inode, uint32_t start,
+                            uint32_t length)
+{
+  bcache_buf_t *buf;
+  efs_extent_t *ext;
+  efs_inode_t *ondisk;
+  uint32_t filesize, extents;
+
+  if(efs_inode_size(efs, inode, &filesize, &extents) != VFS_OK)
+    return VFS_ERROR;
+
+  if(extents > 0) {
+    buf = efs_extent_get(efs, inode, extents - 1, &ext);
+    if(buf == NULL)
+      return VFS_ERROR;
+
+    if(from_big_endian32(ext->start) + from_big_endian32(ext->length)
+       == start) {
+      ext->length = to_big_endian32(from_big_endian32(ext->length) + length);
+      bcache_put(buf, 1);
+      return VFS_OK;
+    }
+    bcache_put(buf, 0);
+  }
+
+  if(extents == EFS_EXTENTS_MAX)
+    return VFS_ERROR;
+
+  buf = efs_extent_get(efs, inode, extents, &ext);
+  if(buf == NULL)
+    return VFS_ERROR;
+  ext->start = to_big_endian32(start);
+  ext->length = to_big_endian32(length);
+  bcache_put(buf, 1);
+
+  buf = bcache_get(efs->disk, efs_sector(efs, inode, 0));
+  if(buf == NULL)
+    return VFS_ERROR;
+  ondisk = (efs_inode_t *)buf->data;
+  ondisk->extents = to_big_endian32(extents + 1);
+  bcache_put(buf, 1);
+
+  return VFS_OK;
+}
+
+/**
+ * Fills blocks with zeros.
+ *
+ * @param efs The filesystem
+ * @param start First block
+ * @param length Number of blocks
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+static int efs_zero(efs_t *efs, uint32_t start, uint32_t length)
+{
+  bcache_buf_t *buf;
+  uint32_t i;
+
+  for(i = 0; i < length * EFS_SECTORS_PER_BLOCK; i++) {
+    buf = bcache_get_empty(efs->disk, efs_sector(efs, start, i));
+    if(buf == NULL)
+      return VFS_ERROR;
+    memoryset(buf->data, 0, EFS_SECTOR_SIZE);
+    bcache_put(buf, 1);
+  }
+
+  return VFS_OK;
+}
+
+/**
+ * Marks blocks used or free in the allocation bitmap. Must be called
+ * with efs->lock held.
+ *
+ * @param efs The filesystem
+ * @param start First block
+ * @param length Number of blocks
+ * @param value 1 for used, 0 for free
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+static int efs_bitmap_mark(efs_t *efs, uint32_t start, uint32_t length,
+                           int value)
+{
+  bcache_buf_t *buf = NULL;
+  uint8_t *bits;
+  uint32_t b, bit;
+
+  for(b = start; b < start + length; b++) {
+    bit = b % EFS_BITS_PER_SECTOR;
+    if(buf == NULL || bit == 0) {
+      if(buf != NULL)
+        bcache_put(buf, 1);
+      buf = bcache_get(efs->disk,
+                       efs_sector(efs, EFS_BITMAP_BLOCK, 0)
+                       + b / EFS_BITS_PER_SECTOR);
+      if(buf == NULL)
+        return VFS_ERROR;
+    }
+
+    bits = (uint8_t *)buf->data;
+    if(value)
+      bits[bit / 8] |= 1 << (bit % 8);
+    else
+      bits[bit / 8] &= ~(1 << (bit % 8));
+  }
+
+  if(buf != NULL)
+    bcache_put(buf, 1);
+  return VFS_OK;
+}
+
+/**
+ * Finds free blocks in the allocation bitmap: the first run of at
+ * least count free blocks, or the longest run if there is none. Must
+ * be called with efs->lock held.
+ *
+ * @param efs The filesystem
+ * @param count Number of blocks wanted
+ * @param start Where to store the first block of the run
+ *
+ * @return Length of the run, at most count, 0 if the disk is full, or
+ * VFS_ERROR if error occured.
+ */
+static int efs_bitmap_find(efs_t *efs, uint32_t count, uint32_t *start)
+{
+  bcache_buf_t *buf = NULL;
+  uint8_t *bits = NULL;
+  uint32_t b, bit;
+  uint32_t run = 0, best = 0;
+
+  for(b = 0; b < efs->totalblocks && best < count; b++) {
+    bit = b % EFS_BITS_PER_SECTOR;
+    if(bit == 0) {
+      if(buf != NULL)
+        bcache_put(buf, 0);
+      buf = bcache_get(efs->disk,
+                       efs_sector(efs, EFS_BITMAP_BLOCK, 0)
+                       + b / EFS_BITS_PER_SECTOR);
+      if(buf == NULL)
+        return VFS_ERROR;
+      bits = (uint8_t *)buf->data;
+    }
+
+    if(bits[bit / 8] & (1 << (bit % 8))) {
+      run = 0;
+    } else if(++run > best) {
+      best = run;
+      *start = b + 1 - run;
+    }
+  }
+
+  if(buf != NULL)
+    bcache_put(buf, 0);
+  return best;
+}
+
+/**
+ * Frees the blocks of a file and its inode block. Must be called with
+ * efs->lock held.
+ *
+ * @param efs The filesystem
+ * @param inode Inode block number of the file
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+static int efs_inode_free(efs_t *efs, uint32_t inode)
+{
+  bcache_buf_t *buf;
+  efs_extent_t *ext;
+  uint32_t i, filesize, extents, start, length;
+
+  if(efs_inode_size(efs, inode, &filesize, &extents) != VFS_OK)
+    return VFS_ERROR;
+
+  for(i = 0; i < extents; i++) {
+    buf = efs_extent_get(efs, inode, i, &ext);
+    if(buf == NULL)
+      return VFS_ERROR;
+    start = from_big_endian32(ext->start);
+    length = from_big_endian32(ext->length);
+    bcache_put(buf, 0);
+
+    if(efs_bitmap_mark(efs, start, length, 0) != VFS_OK)
+      return VFS_ERROR;
+  }
+
+  return efs_bitmap_mark(efs, inode, 1, 0);
+}
+
+/**
+ * Gets a sector of the directory. The sector must be released with
+ * bcache_put().
+ *
+ * @param efs The filesystem
+ * @param n Sector number within the directory
+ *
+ * @return The sector, or NULL if it could not be read.
+ */
+static bcache_buf_t *efs_dir_get(efs_t *efs, uint32_t n)
+{
+  uint32_t block, run;
+
+  if(efs_map(efs, efs->directory, n / EFS_SECTORS_PER_BLOCK,
+             &block, &run) != VFS_OK)
+    return NULL;
+
+  return bcache_get(efs->disk,
+                    efs_sector(efs, block, n % EFS_SECTORS_PER_BLOCK));
+}
+
+/**
+ * Searches the directory for a file. Must be called with efs->lock
+ * held.
+ *
+ * @param efs The filesystem
+ * @param filename Name of the file
+ * @param sector Where to store the directory sector of the entry of
+ * the file, or of a free entry if the file is not found
+ * @param index Where to store the index of the entry in the sector,
+ * -1 if the file is not found and there are no free entries
+ *
+ * @return VFS_OK if the file was found, VFS_NOT_FOUND if not, or
+ * VFS_ERROR if error occured.
+ */
+static int efs_lookup(efs_t *efs, char *filename, uint32_t *sector,
+                      int *index)
+{
+  bcache_buf_t *buf;
+  efs_direntry_t *dir;
+  uint32_t n, filesize;
+  int i;
+
+  if(efs_inode_size(efs, efs->directory, &filesize, NULL) != VFS_OK)
+    return VFS_ERROR;
+
+  *index = -1;
+  for(n = 0; n < filesize / EFS_SECTOR_SIZE; n++) {
+    buf = efs_dir_get(efs, n);
+    if(buf == NULL)
+      return VFS_ERROR;
+
+    dir = (efs_direntry_t *)buf->data;
+    for(i = 0; i < (int)EFS_DIRENTRIES_PER_SECTOR; i++) {
+      if(dir[i].inode == 0) {
+        if(*index == -1) {
+          *sector = n;
+          *index = i;
+        }
+      } else if(stringcmp(dir[i].name, filename) == 0) {
+        *sector = n;
+        *index = i;
+        bcache_put(buf, 0);
+        return VFS_OK;
+      }
+    }
+
+    bcache_put(buf, 0);
+  }
+
+  return VFS_NOT_FOUND;
+}
+
+/**
+ * Adds a block of free entries to the directory. Must be called with
+ * efs->lock held.
+ *
+ * @param efs The filesystem
+ * @param sector Where to store the directory sector of the first new
+ * entry
+ *
+ * @return VFS_OK, or VFS_ERROR if the disk is full or error occured.
+ */
+static int efs_dir_grow(efs_t *efs, uint32_t *sector)
+{
+  bcache_buf_t *buf;
+  efs_inode_t *ondisk;
+  uint32_t block, filesize;
+
+  if(efs_inode_size(efs, efs->directory, &filesize, NULL) != VFS_OK)
+    return VFS_ERROR;
+  if(filesize > EFS_MAX_FILESIZE - EFS_BLOCK_SIZE)
+    return VFS_ERROR;
+
+  if(efs_bitmap_find(efs, 1, &block) != 1)
+    return VFS_ERROR;
+  if(efs_bitmap_mark(efs, block, 1, 1) != VFS_OK)
+    return VFS_ERROR;
+
+  if(efs_zero(efs, block, 1) != VFS_OK ||
+     efs_inode_append(efs, efs->directory, block, 1) != VFS_OK) {
+    efs_bitmap_mark(efs, block, 1, 0);
+    return VFS_ERROR;
+  }
+
+  buf = bcache_get(efs->disk, efs_sector(efs, efs->directory, 0));
+  if(buf == NULL)
+    return VFS_ERROR;
+  ondisk = (efs_inode_t *)buf->data;
+  ondisk->filesize = to_big_endian32(filesize + EFS_BLOCK_SIZE);
+  bcache_put(buf, 1);
+
+  *sector = filesize / EFS_SECTOR_SIZE;
+  return VFS_OK;
+}
+
+/**
+ * Reads or writes a range of a file, which must be inside the file.
+ * Whole sectors are read straight into the buffer, other sectors
+ * are used in the block cache.
+ *
+ * @param efs The filesystem
+ * @param fileid File id (inode block number) of the file.
+ * @param buffer Buffer to read into or write from
+ * @param count Number of bytes
+ * @param offset Start of the range in the file
+ * @param write 1 to write, 0 to read
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+static int efs_transfer(efs_t *efs, uint32_t fileid, void *buffer,
+                        int count, int offset, int write)
+{
+  bcache_buf_t *buf;
+  void *data;
+  uint32_t block, run, sector, sectors;
+  int start, n;
+  int done = 0;
+
+  while(done < count) {
+    /* Find the run of blocks holding the next byte... */
+    if(efs_map(efs, fileid, (offset + done) / EFS_BLOCK_SIZE,
+               &block, &run) != VFS_OK)
+      return VFS_ERROR;
+
+    start = (offset + done) % EFS_BLOCK_SIZE;
+    sector = efs_sector(efs, block, start / EFS_SECTOR_SIZE);
+    sectors = run * EFS_SECTORS_PER_BLOCK - start / EFS_SECTOR_SIZE;
+
+    /* ...and transfer its sectors in order. */
+    for(; sectors > 0 && done < count; sector++, sectors--) {
+      start = (offset + done) % EFS_SECTOR_SIZE;
+      n = MIN(EFS_SECTOR_SIZE - start, count - done);
+      data = (void *)((uintptr_t)buffer + done);
+
+      if(!write && n == EFS_SECTOR_SIZE && ((uintptr_t)data & 3) == 0) {
+        if(bcache_read_direct(efs->disk, sector, data) == 0)
+          return VFS_ERROR;
+      } else {
+        if(write && n == EFS_SECTOR_SIZE)
+          buf = bcache_get_empty(efs->disk, sector);
+        else
+          buf = bcache_get(efs->disk, sector);
+        if(buf == NULL)
+          return VFS_ERROR;
+
+        if(write)
+          memcopy(n, (void *)((uintptr_t)buf->data + start), data);
+        else
+          memcopy(n, data, (const void *)((uintptr_t)buf->data + start));
+        bcache_put(buf, write);
+      }
+
+      done += n;
+    }
+  }
+
+  return VFS_OK;
+}
+
+/**
+ * Destroys the locks of a filesystem. The locks not created yet must
+ * be NULL.
+ *
+ * @param efs The filesystem
+ */
+static void efs_destroy_locks(efs_t *efs)
+{
+  int i;
+
+  if(efs->lock != NULL)
+    semaphore_destroy(efs->lock);
+  for(i = 0; i < EFS_INODE_LOCKS; i++) {
+    if(efs->inode_locks[i] != NULL)
+      semaphore_destroy(efs->inode_locks[i]);
+  }
+}
+
+/**
+ * Creates the locks of a filesystem.
+ *
+ * @param efs The filesystem
+ *
+ * @return 1 on success, 0 if there were not enough semaphores.
+ */
+static int efs_create_locks(efs_t *efs)
+{
+  int i;
+
+  efs->lock = semaphore_create(1);
+  for(i = 0; i < EFS_INODE_LOCKS; i++)
+    efs->inode_locks[i] = semaphore_create(1);
+
+  if(efs->lock == NULL) {
+    efs_destroy_locks(efs);
+    return 0;
+  }
+  for(i = 0; i < EFS_INODE_LOCKS; i++) {
+    if(efs->inode_locks[i] == NULL) {
+      efs_destroy_locks(efs);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Initialize extent filesystem. Allocates 1 page of memory dynamically
+ * for filesystem data structure and efs data structure. Sets fs_t and
+ * efs_t fields. If initialization is succesful, returns pointer to
+ * fs_t data structure. Else NULL pointer is returned.
+ *
+ * @param disk Pointer to gbd-device performing efs.
+ * @param sector First sector of the volume.
+ *
+ * @return Pointer to the filesystem data structure fs_t, if fails
+ * return NULL.
+ */
+fs_t * efs_init(gbd_t *disk, uint32_t sector)
+{
+  physaddr_t addr;
+  gbd_request_t req;
+  efs_header_t *header;
+  char name[EFS_VOLNAME_MAX];
+  uint32_t totalblocks, bitmapblocks, directory;
+  fs_t *fs;
+  efs_t *efs;
+  int r;
+
+  if(disk->block_size(disk) != EFS_SECTOR_SIZE)
+    return NULL;
+
+  addr = (physaddr_t)kmalloc(4096);
+
+  if(addr == 0) {
+    kprintf("efs_init: could not allocate memory.\n");
+    return NULL;
+  }
+  addr = ADDR_PHYS_TO_KERNEL(addr);      /* transform to vm address */
+
+  /* Assert that one page is enough */
+  KERNEL_ASSERT(PAGE_SIZE >= EFS_SECTOR_SIZE &&
+                PAGE_SIZE >= sizeof(efs_t)+sizeof(fs_t));
+
+  /* Read header block, and make sure this is efs drive */
+  req.block = sector + EFS_HEADER_BLOCK * EFS_SECTORS_PER_BLOCK;
+  req.sem = NULL;
+  req.buf = ADDR_KERNEL_TO_PHYS(addr);   /* disk needs physical addr */
+
+  r = disk->read_block(disk, &req);
+  if(r == 0) {
+    //NEED kfree function here
+    kprintf("efs_init: Error during disk read. Initialization failed.\n");
+    return NULL;
+  }
+
+  header = (efs_header_t *)addr;
+  if(from_big_endian32(header->magic) != EFS_MAGIC) {
+    //NEED kfree function here
+    return NULL;
+  }
+
+  totalblocks = from_big_endian32(header->totalblocks);
+  bitmapblocks = from_big_endian32(header->bitmapblocks);
+  directory = from_big_endian32(header->directory);
+
+  /* The volume must fit on the disk and the bitmap must cover it. */
+  if(totalblocks > (disk->total_blocks(disk) - sector)
+     / EFS_SECTORS_PER_BLOCK ||
+     bitmapblocks != (totalblocks + EFS_BITS_PER_BLOCK - 1)
+     / EFS_BITS_PER_BLOCK ||
+     directory != EFS_BITMAP_BLOCK + bitmapblocks ||
+     directory >= totalblocks) {
+    kprintf("efs_init: Invalid header. Initialization failed.\n");
+    return NULL;
+  }
+
+  /* Copy volume name from header block. */
+  stringcopy(name, header->volname, EFS_VOLNAME_MAX);
+
+  /* fs_t and efs_t fit in one page, so obtain addresses for each
+     structure inside the allocated memory page. */
+  fs  = (fs_t *)addr;
+  efs = (efs_t *)(addr + sizeof(fs_t));
+  memoryset(efs, 0, sizeof(efs_t));
+
+  if(!efs_create_locks(efs)) {
+    kprintf("efs_init: could not create new semaphores.\n");
+    return NULL;
+  }
+
+  efs->startsector  = sector;
+  efs->totalblocks  = totalblocks;
+  efs->bitmapblocks = bitmapblocks;
+  efs->directory    = directory;
+  efs->disk         = disk;
+
+  memoryset(fs, 0, sizeof(fs_t));
+  fs->internal = (void *)efs;
+  stringcopy(fs->volume_name, name, VFS_NAME_LENGTH);
+
+  fs->unmount = efs_unmount;
+  fs->open    = efs_open;
+  fs->reopen  = efs_reopen;
+  fs->close   = efs_close;
+  fs->create  = efs_create;
+  fs->remove  = efs_remove;
+  fs->read    = efs_read;
+  fs->write   = efs_write;
+  fs->readahead = efs_readahead;
+  fs->getfree  = efs_getfree;
+  fs->filecount = efs_filecount;
+  fs->file      = efs_file;
+
+  return fs;
+}
+
+
+/**
+ * Unmounts efs filesystem from gbd device. Implements fs.unmount().
+ * Waits for the current operation(s) to finish, writes cached blocks
+ * to the disk, frees reserved memory and returns OK.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ *
+ * @return VFS_OK
+ */
+int efs_unmount(fs_t *fs)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+
+  /* The lock should be free at this point, we get it just in case
+     something has gone wrong. */
+  semaphore_P(efs->lock);
+
+  /* write cached blocks back to the disk */
+  bcache_invalidate(efs->disk);
+
+  /* free semaphores and allocated memory */
+  efs_destroy_locks(efs);
+  //NEED kfree function here
+  return VFS_OK;
+}
+
+
+/**
+ * Opens file. Implements fs.open(). Searches the directory for the
+ * file.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename Name of the file to be opened.
+ *
+ * @return If file found, return inode block number as fileid, otherwise
+ * return VFS_NOT_FOUND or VFS_ERROR.
+ */
+int efs_open(fs_t *fs, char *filename)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  bcache_buf_t *buf;
+  uint32_t sector;
+  int index, r;
+
+  semaphore_P(efs->lock);
+
+  r = efs_lookup(efs, filename, &sector, &index);
+  if(r == VFS_OK) {
+    buf = efs_dir_get(efs, sector);
+    if(buf == NULL) {
+      r = VFS_ERROR;
+    } else {
+      r = from_big_endian32(((efs_direntry_t *)buf->data)[index].inode);
+      bcache_put(buf, 0);
+    }
+  }
+
+  semaphore_V(efs->lock);
+  return r;
+}
+
+
+/**
+ * Opens a file again by the file id which efs_open() returned for it
+ * earlier. Implements fs.reopen(). Nothing needs to be read, because
+ * EFS keeps no state for open files.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return fileid, or VFS_INVALID_PARAMS.
+ */
+int efs_reopen(fs_t *fs, int fileid)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+
+  if(!efs_valid_inode(efs, fileid))
+    return VFS_INVALID_PARAMS;
+
+  return fileid;
+}
+
+
+/**
+ * Closes file. Implements fs.close(). There is nothing to do.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return VFS_OK
+ */
+int efs_close(fs_t *fs, int fileid)
+{
+  fs = fs;
+  fileid = fileid;
+
+  return VFS_OK;
+}
+
+
+/**
+ * Creates file of given size. Implements fs.create(). Checks that the
+ * file doesn't already exist, adds a directory block if there is no
+ * free entry, and allocates an inode block and the blocks for the
+ * file in as few extents as possible. The blocks are zeroed.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename File name of the file to be created
+ * @param size Size of the file to be created
+ *
+ * @return If file already exists or not enough space return
+ * VFS_ERROR, otherwise return VFS_OK.
+ */
+int efs_create(fs_t *fs, char *filename, int size)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  bcache_buf_t *buf;
+  efs_inode_t *ondisk;
+  efs_direntry_t *dir;
+  uint32_t sector, inode, start;
+  uint32_t numblocks = ((uint32_t)size + EFS_BLOCK_SIZE - 1)/EFS_BLOCK_SIZE;
+  int index, n;
+  int r;
+
+  if(size < 0 || strlen(filename) >= EFS_FILENAME_MAX)
+    return VFS_ERROR;
+
+  semaphore_P(efs->lock);
+
+  r = efs_lookup(efs, filename, &sector, &index);
+  if(r != VFS_NOT_FOUND) {
+    /* The file exists, or an error occured. */
+    semaphore_V(efs->lock);
+    return VFS_ERROR;
+  }
+
+  if(index == -1) {
+    if(efs_dir_grow(efs, &sector) != VFS_OK) {
+      semaphore_V(efs->lock);
+      return VFS_ERROR;
+    }
+    index = 0;
+  }
+
+  /* Allocate the inode... */
+  if(efs_bitmap_find(efs, 1, &inode) != 1 ||
+     efs_bitmap_mark(efs, inode, 1, 1) != VFS_OK) {
+    semaphore_V(efs->lock);
+    return VFS_ERROR;
+  }
+
+  if(efs_zero(efs, inode, 1) != VFS_OK ||
+     (buf = bcache_get(efs->disk, efs_sector(efs, inode, 0))) == NULL) {
+    efs_bitmap_mark(efs, inode, 1, 0);
+    semaphore_V(efs->lock);
+    return VFS_ERROR;
+  }
+  ondisk = (efs_inode_t *)buf->data;
+  ondisk->filesize = to_big_endian32(size);
+  bcache_put(buf, 1);
+
+  /* ...and the rest of the blocks, taking the longest free runs. */
+  r = VFS_OK;
+  while(numblocks > 0) {
+    n = efs_bitmap_find(efs, numblocks, &start);
+    if(n <= 0) {
+      /* Disk full, or an error occured. */
+      r = VFS_ERROR;
+      break;
+    }
+
+    if(efs_bitmap_mark(efs, start, n, 1) != VFS_OK) {
+      r = VFS_ERROR;
+      break;
+    }
+    if(efs_inode_append(efs, inode, start, n) != VFS_OK) {
+      efs_bitmap_mark(efs, start, n, 0);
+      r = VFS_ERROR;
+      break;
+    }
+    if(efs_zero(efs, start, n) != VFS_OK) {
+      r = VFS_ERROR;
+      break;
+    }
+    numblocks -= n;
+  }
+
+  if(r == VFS_OK) {
+    buf = efs_dir_get(efs, sector);
+    if(buf == NULL) {
+      r = VFS_ERROR;
+    } else {
+      dir = &((efs_direntry_t *)buf->data)[index];
+      dir->inode = to_big_endian32(inode);
+      stringcopy(dir->name, filename, EFS_FILENAME_MAX);
+      bcache_put(buf, 1);
+    }
+  }
+
+  if(r != VFS_OK) {
+    /* Give the blocks back, leaving the disk as it was. */
+    efs_inode_free(efs, inode);
+  }
+
+  semaphore_V(efs->lock);
+  return r;
+}
+
+
+/**
+ * Removes given file. Implements fs.remove(). Frees blocks allocated
+ * for the file and directory entry.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param filename file to be removed.
+ *
+ * @return VFS_OK if file succesfully removed. If file not found
+ * VFS_NOT_FOUND.
+ */
+int efs_remove(fs_t *fs, char *filename)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  bcache_buf_t *buf;
+  efs_direntry_t *dir;
+  semaphore_t *lock;
+  uint32_t sector, inode;
+  int index, r;
+
+  semaphore_P(efs->lock);
+
+  r = efs_lookup(efs, filename, &sector, &index);
+  if(r != VFS_OK) {
+    semaphore_V(efs->lock);
+    return r;
+  }
+
+  buf = efs_dir_get(efs, sector);
+  if(buf == NULL) {
+    semaphore_V(efs->lock);
+    return VFS_ERROR;
+  }
+  dir = &((efs_direntry_t *)buf->data)[index];
+  inode = from_big_endian32(dir->inode);
+
+  /* Holding the inode lock waits for writes to the file to finish. */
+  lock = efs_inode_lock(efs, inode);
+  semaphore_P(lock);
+
+  r = efs_inode_free(efs, inode);
+  if(r == VFS_OK) {
+    /* Free directory entry. */
+    dir->inode   = 0;
+    dir->name[0] = 0;
+  }
+
+  semaphore_V(lock);
+  bcache_put(buf, r == VFS_OK);
+  semaphore_V(efs->lock);
+  return r;
+}
+
+
+/**
+ * Reads at most bufsize bytes from file to the buffer starting from
+ * the offset. bufsize bytes is always read if possible. Returns
+ * number of bytes read. Buffer size must be atleast bufsize.
+ * Implements fs.read(). The buffer must be a kernel address, because
+ * whole sectors are read into it by the disk driver.
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param buffer Pointer to the buffer the data is read into.
+ * @param bufsize Maximum number of bytes to be read.
+ * @param offset Start position of reading.
+ *
+ * @return Number of bytes read into buffer, or VFS_ERROR if error
+ * occured.
+ */
+int efs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  uint32_t filesize;
+
+  if(!efs_valid_inode(efs, fileid))
+    return VFS_ERROR;
+
+  if(efs_inode_size(efs, fileid, &filesize, NULL) != VFS_OK)
+    return VFS_ERROR;
+
+  /* Check that offset is inside the file */
+  if(offset < 0 || offset > (int)filesize)
+    return VFS_ERROR;
+
+  /* Read at most what is left from the file. */
+  bufsize = MIN(bufsize, (int)filesize - offset);
+  if(bufsize <= 0)
+    return 0;
+
+  if(efs_transfer(efs, fileid, buffer, bufsize, offset, 0) != VFS_OK)
+    return VFS_ERROR;
+
+  return bufsize;
+}
+
+/**
+ * Starts reading the sectors of a file range into the block cache in
+ * the background, so that later reads of the range find them cached.
+ * The range is clamped to the file. Implements fs.readahead().
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param offset Start of the range.
+ * @param length Length of the range in bytes.
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+int efs_readahead(fs_t *fs, int fileid, int offset, int length)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  uint32_t filesize, block, run, sector, sectors;
+  int n;
+
+  if(!efs_valid_inode(efs, fileid) || offset < 0)
+    return VFS_ERROR;
+
+  if(efs_inode_size(efs, fileid, &filesize, NULL) != VFS_OK)
+    return VFS_ERROR;
+
+  length = MIN(length, (int)filesize - offset);
+  while(length > 0) {
+    if(efs_map(efs, fileid, offset / EFS_BLOCK_SIZE, &block, &run)
+       != VFS_OK)
+      return VFS_ERROR;
+
+    /* Prefetch the sectors of the run which are in the range. */
+    sector = efs_sector(efs, block,
+                        (offset % EFS_BLOCK_SIZE) / EFS_SECTOR_SIZE);
+    sectors = run * EFS_SECTORS_PER_BLOCK
+      - (offset % EFS_BLOCK_SIZE) / EFS_SECTOR_SIZE;
+    for(; sectors > 0 && length > 0; sectors--) {
+      bcache_prefetch(efs->disk, sector++);
+      n = EFS_SECTOR_SIZE - offset % EFS_SECTOR_SIZE;
+      offset += n;
+      length -= n;
+    }
+  }
+
+  return VFS_OK;
+}
+
+
+/**
+ * Write at most datasize bytes from buffer to the file starting from
+ * the offset. datasize bytes is always written if possible. Returns
+ * number of bytes written. Buffer size must be atleast datasize.
+ * Implements fs.write().
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param buffer Pointer to the buffer the data is written from.
+ * @param datasize Maximum number of bytes to be written.
+ * @param offset Start position of writing.
+ *
+ * @return Number of bytes written into buffer, or VFS_ERROR if error
+ * occured.
+ */
+int efs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  semaphore_t *lock;
+  uint32_t filesize;
+  int r;
+
+  if(!efs_valid_inode(efs, fileid))
+    return VFS_ERROR;
+
+  if(efs_inode_size(efs, fileid, &filesize, NULL) != VFS_OK)
+    return VFS_ERROR;
+
+  /* check that start position is inside the file */
+  if(offset < 0 || offset > (int)filesize)
+    return VFS_ERROR;
+
+  /* write at most the number of bytes left in the file */
+  datasize = MIN(datasize, (int)filesize - offset);
+  if(datasize <= 0)
+    return 0;
+
+  lock = efs_inode_lock(efs, fileid);
+  semaphore_P(lock);
+  r = efs_transfer(efs, fileid, buffer, datasize, offset, 1);
+  semaphore_V(lock);
+
+  if(r != VFS_OK)
+    return VFS_ERROR;
+  return datasize;
+}
+
+/**
+ * Get number of free bytes on the disk. Implements fs.getfree().
+ * Counts the zeros in the allocation bitmap and multiplies the result
+ * by the block size.
+ *
+ * @param fs Pointer to the fs data structure of the device.
+ *
+ * @return Number of free bytes, at most EFS_MAX_FILESIZE.
+ */
+int efs_getfree(fs_t *fs)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  bcache_buf_t *buf = NULL;
+  uint8_t *bits = NULL;
+  uint32_t b, bit;
+  uint32_t freeblocks = 0;
+
+  semaphore_P(efs->lock);
+
+  for(b = 0; b < efs->totalblocks; b++) {
+    bit = b % EFS_BITS_PER_SECTOR;
+    if(bit == 0) {
+      if(buf != NULL)
+        bcache_put(buf, 0);
+      buf = bcache_get(efs->disk,
+                       efs_sector(efs, EFS_BITMAP_BLOCK, 0)
+                       + b / EFS_BITS_PER_SECTOR);
+      if(buf == NULL) {
+        semaphore_V(efs->lock);
+        return VFS_ERROR;
+      }
+      bits = (uint8_t *)buf->data;
+    }
+
+    if(!(bits[bit / 8] & (1 << (bit % 8))))
+      freeblocks++;
+  }
+
+  if(buf != NULL)
+    bcache_put(buf, 0);
+  semaphore_V(efs->lock);
+
+  if(freeblocks > EFS_MAX_FILESIZE / EFS_BLOCK_SIZE)
+    return EFS_MAX_FILESIZE;
+  return freeblocks * EFS_BLOCK_SIZE;
+}
+
+/**
+ * Finds a file of the directory by its index among the files. Must
+ * be called with efs->lock held.
+ *
+ * @param efs The filesystem
+ * @param idx Index of the file, or -1 to count the files
+ * @param buffer Where to store the name of the file, or NULL
+ *
+ * @return The number of files if idx is -1, otherwise VFS_OK, or
+ * VFS_ERROR if there is no such file or error occured.
+ */
+static int efs_dir_scan(efs_t *efs, int idx, char *buffer)
+{
+  bcache_buf_t *buf;
+  efs_direntry_t *dir;
+  uint32_t n, filesize;
+  int i, count = 0;
+
+  if(efs_inode_size(efs, efs->directory, &filesize, NULL) != VFS_OK)
+    return VFS_ERROR;
+
+  for(n = 0; n < filesize / EFS_SECTOR_SIZE; n++) {
+    buf = efs_dir_get(efs, n);
+    if(buf == NULL)
+      return VFS_ERROR;
+
+    dir = (efs_direntry_t *)buf->data;
+    for(i = 0; i < (int)EFS_DIRENTRIES_PER_SECTOR; i++) {
+      if(dir[i].inode != 0 && count++ == idx) {
+        stringcopy(buffer, dir[i].name, EFS_FILENAME_MAX);
+        bcache_put(buf, 0);
+        return VFS_OK;
+      }
+    }
+
+    bcache_put(buf, 0);
+  }
+
+  return (idx == -1) ? count : VFS_ERROR;
+}
+
+/* Get the count of files in the directory if it exists (ie. only the
+ * master directory is accepted. */
+int efs_filecount(fs_t *fs, char *dirname)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  int r;
+
+  if (stringcmp(dirname, "/") != 0)
+    return VFS_NOT_FOUND;
+
+  semaphore_P(efs->lock);
+  r = efs_dir_scan(efs, -1, NULL);
+  semaphore_V(efs->lock);
+  return r;
+}
+
+/* Get the name of the file with index idx in the directory dirname.
+ * There is only one directory in efs, so we check that dirname == "/". */
+int efs_file(fs_t *fs, char *dirname, int idx, char *buffer)
+{
+  efs_t *efs = (efs_t *)fs->internal;
+  int r;
+
+  if (stringcmp(dirname, "/") != 0 || idx < 0)
+    return VFS_ERROR;
+
+  semaphore_P(efs->lock);
+  r = efs_dir_scan(efs, idx, buffer);
+  semaphore_V(efs->lock);
+  return r;
+}
+
+/** @} */
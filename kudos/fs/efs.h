@@ -0,0 +1,30 @@
+/*
+ * Extent Filesystem (EFS).
+ */
+
+#ifndef KUDOS_FS_EFS_H
+#define KUDOS_FS_EFS_H
+
+#include "fs/efs_constants.h"
+
+#include "drivers/gbd.h"
+#include "fs/vfs.h"
+#include "lib/libc.h"
+
+/* functions */
+fs_t * efs_init(gbd_t *disk, uint32_t sector);
+
+int efs_unmount(fs_t *fs);
+int efs_open(fs_t *fs, char *filename);
+int efs_reopen(fs_t *fs, int fileid);
+int efs_close(fs_t *fs, int fileid);
+int efs_create(fs_t *fs, char *filename, int size);
+int efs_remove(fs_t *fs, char *filename);
+int efs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset);
+int efs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset);
+int efs_readahead(fs_t *fs, int fileid, int offset, int length);
+int efs_getfree(fs_t *fs);
+int efs_filecount(fs_t *fs, char *dirname);
+int efs_file(fs_t *fs, char *dirname, int idx, char *buffer);
+
+#endif // KUDOS_FS_EFS_H
@@ -0,0 +1,93 @@
+/*
+ * Extent Filesystem (EFS).
+ */
+
+/*
+ * This file defines the EFS disk format. Like tfs_constants.h, it
+ * can also be imported by host (Linux) userspace, because tfstool
+ * handles EFS volumes too.
+ */
+
+#ifndef KUDOS_FS_EFS_CONSTANTS_H
+#define KUDOS_FS_EFS_CONSTANTS_H
+
+/* EFS allocates space in 4 KiB blocks, which are read and written as
+   512-byte disk sectors. All integers on the disk are big-endian. */
+#define EFS_BLOCK_SIZE 4096
+#define EFS_SECTOR_SIZE 512
+#define EFS_SECTORS_PER_BLOCK (EFS_BLOCK_SIZE/EFS_SECTOR_SIZE)
+
+/* Magic number found on each efs filesystem's header block. */
+#define EFS_MAGIC 0x45465331
+
+/* Block numbers of system blocks. The allocation bitmap starts at
+   block 1 and is followed by the inode of the directory. */
+#define EFS_HEADER_BLOCK 0
+#define EFS_BITMAP_BLOCK 1
+
+/* Number of blocks one bitmap block keeps track of. */
+#define EFS_BITS_PER_BLOCK (8*EFS_BLOCK_SIZE)
+
+/* Names are limited to 16 (volumes) and 28 (files) characters */
+#define EFS_VOLNAME_MAX 16
+#define EFS_FILENAME_MAX 28
+
+/* The header, at the start of the header block. */
+typedef struct {
+  uint32_t magic;
+
+  /* Size of the volume in blocks */
+  uint32_t totalblocks;
+
+  /* Number of allocation bitmap blocks. Bit n of the bitmap (bit n%8
+     of byte n/8) is set if block n is in use. */
+  uint32_t bitmapblocks;
+
+  /* Inode block number of the directory */
+  uint32_t directory;
+
+  char     volname[EFS_VOLNAME_MAX];
+} efs_header_t;
+
+/* A run of consecutive blocks. */
+typedef struct {
+  uint32_t start;
+  uint32_t length;
+} efs_extent_t;
+
+/* Maximum number of extents in one inode. */
+#define EFS_EXTENTS_MAX ((EFS_BLOCK_SIZE - 8)/sizeof(efs_extent_t))
+
+/* Maximum file size. File offsets are signed 32-bit integers. */
+#define EFS_MAX_FILESIZE 0x7fffffff
+
+/* File inode block. The blocks of a file are the blocks of its
+   extents, in order. An extent is never split across disk sectors. */
+typedef struct {
+  /* filesize in bytes */
+  uint32_t filesize;
+
+  /* number of extents used */
+  uint32_t extents;
+
+  efs_extent_t extent[EFS_EXTENTS_MAX];
+} efs_inode_t;
+
+/* Directory entry. The directory is stored like a file, and grows
+   by a block when it is full. If inode is zero, entry is unused
+   (free). */
+typedef struct {
+  /* File's inode block number. */
+  uint32_t inode;
+
+  /* File name */
+  char     name[EFS_FILENAME_MAX];
+} efs_direntry_t;
+
+#define EFS_DIRENTRIES_PER_SECTOR (EFS_SECTOR_SIZE/sizeof(efs_direntry_t))
+
+/* Number of extents in one sector of an inode. The first sector also
+   holds the file size and the extent count. */
+#define EFS_EXTENTS_PER_SECTOR (EFS_SECTOR_SIZE/sizeof(efs_extent_t))
+
+#endif // KUDOS_FS_EFS_CONSTANTS_H
@@ -4,6 +4,7 @@
 
 #include "fs/filesystems.h"
 #include "fs/tfs.h"
+#include "fs/efs.h"
 #include "drivers/device.h"
 
 /* Structure of a partition */
@@ -33,6 +34,7 @@ typedef struct boot_sector
 
 static filesystems_t filesystems[] = {
   {"TFS", &tfs_init},
+  {"EFS", &efs_init},
   { NULL, NULL} /* Last entry must be a NULL pair. */
 };
 
@@ -4,27 +4,56 @@
 
 #include "kernel/stalloc.h"
 #include "kernel/assert.h"
+#include "kernel/config.h"
 #include "vm/memory.h"
 #include "drivers/gbd.h"
 #include "fs/vfs.h"
 #include "fs/tfs.h"
 #include "lib/libc.h"
 #include "lib/bitmap.h"
+#include "fs/bcache.h"
 
 /**@name Trivial Filesystem (TFS)
  *
  * This module contains implementation for TFS.
  *
+ * Operations on different files run in parallel. The directory
+ * block, the allocation block and the inode cache each have a lock,
+ * and writes to a file hold the lock of its inode. Blocks are used
+ * in place in the block cache, so no buffers are shared between
+ * operations.
+ *
  * @{
  */
 
 
+/* Number of decoded inodes cached per filesystem. A thread uses at
+   most one slot at a time, so there is always a slot to replace. */
+#define TFS_INODE_CACHE_SIZE CONFIG_MAX_THREADS
+
+/* Number of inode locks per filesystem. Inodes share the locks by
+   their number. */
+#define TFS_INODE_LOCKS 8
+
+/* An inode decoded to host byte order. It is kept while the file is
+   open, and afterwards until the slot is needed for another file. */
+typedef struct {
+  /* Inode block number (fileid) of the file, 0 if the slot is unused */
+  uint32_t inode;
+  /* Number of times the file is open */
+  int      opens;
+  /* Number of operations using the slot; it is not replaced before
+     they are done */
+  int      refs;
+
+  uint32_t filesize;
+  uint32_t block[TFS_BLOCKS_MAX];
+} tfs_cached_inode_t;
+
 /* Data structure used internally by TFS filesystem. This data structure
-   is used by tfs-functions. it is initialized during tfs_init(). Also
-   memory for the buffers is reserved _dynamically_ during init.
+   is used by tfs-functions. it is initialized during tfs_init().
 
-   Buffers are used when reading/writing system or data blocks from/to
-   disk.
+   The locks are taken in the order they are listed here.
 */
 typedef struct {
   /* Total number of blocks of the disk */
@@ -34,21 +63,274 @@ typedef struct {
   /* Pointer to gbd device performing tfs */
   gbd_t          *disk;
 
-  /* lock for mutual exclusion of fs-operations (we support only
-     one operation at a time in any case) */
-  semaphore_t    *lock;
-
-  /* Buffers for read/write operations on disk. */
-  tfs_inode_t    *buffer_inode;   /* buffer for inode blocks */
-  bitmap_t       *buffer_bat;     /* buffer for allocation block */
-  tfs_direntry_t *buffer_md;      /* buffer for directory block */
+  /* lock for the directory block */
+  semaphore_t    *md_lock;
+  /* lock for the allocation block */
+  semaphore_t    *bat_lock;
+  /* locks for writing files, see tfs_inode_lock() */
+  semaphore_t    *inode_locks[TFS_INODE_LOCKS];
+  /* lock for the inode cache */
+  semaphore_t    *icache_lock;
+
+  /* Inode cache */
+  tfs_cached_inode_t *inodes;
+  int            inode_hand;      /* slot that was replaced last */
 } tfs_t;
 
+/**
+ * Returns the lock which serializes writing and removing a file.
+ *
+ * @param tfs The filesystem
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return The lock
+ */
+static semaphore_t *tfs_inode_lock(tfs_t *tfs, uint32_t fileid)
+{
+  return tfs->inode_locks[fileid % TFS_INODE_LOCKS];
+}
+
+/**
+ * Finds the cached inode of a file. Must be called with
+ * tfs->icache_lock held.
+ *
+ * @param tfs The filesystem
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return The cached inode, or NULL if it is not cached.
+ */
+static tfs_cached_inode_t *tfs_inode_find(tfs_t *tfs, uint32_t fileid)
+{
+  int i;
+
+  for(i = 0; i < TFS_INODE_CACHE_SIZE; i++) {
+    if(tfs->inodes[i].inode == fileid)
+      return &tfs->inodes[i];
+  }
+
+  return NULL;
+}
+
+/**
+ * Gets the inode of a file, reading and decoding it if it is not
+ * cached. The inode must be released with tfs_inode_put().
+ *
+ * @param tfs The filesystem
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return The cached inode, or NULL if it could not be read.
+ */
+static tfs_cached_inode_t *tfs_inode_get(tfs_t *tfs, uint32_t fileid)
+{
+  tfs_cached_inode_t *inode;
+  tfs_inode_t *ondisk;
+  bcache_buf_t *buf;
+  int i, slot = -1;
+
+  semaphore_P(tfs->icache_lock);
+
+  inode = tfs_inode_find(tfs, fileid);
+  if(inode == NULL) {
+    /* Replace a slot which is not in use, preferring the slots of
+       closed files. */
+    for(i = 0; i < TFS_INODE_CACHE_SIZE; i++) {
+      tfs->inode_hand = (tfs->inode_hand + 1) % TFS_INODE_CACHE_SIZE;
+      if(tfs->inodes[tfs->inode_hand].refs == 0) {
+        slot = tfs->inode_hand;
+        if(tfs->inodes[slot].opens == 0)
+          break;
+      }
+    }
+    KERNEL_ASSERT(slot >= 0);
+    inode = &tfs->inodes[slot];
+
+    inode->inode = 0;
+    inode->opens = 0;
+    buf = bcache_get(tfs->disk, tfs->startblock + fileid);
+    if(buf == NULL) {
+      semaphore_V(tfs->icache_lock);
+      return NULL;
+    }
+
+    ondisk = (tfs_inode_t *)buf->data;
+    inode->filesize = from_big_endian32(ondisk->filesize);
+    for(i = 0; i < (int)TFS_BLOCKS_MAX; i++)
+      inode->block[i] = from_big_endian32(ondisk->block[i]);
+    bcache_put(buf, 0);
+    inode->inode = fileid;
+  }
+
+  inode->refs++;
+  semaphore_V(tfs->icache_lock);
+  return inode;
+}
+
+/**
+ * Releases an inode got with tfs_inode_get().
+ *
+ * @param tfs The filesystem
+ * @param inode The cached inode
+ */
+static void tfs_inode_put(tfs_t *tfs, tfs_cached_inode_t *inode)
+{
+  semaphore_P(tfs->icache_lock);
+  KERNEL_ASSERT(inode->refs > 0);
+  inode->refs--;
+  semaphore_V(tfs->icache_lock);
+}
+
+/**
+ * Drops a file from the inode cache, after its inode changed on the
+ * disk. Operations still using the old inode may finish.
+ *
+ * @param tfs The filesystem
+ * @param fileid File id (inode block number) of the file.
+ */
+static void tfs_inode_drop(tfs_t *tfs, uint32_t fileid)
+{
+  tfs_cached_inode_t *inode;
+
+  semaphore_P(tfs->icache_lock);
+
+  inode = tfs_inode_find(tfs, fileid);
+  if(inode != NULL) {
+    inode->inode = 0;
+    inode->opens = 0;
+  }
+
+  semaphore_V(tfs->icache_lock);
+}
+
+/**
+ * Destroys the locks of a filesystem. The locks not created yet must
+ * be NULL.
+ *
+ * @param tfs The filesystem
+ */
+static void tfs_destroy_locks(tfs_t *tfs)
+{
+  int i;
+
+  if(tfs->md_lock != NULL)
+    semaphore_destroy(tfs->md_lock);
+  if(tfs->bat_lock != NULL)
+    semaphore_destroy(tfs->bat_lock);
+  for(i = 0; i < TFS_INODE_LOCKS; i++) {
+    if(tfs->inode_locks[i] != NULL)
+      semaphore_destroy(tfs->inode_locks[i]);
+  }
+  if(tfs->icache_lock != NULL)
+    semaphore_destroy(tfs->icache_lock);
+}
+
+/**
+ * Creates the locks of a filesystem.
+ *
+ * @param tfs The filesystem
+ *
+ * @return 1 on success, 0 if there were not enough semaphores.
+ */
+static int tfs_create_locks(tfs_t *tfs)
+{
+  int i;
+
+  tfs->md_lock = semaphore_create(1);
+  tfs->bat_lock = semaphore_create(1);
+  tfs->icache_lock = semaphore_create(1);
+  for(i = 0; i < TFS_INODE_LOCKS; i++)
+    tfs->inode_locks[i] = semaphore_create(1);
+
+  if(tfs->md_lock == NULL || tfs->bat_lock == NULL ||
+     tfs->icache_lock == NULL) {
+    tfs_destroy_locks(tfs);
+    return 0;
+  }
+  for(i = 0; i < TFS_INODE_LOCKS; i++) {
+    if(tfs->inode_locks[i] == NULL) {
+      tfs_destroy_locks(tfs);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Finds the free run of blocks to allocate a file from: the smallest
+ * run of at least count blocks (best fit), or the largest run if no
+ * run is large enough. Must be called with tfs->bat_lock held.
+ *
+ * @param tfs The filesystem
+ * @param bat The allocation block
+ * @param count Number of blocks wanted
+ * @param start Where to store the first block of the run
+ *
+ * @return Length of the run, 0 if there are no free blocks.
+ */
+static uint32_t tfs_find_run(tfs_t *tfs, bitmap_t *bat, uint32_t count,
+                             uint32_t *start)
+{
+  uint32_t i, run = 0, best = 0;
+  uint32_t largest = 0, largest_start = 0;
+
+  for(i = 0; i <= tfs->totalblocks && best != count; i++) {
+    if(i < tfs->totalblocks && bitmap_get(bat, i) == 0) {
+      run++;
+      continue;
+    }
+
+    if(run >= count) {
+      if(best == 0 || run < best) {
+        best = run;
+        *start = i - run;
+      }
+    } else if(run > largest) {
+      largest = run;
+      largest_start = i - run;
+    }
+    run = 0;
+  }
+
+  if(best == 0) {
+    best = largest;
+    *start = largest_start;
+  }
+  return best;
+}
+
+/**
+ * Allocates the next block of a file. The blocks are taken from one
+ * free run while it lasts, and the next run is chosen with
+ * tfs_find_run(), so the blocks of a file are contiguous when
+ * possible. Must be called with tfs->bat_lock held.
+ *
+ * @param tfs The filesystem
+ * @param bat The allocation block
+ * @param count Number of blocks the file still needs, including this
+ * @param next The next block of the current run
+ * @param left Number of blocks left in the current run, 0 initially
+ *
+ * @return The block number, or -1 if the disk is full.
+ */
+static int tfs_alloc_block(tfs_t *tfs, bitmap_t *bat, uint32_t count,
+                           uint32_t *next, uint32_t *left)
+{
+  if(*left == 0) {
+    *left = tfs_find_run(tfs, bat, count, next);
+    if(*left == 0)
+      return -1;
+  }
+
+  bitmap_set(bat, *next, 1);
+  (*left)--;
+  return (*next)++;
+}
+
 /**
  * Initialize trivial filesystem. Allocates 1 page of memory dynamically for
- * filesystem data structure, tfs data structure and buffers needed.
- * Sets fs_t and tfs_t fields. If initialization is succesful, returns
- * pointer to fs_t data structure. Else NULL pointer is returned.
+ * filesystem data structure and tfs data structure, and memory for the
+ * inode cache. Sets fs_t and tfs_t fields. If initialization is succesful,
+ * returns pointer to fs_t data structure. Else NULL pointer is returned.
  *
  * @param Pointer to gbd-device performing tfs.
  *
@@ -64,29 +346,22 @@ fs_t * tfs_init(gbd_t *disk, uint32_t sector)
   fs_t *fs;
   tfs_t *tfs;
   int r;
-  semaphore_t *sem;
+  tfs_cached_inode_t *inodes;
 
   if(disk->block_size(disk) != TFS_BLOCK_SIZE)
     return NULL;
 
-  /* check semaphore availability before memory allocation */
-  sem = semaphore_create(1);
-  if (sem == NULL) {
-    kprintf("tfs_init: could not create a new semaphore.\n");
-    return NULL;
-  }
-
   addr = kmalloc(4096);
 
   if(addr == 0) {
-    semaphore_destroy(sem);
     kprintf("tfs_init: could not allocate memory.\n");
     return NULL;
   }
   addr = ADDR_PHYS_TO_KERNEL(addr);      /* transform to vm address */
 
   /* Assert that one page is enough */
-  KERNEL_ASSERT(PAGE_SIZE >= (3*TFS_BLOCK_SIZE+sizeof(tfs_t)+sizeof(fs_t)));
+  KERNEL_ASSERT(PAGE_SIZE >= TFS_BLOCK_SIZE &&
+                PAGE_SIZE >= sizeof(tfs_t)+sizeof(fs_t));
 
   /* Read header block, and make sure this is tfs drive */
   req.block = sector + TFS_HEADER_BLOCK;
@@ -95,7 +370,6 @@ fs_t * tfs_init(gbd_t *disk, uint32_t sector)
 
   r = disk->read_block(disk, &req);
   if(r == 0) {
-    semaphore_destroy(sem);
     //NEED kfree function here
     //physmem_freeblock((physaddr_t*)ADDR_KERNEL_TO_PHYS(addr));
     kprintf("tfs_init: Error during disk read. Initialization failed.\n");
@@ -106,7 +380,6 @@ fs_t * tfs_init(gbd_t *disk, uint32_t sector)
   magic = from_big_endian32((*(uintptr_t*)addr));
 
   if(magic != TFS_MAGIC) {
-    semaphore_destroy(sem);
     //NEED kfree function here
     //physmem_freeblock((physaddr_t*)ADDR_KERNEL_TO_PHYS(addr));
     return NULL;
@@ -115,34 +388,45 @@ fs_t * tfs_init(gbd_t *disk, uint32_t sector)
   /* Copy volume name from header block. */
   stringcopy(name, (char *)(addr+4), TFS_VOLNAME_MAX);
 
-  /* fs_t, tfs_t and all buffers in tfs_t fit in one page, so obtain
-     addresses for each structure and buffer inside the allocated
-     memory page. */
+  /* fs_t and tfs_t fit in one page, so obtain addresses for each
+     structure inside the allocated memory page. */
   fs  = (fs_t *)addr;
   tfs = (tfs_t *)(addr + sizeof(fs_t));
-  tfs->buffer_inode = (tfs_inode_t *)(uintptr_t)((uintptr_t)tfs + sizeof(tfs_t));
-  tfs->buffer_bat  = (bitmap_t *)(uintptr_t)((uintptr_t)tfs->buffer_inode +
-                                          TFS_BLOCK_SIZE);
-  tfs->buffer_md   = (tfs_direntry_t *)((uintptr_t)tfs->buffer_bat +
-                                        TFS_BLOCK_SIZE);
+  memoryset(tfs, 0, sizeof(tfs_t));
+
+  if(!tfs_create_locks(tfs)) {
+    kprintf("tfs_init: could not create new semaphores.\n");
+    return NULL;
+  }
+
+  /* This is a TFS volume, so allocate its inode cache. */
+  inodes = kmalloc(TFS_INODE_CACHE_SIZE * sizeof(tfs_cached_inode_t));
+  if(inodes == NULL) {
+    tfs_destroy_locks(tfs);
+    kprintf("tfs_init: could not allocate memory.\n");
+    return NULL;
+  }
 
   tfs->startblock  = sector;
   tfs->totalblocks = MIN(disk->total_blocks(disk), 8*TFS_BLOCK_SIZE);
   tfs->disk        = disk;
 
-  /* save the semaphore to the tfs_t */
-  tfs->lock = sem;
+  memoryset(inodes, 0, TFS_INODE_CACHE_SIZE * sizeof(tfs_cached_inode_t));
+  tfs->inodes = inodes;
+  tfs->inode_hand = 0;
 
   fs->internal = (void *)tfs;
   stringcopy(fs->volume_name, name, VFS_NAME_LENGTH);
 
   fs->unmount = tfs_unmount;
   fs->open    = tfs_open;
+  fs->reopen  = tfs_reopen;
   fs->close   = tfs_close;
   fs->create  = tfs_create;
   fs->remove  = tfs_remove;
   fs->read    = tfs_read;
   fs->write   = tfs_write;
+  fs->readahead = tfs_readahead;
   fs->getfree  = tfs_getfree;
   fs->filecount = tfs_filecount;
   fs->file      = tfs_file;
@@ -154,8 +438,8 @@ fs_t * tfs_init(gbd_t *disk, uint32_t sector)
 /**
  * Unmounts tfs filesystem from gbd device. After this TFS-driver and
  * gbd-device are no longer linked together. Implements
- * fs.unmount(). Waits for the current operation(s) to finish, frees
- * reserved memory and returns OK.
+ * fs.unmount(). Waits for the current operation(s) to finish, writes
+ * cached blocks to the disk, frees reserved memory and returns OK.
  *
  * @param fs Pointer to fs data structure of the device.
  *
@@ -167,11 +451,16 @@ int tfs_unmount(fs_t *fs)
 
   tfs = (tfs_t *)fs->internal;
 
-  semaphore_P(tfs->lock); /* The semaphore should be free at this
-                             point, we get it just in case something has gone wrong. */
+  /* The locks should be free at this point, we get them just in case
+     something has gone wrong. */
+  semaphore_P(tfs->md_lock);
+  semaphore_P(tfs->bat_lock);
 
-  /* free semaphore and allocated memory */
-  semaphore_destroy(tfs->lock);
+  /* write cached blocks back to the disk */
+  bcache_invalidate(tfs->disk);
+
+  /* free semaphores and allocated memory */
+  tfs_destroy_locks(tfs);
   //NEED kfree function here
   //physmem_freeblock((void*)(uintptr_t)ADDR_KERNEL_TO_PHYS((uintptr_t)fs));
   return VFS_OK;
@@ -192,40 +481,86 @@ int tfs_unmount(fs_t *fs)
 int tfs_open(fs_t *fs, char *filename)
 {
   tfs_t *tfs;
-  gbd_request_t req;
+  tfs_cached_inode_t *inode;
+  tfs_direntry_t *dir;
+  bcache_buf_t *md;
   uint32_t i;
-  int r;
+  int fileid = VFS_NOT_FOUND;
 
   tfs = (tfs_t *)fs->internal;
 
-  semaphore_P(tfs->lock);
+  semaphore_P(tfs->md_lock);
 
-  req.block     = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf       = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem       = NULL;
-  r = tfs->disk->read_block(tfs->disk,&req);
-  if(r == 0) {
+  md = bcache_get(tfs->disk, tfs->startblock + TFS_DIRECTORY_BLOCK);
+  if(md == NULL) {
     /* An error occured during read. */
     kprintf("tfs_open: read error at block 0x%x\n", TFS_DIRECTORY_BLOCK);
-    semaphore_V(tfs->lock);
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
+  dir = (tfs_direntry_t *)md->data;
   for(i=0;i < TFS_MAX_FILES;i++) {
-    if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-      semaphore_V(tfs->lock);
-      return from_big_endian32(tfs->buffer_md[i].inode);
+    if(stringcmp(dir[i].name, filename) == 0) {
+      /* Keep the inode cached while the file is open. The directory
+         is still locked, so the file cannot be removed meanwhile. */
+      fileid = from_big_endian32(dir[i].inode);
+      inode = tfs_inode_get(tfs, fileid);
+      if(inode == NULL) {
+        fileid = VFS_ERROR;
+      } else {
+        semaphore_P(tfs->icache_lock);
+        inode->opens++;
+        semaphore_V(tfs->icache_lock);
+        tfs_inode_put(tfs, inode);
+      }
+      break;
     }
   }
-  kprintf("tfs_open: file not found\n");
-  semaphore_V(tfs->lock);
-  return VFS_NOT_FOUND;
+
+  bcache_put(md, 0);
+  semaphore_V(tfs->md_lock);
+
+  if(fileid == VFS_NOT_FOUND)
+    kprintf("tfs_open: file not found\n");
+  return fileid;
+}
+
+
+/**
+ * Opens a file again by the file id which tfs_open() returned for it
+ * earlier, without searching the directory. Implements fs.reopen().
+ * The caller makes sure that the file has not been removed since.
+ *
+ * @param fs Pointer to fs data structure of the device.
+ * @param fileid File id (inode block number) of the file.
+ *
+ * @return fileid, or a negative error code.
+ */
+int tfs_reopen(fs_t *fs, int fileid)
+{
+  tfs_t *tfs = (tfs_t *)fs->internal;
+  tfs_cached_inode_t *inode;
+
+  if(fileid <= TFS_DIRECTORY_BLOCK || (uint32_t)fileid >= tfs->totalblocks)
+    return VFS_INVALID_PARAMS;
+
+  inode = tfs_inode_get(tfs, fileid);
+  if(inode == NULL)
+    return VFS_ERROR;
+
+  semaphore_P(tfs->icache_lock);
+  inode->opens++;
+  semaphore_V(tfs->icache_lock);
+  tfs_inode_put(tfs, inode);
+
+  return fileid;
 }
 
 
 /**
- * Closes file. Implements fs.close(). There is nothing to be done, no
- * data strucutures or similar are reserved for file. Returns VFS_OK.
+ * Closes file. Implements fs.close(). The cached inode of the file may
+ * be replaced after the last close. Returns VFS_OK.
  *
  * @param fs Pointer to fs data structure of the device.
  * @param fileid File id (inode block number) of the file.
@@ -234,9 +569,16 @@ int tfs_open(fs_t *fs, char *filename)
  */
 int tfs_close(fs_t *fs, int fileid)
 {
-  fs = fs;
-  fileid = fileid;
+  tfs_t *tfs = (tfs_t *)fs->internal;
+  tfs_cached_inode_t *inode;
+
+  semaphore_P(tfs->icache_lock);
+
+  inode = tfs_inode_find(tfs, fileid);
+  if(inode != NULL && inode->opens > 0)
+    inode->opens--;
 
+  semaphore_V(tfs->icache_lock);
   return VFS_OK;
 }
 
@@ -245,7 +587,8 @@ int tfs_close(fs_t *fs, int fileid)
  * Creates file of given size. Implements fs.create(). Checks that
  * file name doesn't allready exist in directory block.Allocates
  * enough blocks from the allocation block for the file (1 for inode
- * and then enough for the file of given size). Reserved blocks are zeroed.
+ * and then enough for the file of given size), in one contiguous run
+ * if a free run is large enough. Reserved blocks are zeroed.
  *
  * @param fs Pointer to fs data structure of the device.
  * @param filename File name of the file to be created
@@ -257,38 +600,38 @@ int tfs_close(fs_t *fs, int fileid)
 int tfs_create(fs_t *fs, char *filename, int size)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
-  gbd_request_t req;
-  uint32_t i;
+  bcache_buf_t *md, *bat, *ib, *buf;
+  tfs_direntry_t *dir;
+  tfs_inode_t *inode;
+  uint32_t i, next, left = 0;
   uint32_t numblocks = (size + TFS_BLOCK_SIZE - 1)/TFS_BLOCK_SIZE;
   int index = -1;
-  int r;
-
-  semaphore_P(tfs->lock);
+  int fileid, block;
+  int r = VFS_OK;
 
-  if(numblocks > (TFS_BLOCK_SIZE / 4 - 1)) {
-    semaphore_V(tfs->lock);
+  if(numblocks > TFS_BLOCKS_MAX)
     return VFS_ERROR;
-  }
+
+  semaphore_P(tfs->md_lock);
 
   /* Read directory block. Check that file doesn't allready exist and
      there is space left for the file in directory block. */
-  req.block = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
+  md = bcache_get(tfs->disk, tfs->startblock + TFS_DIRECTORY_BLOCK);
+  if(md == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
+  dir = (tfs_direntry_t *)md->data;
   for(i=0;i<TFS_MAX_FILES;i++) {
-    if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-      semaphore_V(tfs->lock);
+    if(stringcmp(dir[i].name, filename) == 0) {
+      bcache_put(md, 0);
+      semaphore_V(tfs->md_lock);
       return VFS_ERROR;
     }
 
-    if(from_big_endian32(tfs->buffer_md[i].inode) == 0) {
+    if(from_big_endian32(dir[i].inode) == 0) {
       /* found free slot from directory */
       index = i;
     }
@@ -296,98 +639,91 @@ int tfs_create(fs_t *fs, char *filename, int size)
 
   if(index == -1) {
     /* there was no space in directory, because index is not set */
-    semaphore_V(tfs->lock);
+    bcache_put(md, 0);
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
-  stringcopy(tfs->buffer_md[index].name,filename, TFS_FILENAME_MAX);
-
   /* Read allocation block and... */
-  req.block = tfs->startblock + TFS_ALLOCATION_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r==0) {
+  semaphore_P(tfs->bat_lock);
+  bat = bcache_get(tfs->disk, tfs->startblock + TFS_ALLOCATION_BLOCK);
+  if(bat == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
+    semaphore_V(tfs->bat_lock);
+    bcache_put(md, 0);
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
+  /* ...find space for inode, followed by the data blocks if there is
+     a free run for them... */
+  fileid = tfs_alloc_block(tfs, (bitmap_t *)bat->data, numblocks + 1,
+                           &next, &left);
+  if(fileid == -1) {
+    bcache_put(bat, 0);
+    semaphore_V(tfs->bat_lock);
+    bcache_put(md, 0);
+    semaphore_V(tfs->md_lock);
+    return VFS_ERROR;
+  }
 
-  /* ...find space for inode... */
-  tfs->buffer_md[index].inode = bitmap_findnset(tfs->buffer_bat,
-                                                tfs->totalblocks);
-
-  if((int)(from_big_endian32(tfs->buffer_md[index].inode)) == -1) {
-    semaphore_V(tfs->lock);
+  ib = bcache_get_empty(tfs->disk, tfs->startblock + fileid);
+  if(ib == NULL) {
+    bitmap_set((bitmap_t *)bat->data, fileid, 0);
+    bcache_put(bat, 0);
+    semaphore_V(tfs->bat_lock);
+    bcache_put(md, 0);
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
   /* ...and the rest of the blocks. Mark found block numbers in
-     inode.*/
-  tfs->buffer_inode->filesize = from_big_endian32(size);
+     inode and write zeros to them. */
+  inode = (tfs_inode_t *)ib->data;
+  inode->filesize = to_big_endian32(size);
+  for(i=0; i<TFS_BLOCKS_MAX; i++)
+    inode->block[i] = 0;
+
   for(i=0; i<numblocks; i++) {
-    tfs->buffer_inode->block[i] = from_big_endian32(bitmap_findnset(tfs->buffer_bat,
-                                                                    tfs->totalblocks));
-    if((int)from_big_endian32(tfs->buffer_inode->block[i]) == -1) {
+    block = tfs_alloc_block(tfs, (bitmap_t *)bat->data, numblocks - i,
+                            &next, &left);
+    if(block == -1) {
       /* Disk full. No free block found. */
-      semaphore_V(tfs->lock);
-      return VFS_ERROR;
+      r = VFS_ERROR;
+      break;
     }
-  }
+    inode->block[i] = to_big_endian32(block);
 
-  /* Mark rest of the blocks in inode as unused. */
-  while(i < (TFS_BLOCK_SIZE / 4 - 1))
-    tfs->buffer_inode->block[i++] = 0;
-
-  req.block = tfs->startblock + TFS_ALLOCATION_BLOCK;
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem   = NULL;
-  r = tfs->disk->write_block(tfs->disk, &req);
-  if(r==0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-  req.block = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem   = NULL;
-  r = tfs->disk->write_block(tfs->disk, &req);
-  if(r==0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-  req.block = tfs->startblock + from_big_endian32(tfs->buffer_md[index].inode);
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_inode);
-  req.sem   = NULL;
-  r = tfs->disk->write_block(tfs->disk, &req);
-  if(r==0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-  /* Write zeros to the reserved blocks. Buffer for allocation block
-     is no longer needed, so lets use it as zero buffer. */
-  memoryset(tfs->buffer_bat, 0, TFS_BLOCK_SIZE);
-  for(i=0;i<numblocks;i++) {
-    req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[i]);
-    req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
+    buf = bcache_get_empty(tfs->disk, tfs->startblock + block);
+    if(buf == NULL) {
       /* An error occured. */
-      semaphore_V(tfs->lock);
-      return VFS_ERROR;
+      i++;
+      r = VFS_ERROR;
+      break;
     }
+    memoryset(buf->data, 0, TFS_BLOCK_SIZE);
+    bcache_put(buf, 1);
+  }
 
+  if(r != VFS_OK) {
+    /* Give the blocks back, leaving the disk as it was. */
+    while(i > 0)
+      bitmap_set((bitmap_t *)bat->data,
+                 from_big_endian32(inode->block[--i]), 0);
+    bitmap_set((bitmap_t *)bat->data, fileid, 0);
+    bcache_put(ib, 0);
+  } else {
+    bcache_put(ib, 1);
+    tfs_inode_drop(tfs, fileid);
+    dir[index].inode = to_big_endian32(fileid);
+    stringcopy(dir[index].name, filename, TFS_FILENAME_MAX);
   }
 
-  semaphore_V(tfs->lock);
-  return VFS_OK;
+  bcache_put(bat, r == VFS_OK);
+  semaphore_V(tfs->bat_lock);
+  bcache_put(md, r == VFS_OK);
+  semaphore_V(tfs->md_lock);
+  return r;
 }
 
 /**
@@ -403,93 +739,75 @@ int tfs_create(fs_t *fs, char *filename, int size)
 int tfs_remove(fs_t *fs, char *filename)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
-  gbd_request_t req;
-  uint32_t i;
+  bcache_buf_t *md, *bat, *ib;
+  tfs_direntry_t *dir;
+  tfs_inode_t *inode;
+  semaphore_t *lock;
+  uint32_t i, fileid;
   int index = -1;
-  int r;
+  int r = VFS_ERROR;
 
-  semaphore_P(tfs->lock);
+  semaphore_P(tfs->md_lock);
 
   /* Find file and inode block number from directory block.
      If not found return VFS_NOT_FOUND. */
-  req.block = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
+  md = bcache_get(tfs->disk, tfs->startblock + TFS_DIRECTORY_BLOCK);
+  if(md == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
+  dir = (tfs_direntry_t *)md->data;
   for(i=0;i<TFS_MAX_FILES;i++) {
-    if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
+    if(stringcmp(dir[i].name, filename) == 0) {
       index = i;
       break;
     }
   }
   if(index == -1) {
-    semaphore_V(tfs->lock);
+    bcache_put(md, 0);
+    semaphore_V(tfs->md_lock);
     return VFS_NOT_FOUND;
   }
+  fileid = from_big_endian32(dir[index].inode);
 
   /* Read allocation block of the device and inode block of the file.
-     Free reserved blocks (marked in inode) from allocation block. */
-  req.block = tfs->startblock + TFS_ALLOCATION_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-  req.block = tfs->startblock + from_big_endian32(tfs->buffer_md[index].inode);
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_inode);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-
-  bitmap_set(tfs->buffer_bat, from_big_endian32(tfs->buffer_md[index].inode),0);
-  i=0;
-  while(from_big_endian32(tfs->buffer_inode->block[i]) != 0 &&
-        i < (TFS_BLOCK_SIZE / 4 - 1)) {
-    bitmap_set(tfs->buffer_bat, from_big_endian32(tfs->buffer_inode->block[i]),0);
-    i++;
-  }
+     Free reserved blocks (marked in inode) from allocation block.
+     Holding the inode lock waits for writes to the file to finish. */
+  semaphore_P(tfs->bat_lock);
+  lock = tfs_inode_lock(tfs, fileid);
+  semaphore_P(lock);
+
+  bat = bcache_get(tfs->disk, tfs->startblock + TFS_ALLOCATION_BLOCK);
+  ib = bcache_get(tfs->disk, tfs->startblock + fileid);
+  if(bat != NULL && ib != NULL) {
+    inode = (tfs_inode_t *)ib->data;
+    bitmap_set((bitmap_t *)bat->data, fileid, 0);
+    i=0;
+    while(i < TFS_BLOCKS_MAX && from_big_endian32(inode->block[i]) != 0) {
+      bitmap_set((bitmap_t *)bat->data,
+                 from_big_endian32(inode->block[i]), 0);
+      i++;
+    }
 
-  /* Free directory entry. */
-  tfs->buffer_md[index].inode   = 0;
-  tfs->buffer_md[index].name[0] = 0;
+    tfs_inode_drop(tfs, fileid);
 
-  req.block = tfs->startblock + TFS_ALLOCATION_BLOCK;
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem   = NULL;
-  r = tfs->disk->write_block(tfs->disk, &req);
-  if(r == 0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
+    /* Free directory entry. */
+    dir[index].inode   = 0;
+    dir[index].name[0] = 0;
+    r = VFS_OK;
   }
 
-  req.block = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem   = NULL;
-  r = tfs->disk->write_block(tfs->disk, &req);
-  if(r == 0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-  semaphore_V(tfs->lock);
-  return VFS_OK;
+  if(ib != NULL)
+    bcache_put(ib, 0);
+  if(bat != NULL)
+    bcache_put(bat, r == VFS_OK);
+  semaphore_V(lock);
+  semaphore_V(tfs->bat_lock);
+  bcache_put(md, r == VFS_OK);
+  semaphore_V(tfs->md_lock);
+  return r;
 }
 
 
@@ -497,7 +815,8 @@ int tfs_remove(fs_t *fs, char *filename)
  * Reads at most bufsize bytes from file to the buffer starting from
  * the offset. bufsize bytes is always read if possible. Returns
  * number of bytes read. Buffer size must be atleast bufsize.
- * Implements fs.read().
+ * Implements fs.read(). The buffer must be a kernel address, because
+ * whole blocks are read into it by the disk driver.
  *
  * @param fs  Pointer to fs data structure of the device.
  * @param fileid Fileid of the file.
@@ -511,42 +830,36 @@ int tfs_remove(fs_t *fs, char *filename)
 int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
-  gbd_request_t req;
+  tfs_cached_inode_t *inode;
+  bcache_buf_t *buf;
+  void *dest;
   int b1, b2;
+  int start, count;
   int read=0;
-  int r;
-
-  semaphore_P(tfs->lock);
 
   /* fileid is blocknum so ensure that we don't read system blocks
      or outside the disk */
 
-  if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-    semaphore_V(tfs->lock);
+  if(fileid < 2 || fileid > (int)tfs->totalblocks)
     return VFS_ERROR;
-  }
 
-  req.block = tfs->startblock + fileid;
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_inode);
-  req.sem   = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
+  inode = tfs_inode_get(tfs, fileid);
+  if(inode == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
     return VFS_ERROR;
   }
 
   /* Check that offset is inside the file */
-  if(offset < 0 || offset > (int)from_big_endian32(tfs->buffer_inode->filesize)) {
-    semaphore_V(tfs->lock);
+  if(offset < 0 || offset > (int)inode->filesize) {
+    tfs_inode_put(tfs, inode);
     return VFS_ERROR;
   }
 
   /* Read at most what is left from the file. */
-  bufsize = MIN(bufsize,((int)from_big_endian32(tfs->buffer_inode->filesize)) - offset);
+  bufsize = MIN(bufsize,((int)inode->filesize) - offset);
 
   if(bufsize==0) {
-    semaphore_V(tfs->lock);
+    tfs_inode_put(tfs, inode);
     return 0;
   }
 
@@ -556,60 +869,76 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
   /* last block to be read from the disk */
   b2 = (offset+bufsize-1) / TFS_BLOCK_SIZE;
 
-  /* Read blocks from b1 to b2. First and last are
-     special cases because whole block might not be written
-     to the buffer. */
-  req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[b1]);
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem   = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
+  /* Read blocks from b1 to b2. Whole blocks are read straight into
+     the buffer. First and last are special cases because whole block
+     might not be written to the buffer, so they are copied from the
+     block cache. */
+  for(; b1 <= b2; b1++) {
+    start = (read == 0) ? offset % TFS_BLOCK_SIZE : 0;
+    count = MIN(TFS_BLOCK_SIZE - start, bufsize - read);
+    dest = (void *)((uintptr_t)buffer + read);
+
+    if(count == TFS_BLOCK_SIZE && ((uintptr_t)dest & 3) == 0) {
+      if(bcache_read_direct(tfs->disk, tfs->startblock + inode->block[b1],
+                            dest) == 0) {
+        /* An error occured. */
+        tfs_inode_put(tfs, inode);
+        return VFS_ERROR;
+      }
+    } else {
+      buf = bcache_get(tfs->disk, tfs->startblock + inode->block[b1]);
+      if(buf == NULL) {
+        /* An error occured. */
+        tfs_inode_put(tfs, inode);
+        return VFS_ERROR;
+      }
+
+      memcopy(count, dest, (const void *)((uintptr_t)buf->data + start));
+      bcache_put(buf, 0);
+    }
+    read += count;
+  }
+
+  tfs_inode_put(tfs, inode);
+  return read;
+}
+
+/**
+ * Starts reading the blocks of a file range into the block cache in
+ * the background, so that later reads of the range find them cached.
+ * The range is clamped to the file. Implements fs.readahead().
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file.
+ * @param offset Start of the range.
+ * @param length Length of the range in bytes.
+ *
+ * @return VFS_OK, or VFS_ERROR if error occured.
+ */
+int tfs_readahead(fs_t *fs, int fileid, int offset, int length)
+{
+  tfs_t *tfs = (tfs_t *)fs->internal;
+  tfs_cached_inode_t *inode;
+  int b1, b2;
+
+  if(fileid < 2 || fileid > (int)tfs->totalblocks || offset < 0)
+    return VFS_ERROR;
+
+  inode = tfs_inode_get(tfs, fileid);
+  if(inode == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
     return VFS_ERROR;
   }
 
-  /* Count the number of the bytes to be read from the block and
-     written to the buffer from the first block. */
-  read = MIN(TFS_BLOCK_SIZE - (offset % TFS_BLOCK_SIZE), bufsize);
-  memcopy(read,
-          buffer,
-          (const uint32_t *)(((uintptr_t)tfs->buffer_bat) +
-                             (offset % TFS_BLOCK_SIZE)));
-
-  buffer = (void *)((uintptr_t)buffer + read);
-  b1++;
-  while(b1 <= b2) {
-    req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[b1]);
-    req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-      /* An error occured. */
-      semaphore_V(tfs->lock);
-      return VFS_ERROR;
-    }
-
-    if(b1 == b2) {
-      /* Last block. Whole block might not be read.*/
-      memcopy(bufsize - read,
-              buffer,
-              (const uint32_t *)(uintptr_t)tfs->buffer_bat);
-      read += (bufsize - read);
-    }
-    else {
-      /* Read whole block */
-      memcopy(TFS_BLOCK_SIZE,
-              buffer,
-              (const uint32_t *)tfs->buffer_bat);
-      read += TFS_BLOCK_SIZE;
-      buffer = (void *)((uintptr_t)buffer + TFS_BLOCK_SIZE);
-    }
-    b1++;
+  length = MIN(length, (int)inode->filesize - offset);
+  if(length > 0) {
+    b2 = (offset + length - 1) / TFS_BLOCK_SIZE;
+    for(b1 = offset / TFS_BLOCK_SIZE; b1 <= b2; b1++)
+      bcache_prefetch(tfs->disk, tfs->startblock + inode->block[b1]);
   }
 
-  semaphore_V(tfs->lock);
-  return read;
+  tfs_inode_put(tfs, inode);
+  return VFS_OK;
 }
 
 
@@ -632,41 +961,36 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
-  gbd_request_t req;
+  tfs_cached_inode_t *inode;
+  semaphore_t *lock;
+  bcache_buf_t *buf;
+  uint32_t block;
   int b1, b2;
+  int start, count;
   int written=0;
-  int r;
-
-  semaphore_P(tfs->lock);
 
   /* fileid is blocknum so ensure that we don't read system blocks
      or outside the disk */
-  if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-    semaphore_V(tfs->lock);
+  if(fileid < 2 || fileid > (int)tfs->totalblocks)
     return VFS_ERROR;
-  }
 
-  req.block = tfs->startblock + fileid;
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_inode);
-  req.sem   = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
+  inode = tfs_inode_get(tfs, fileid);
+  if(inode == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
     return VFS_ERROR;
   }
 
   /* check that start position is inside the disk */
-  if(offset < 0 || offset > (int)from_big_endian32(tfs->buffer_inode->filesize)) {
-    semaphore_V(tfs->lock);
+  if(offset < 0 || offset > (int)inode->filesize) {
+    tfs_inode_put(tfs, inode);
     return VFS_ERROR;
   }
 
   /* write at most the number of bytes left in the file */
-  datasize = MIN(datasize,(int)from_big_endian32(tfs->buffer_inode->filesize)-offset);
+  datasize = MIN(datasize,(int)inode->filesize-offset);
 
   if(datasize==0) {
-    semaphore_V(tfs->lock);
+    tfs_inode_put(tfs, inode);
     return 0;
   }
 
@@ -676,89 +1000,38 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
   /* last block to be written into */
   b2 = (offset+datasize-1) / TFS_BLOCK_SIZE;
 
-  /* Write data to blocks from b1 to b2. First and last are special
-     cases because whole block might not be written. Because of possible
-     partial write, first and last block must be read before writing.
-
-     If we write less than block size or start writing in the middle
-     of the block, read the block firts. Buffer for allocation block
-     is used because it is not needed (for allocation block) in this
-     function. */
-  written = MIN(TFS_BLOCK_SIZE - (offset % TFS_BLOCK_SIZE),datasize);
-  if(written < TFS_BLOCK_SIZE) {
-    req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[b1]);
-    req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-      /* An error occured. */
-      semaphore_V(tfs->lock);
-      return VFS_ERROR;
+  lock = tfs_inode_lock(tfs, fileid);
+  semaphore_P(lock);
+
+  /* Write data to blocks from b1 to b2 in the block cache. First and
+     last are special cases because whole block might not be
+     written. Because of possible partial write, first and last block
+     must be read before writing. */
+  for(; b1 <= b2; b1++) {
+    start = (written == 0) ? offset % TFS_BLOCK_SIZE : 0;
+    count = MIN(TFS_BLOCK_SIZE - start, datasize - written);
+    block = tfs->startblock + inode->block[b1];
+    if(count < TFS_BLOCK_SIZE) {
+      buf = bcache_get(tfs->disk, block);
+    } else {
+      buf = bcache_get_empty(tfs->disk, block);
     }
-  }
-
-  memcopy(written,
-          (uint32_t *)(((uintptr_t)tfs->buffer_bat) +
-                       (offset % TFS_BLOCK_SIZE)),
-          buffer);
-
-  req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[b1]);
-  req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem   = NULL;
-  r = tfs->disk->write_block(tfs->disk, &req);
-  if(r == 0) {
-    /* An error occured. */
-    semaphore_V(tfs->lock);
-    return VFS_ERROR;
-  }
-
-  buffer = (void *)((uintptr_t)buffer + written);
-  b1++;
-  while(b1 <= b2) {
-
-    if(b1 == b2) {
-      /* Last block. If partial write, read the block first.
-         Write anyway always to the beginning of the block */
-      if((datasize - written)  < TFS_BLOCK_SIZE) {
-        req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[b1]);
-        req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-        req.sem   = NULL;
-        r = tfs->disk->read_block(tfs->disk, &req);
-        if(r == 0) {
-          /* An error occured. */
-          semaphore_V(tfs->lock);
-          return VFS_ERROR;
-        }
-      }
-
-      memcopy(datasize - written,
-              (uint32_t *)(uintptr_t)tfs->buffer_bat,
-              buffer);
-      written = datasize;
-    }
-    else {
-      /* Write whole block */
-      memcopy(TFS_BLOCK_SIZE,
-              (uint32_t *)(uintptr_t)tfs->buffer_bat,
-              buffer);
-      written += TFS_BLOCK_SIZE;
-      buffer = (void *)((uintptr_t)buffer + TFS_BLOCK_SIZE);
-    }
-
-    req.block = tfs->startblock + from_big_endian32(tfs->buffer_inode->block[b1]);
-    req.buf   = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r == 0) {
+    if(buf == NULL) {
       /* An error occured. */
-      semaphore_V(tfs->lock);
+      semaphore_V(lock);
+      tfs_inode_put(tfs, inode);
       return VFS_ERROR;
     }
 
-    b1++;
+    memcopy(count,
+            (void *)((uintptr_t)buf->data + start),
+            (const void *)((uintptr_t)buffer + written));
+    bcache_put(buf, 1);
+    written += count;
   }
 
-  semaphore_V(tfs->lock);
+  semaphore_V(lock);
+  tfs_inode_put(tfs, inode);
   return written;
 }
 
@@ -774,28 +1047,25 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 int tfs_getfree(fs_t *fs)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
-  gbd_request_t req;
+  bcache_buf_t *bat;
   int allocated = 0;
   uint32_t i;
-  int r;
 
-  semaphore_P(tfs->lock);
+  semaphore_P(tfs->bat_lock);
 
-  req.block = tfs->startblock + TFS_ALLOCATION_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_bat);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
+  bat = bcache_get(tfs->disk, tfs->startblock + TFS_ALLOCATION_BLOCK);
+  if(bat == NULL) {
     /* An error occured. */
-    semaphore_V(tfs->lock);
+    semaphore_V(tfs->bat_lock);
     return VFS_ERROR;
   }
 
   for(i=0;i<tfs->totalblocks;i++) {
-    allocated += bitmap_get(tfs->buffer_bat,i);
+    allocated += bitmap_get((bitmap_t *)bat->data,i);
   }
 
-  semaphore_V(tfs->lock);
+  bcache_put(bat, 0);
+  semaphore_V(tfs->bat_lock);
   return (tfs->totalblocks - allocated)*TFS_BLOCK_SIZE;
 }
 
@@ -804,32 +1074,31 @@ int tfs_getfree(fs_t *fs)
 int tfs_filecount(fs_t *fs, char *dirname)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
-  gbd_request_t req;
+  bcache_buf_t *md;
+  tfs_direntry_t *dir;
   uint32_t i;
-  int r;
   int count = 0;
 
   if (stringcmp(dirname, "/") != 0)
     return VFS_NOT_FOUND;
 
-  semaphore_P(tfs->lock);
+  semaphore_P(tfs->md_lock);
 
-  req.block = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
-  if(r == 0) {
-    semaphore_V(tfs->lock);
+  md = bcache_get(tfs->disk, tfs->startblock + TFS_DIRECTORY_BLOCK);
+  if(md == NULL) {
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
+  dir = (tfs_direntry_t *)md->data;
   for(i=0; i < TFS_MAX_FILES; ++i) {
-    if(tfs->buffer_md[i].inode != 0) {
+    if(dir[i].inode != 0) {
       ++count;
     }
   }
 
-  semaphore_V(tfs->lock);
+  bcache_put(md, 0);
+  semaphore_V(tfs->md_lock);
   return count;
 }
 
@@ -840,39 +1109,37 @@ int tfs_filecount(fs_t *fs, char *dirname)
 int tfs_file(fs_t *fs, char *dirname, int idx, char *buffer)
 {
   tfs_t *tfs = (tfs_t *)fs->internal;
+  bcache_buf_t *md;
+  tfs_direntry_t *dir;
   uint32_t i;
-  int r;
   int count = 0;
-  gbd_request_t req;
+  int r = VFS_ERROR;
 
   if (stringcmp(dirname, "/") != 0 || idx < 0)
     return VFS_ERROR;
 
-  semaphore_P(tfs->lock);
-
-  req.block = tfs->startblock + TFS_DIRECTORY_BLOCK;
-  req.buf = ADDR_KERNEL_TO_PHYS((uintptr_t)tfs->buffer_md);
-  req.sem = NULL;
-  r = tfs->disk->read_block(tfs->disk, &req);
+  semaphore_P(tfs->md_lock);
 
- if(r == 0) {
-    semaphore_V(tfs->lock);
+  md = bcache_get(tfs->disk, tfs->startblock + TFS_DIRECTORY_BLOCK);
+  if(md == NULL) {
+    semaphore_V(tfs->md_lock);
     return VFS_ERROR;
   }
 
+  dir = (tfs_direntry_t *)md->data;
   for(i=0; i < TFS_MAX_FILES; ++i)
     {
-      if(tfs->buffer_md[i].inode != 0 && count++ == idx)
+      if(dir[i].inode != 0 && count++ == idx)
         {
-          stringcopy(buffer, tfs->buffer_md[i].name,
-                     TFS_FILENAME_MAX);
-          semaphore_V(tfs->lock);
-          return VFS_OK;
+          stringcopy(buffer, dir[i].name, TFS_FILENAME_MAX);
+          r = VFS_OK;
+          break;
         }
     }
 
-  semaphore_V(tfs->lock);
-  return VFS_ERROR;
+  bcache_put(md, 0);
+  semaphore_V(tfs->md_lock);
+  return r;
 }
 
 /** @} */
@@ -4,10 +4,13 @@
 
 #include "fs/vfs.h"
 #include "kernel/semaphore.h"
+#include "kernel/atomic.h"
 #include "kernel/assert.h"
 #include "kernel/config.h"
 #include "lib/libc.h"
+#include "lib/bitmap.h"
 #include "drivers/device.h"
+#include "drivers/bootargs.h"
 #include "fs/tfs.h"
 #include "fs/filesystems.h"
 
@@ -19,6 +22,16 @@
  *  @{
  */
 
+/* Bounds of the read-ahead window of a sequentially read file, in
+   bytes. */
+#define VFS_READAHEAD_MIN 1024
+#define VFS_READAHEAD_MAX 16384
+
+/* Number of entries in the directory entry cache, and the size of a
+   pathname stored in an entry. Longer pathnames are not cached. */
+#define VFS_DCACHE_SIZE 128
+#define VFS_DCACHE_PATH (2 * VFS_NAME_LENGTH + 2)
+
 /* Mounted filesystem information structure. */
 typedef struct {
   /* Pointer to filesystem driver. */
@@ -36,8 +49,18 @@ typedef struct {
   /* Filesystem specific file id for this open file. */
   int fileid;
 
+  /* Number of handles of this open file (see vfs_dup()). */
+  int refs;
+
   /* Current seek position in the file. */
   int seek_position;
+
+  /* Read-ahead state: the offset at which the next read is
+     sequential, the end of the range already read ahead, and the
+     number of bytes to read ahead (0 for random access). */
+  int ra_next;
+  int ra_end;
+  int ra_window;
 } openfile_entry_t;
 
 
@@ -58,27 +81,152 @@ static struct {
 
   /* Table of open files. */
   openfile_entry_t files[CONFIG_MAX_OPEN_FILES];
+
+  /* Entries in use, for finding a free one quickly. */
+  bitmap_t used[(CONFIG_MAX_OPEN_FILES + 31) / 32];
 } openfile_table;
 
+/* Directory entry cache entry: the result of opening a pathname. */
+typedef struct {
+  /* Filesystem of the file, NULL for an unused entry. */
+  fs_t *filesystem;
+
+  /* File id of the file, or VFS_NOT_FOUND if there is no such file
+     (a negative entry). */
+  int fileid;
+
+  /* Hash and the pathname as given to vfs_open(). */
+  uint32_t hash;
+  char pathname[VFS_DCACHE_PATH];
+} vfs_dentry_t;
+
+/* Directory entry cache, so that opening a pathname again needs no
+   directory search. Entries are found by the hash of the pathname,
+   an entry with a colliding hash is replaced. Protected by the lock
+   of vfs_table, which is also held while files are created or
+   removed. */
+static struct {
+  vfs_dentry_t entries[VFS_DCACHE_SIZE];
+
+  /* Incremented whenever entries are invalidated. */
+  uint32_t generation;
+} vfs_dcache;
+
 /* The following variables are used to synchronize the forced unmount
    used when shutting down the system so that the filesystems are
    clean. */
 
-/* Binary semaphore to synchronize access to vfs_ops and vfs_usable */
-static semaphore_t *vfs_op_sem;
-
 /* This semaphore is used to wake up the pending unmount operation
    when VFS is being shut down and all pending operations are
    complete */
 static semaphore_t *vfs_unmount_sem;
 
-/* The number of active operations on VFS */
-static int vfs_ops;
+/* The number of active operations on VFS, plus VFS_USABLE while VFS
+   is usable. It is only changed with atomic_add(), so operations need
+   no lock to start and end. When VFS becomes unusable it will never be
+   usable again because this is used when halting the system. */
+static int vfs_ops = 0;
 
-/* Boolean which indicates whether VFS is currently usable. When VFS
-   becomes unusable it will never be usable again because this is used
-   when halting the system. */
-static int vfs_usable = 0;
+/* Added to vfs_ops while VFS is usable. Larger than the number of
+   operations that can be active at once. */
+#define VFS_USABLE 0x10000
+
+/**
+ * Computes the hash of a pathname for the directory entry cache.
+ *
+ * @param pathname Full pathname
+ *
+ * @param hash Where to store the hash
+ *
+ * @return VFS_OK, or VFS_ERROR if the pathname is too long to be
+ * cached.
+ */
+
+static int vfs_dcache_hash(char *pathname, uint32_t *hash)
+{
+  uint32_t h = 2166136261u;
+  int i;
+
+  /* FNV-1a */
+  for (i = 0; pathname[i] != '\0'; i++) {
+    if (i >= VFS_DCACHE_PATH - 1)
+      return VFS_ERROR;
+    h = (h ^ (uint8_t)pathname[i]) * 16777619u;
+  }
+
+  *hash = h;
+  return VFS_OK;
+}
+
+/**
+ * Looks up a pathname in the directory entry cache. The mount table
+ * must be locked.
+ *
+ * @param pathname Full pathname
+ *
+ * @return The cache entry of the pathname, or NULL if there is none.
+ */
+
+static vfs_dentry_t *vfs_dcache_lookup(char *pathname)
+{
+  vfs_dentry_t *dentry;
+  uint32_t hash;
+
+  if (vfs_dcache_hash(pathname, &hash) != VFS_OK)
+    return NULL;
+
+  dentry = &vfs_dcache.entries[hash % VFS_DCACHE_SIZE];
+  if (dentry->filesystem == NULL || dentry->hash != hash ||
+      stringcmp(dentry->pathname, pathname) != 0)
+    return NULL;
+
+  return dentry;
+}
+
+/**
+ * Remembers the result of opening a pathname in the directory entry
+ * cache. The mount table must be locked.
+ *
+ * @param pathname Full pathname
+ *
+ * @param fs Filesystem of the file
+ *
+ * @param fileid File id of the file, or VFS_NOT_FOUND
+ */
+
+static void vfs_dcache_insert(char *pathname, fs_t *fs, int fileid)
+{
+  vfs_dentry_t *dentry;
+  uint32_t hash;
+
+  if (vfs_dcache_hash(pathname, &hash) != VFS_OK)
+    return;
+
+  dentry = &vfs_dcache.entries[hash % VFS_DCACHE_SIZE];
+  dentry->filesystem = fs;
+  dentry->fileid = fileid;
+  dentry->hash = hash;
+  stringcopy(dentry->pathname, pathname, VFS_DCACHE_PATH);
+}
+
+/**
+ * Drops the directory entry cache entries of a filesystem, because
+ * files were created or removed in it or it is unmounted. The mount
+ * table must be locked.
+ *
+ * @param fs Filesystem
+ */
+
+static void vfs_dcache_purge(fs_t *fs)
+{
+  int i;
+
+  for (i = 0; i < VFS_DCACHE_SIZE; i++) {
+    if (vfs_dcache.entries[i].filesystem == fs)
+      vfs_dcache.entries[i].filesystem = NULL;
+  }
+  vfs_dcache.generation++;
+}
 
 /**
  * Initializes Virtual Filesystem layer. This function is called
@@ -104,12 +252,18 @@ void vfs_init(void)
   for (i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
     openfile_table.files[i].filesystem = NULL;
   }
+  bitmap_init(openfile_table.used, CONFIG_MAX_OPEN_FILES);
+
+  /* Clear directory entry cache. */
+  for (i = 0; i < VFS_DCACHE_SIZE; i++) {
+    vfs_dcache.entries[i].filesystem = NULL;
+  }
+  vfs_dcache.generation = 0;
 
-  vfs_op_sem = semaphore_create(1);
   vfs_unmount_sem = semaphore_create(0);
+  KERNEL_ASSERT(vfs_unmount_sem != NULL);
 
-  vfs_ops = 0;
-  vfs_usable = 1;
+  vfs_ops = VFS_USABLE;
 
   kprintf("VFS: Max filesystems: %d, Max open files: %d\n",
           CONFIG_MAX_FILESYSTEMS, CONFIG_MAX_OPEN_FILES);
@@ -126,18 +280,18 @@ void vfs_deinit(void)
 {
   fs_t *fs;
   int row;
+  int ops;
 
-  semaphore_P(vfs_op_sem);
-  vfs_usable = 0;
+  /* New operations fail from now on. The last pending one wakes us
+     up when it ends. */
+  ops = atomic_add(&vfs_ops, -VFS_USABLE);
+  KERNEL_ASSERT(ops >= 0 && ops < VFS_USABLE);
 
   kprintf("VFS: Entering forceful unmount of all filesystems.\n");
-  if (vfs_ops > 0) {
+  if (ops > 0) {
     kprintf("VFS: Delaying force unmount until the pending %d "
-            "operations are done.\n", vfs_ops);
-    semaphore_V(vfs_op_sem);
+            "operations are done.\n", ops);
     semaphore_P(vfs_unmount_sem);
-    semaphore_P(vfs_op_sem);
-    KERNEL_ASSERT(vfs_ops == 0);
     kprintf("VFS: Continuing forceful unmount.\n");
   }
 
@@ -149,6 +303,7 @@ void vfs_deinit(void)
     if (fs != NULL) {
       kprintf("VFS: Forcefully unmounting volume [%s]\n",
               vfs_table.filesystems[row].mountpoint);
+      vfs_dcache_purge(fs);
       fs->unmount(fs);
       vfs_table.filesystems[row].filesystem = NULL;
     }
@@ -156,7 +311,6 @@ void vfs_deinit(void)
 
   semaphore_V(openfile_table.sem);
   semaphore_V(vfs_table.sem);
-  semaphore_V(vfs_op_sem);
 }
 
 
@@ -219,6 +373,7 @@ void vfs_mount_all(void)
 {
   int i;
   device_t *dev;
+  char *swapdisk = bootargs_get("swapdisk");
 
   for(i=0; i<CONFIG_MAX_FILESYSTEMS; i++) {
     dev = device_get(TYPECODE_DISK, i);
@@ -235,6 +390,11 @@ void vfs_mount_all(void)
         continue;
       }
 
+      /* The swap disk holds no filesystem (see proc/swap.c) */
+      if(swapdisk != NULL && atoi(swapdisk) == i) {
+        continue;
+      }
+
       vfs_mount_fs(gbd, NULL);
     }
   }
@@ -323,6 +483,20 @@ static int vfs_parse_pathname(char *pathname,
   return VFS_ERROR;
 }
 
+/**
+ * End a VFS operation.
+ */
+static void vfs_end_op()
+{
+  int ops = atomic_add(&vfs_ops, -1);
+
+  KERNEL_ASSERT(ops >= 0);
+
+  /* Wake up pending unmount if VFS is now idle. */
+  if (ops == 0)
+    semaphore_V(vfs_unmount_sem);
+}
+
 /**
  * Start a new operation on VFS. Operation is defined to be any such
  * sequence of actions (a VFS function call) that may touch some
@@ -333,40 +507,14 @@ static int vfs_parse_pathname(char *pathname,
  */
 static int vfs_start_op()
 {
-  int ret = VFS_OK;
-
-  semaphore_P(vfs_op_sem);
-
-  if (vfs_usable) {
-    vfs_ops++;
-  } else {
-    ret = VFS_UNUSABLE;
+  /* Count the operation first, so that vfs_deinit() either sees it
+     or this sees that VFS is no longer usable. */
+  if (atomic_add(&vfs_ops, 1) < VFS_USABLE) {
+    vfs_end_op();
+    return VFS_UNUSABLE;
   }
 
-  semaphore_V(vfs_op_sem);
-
-  return ret;
-}
-
-/**
- * End a VFS operation.
- */
-static void vfs_end_op()
-{
-  semaphore_P(vfs_op_sem);
-
-  vfs_ops--;
-
-  KERNEL_ASSERT(vfs_ops >= 0);
-
-  /* Wake up pending unmount if VFS is now idle. */
-  if (!vfs_usable && (vfs_ops == 0))
-    semaphore_V(vfs_unmount_sem);
-
-  if (!vfs_usable && (vfs_ops > 0))
-    kprintf("VFS: %d operations still pending\n", vfs_ops);
-
-  semaphore_V(vfs_op_sem);
+  return VFS_OK;
 }
 
 /**
@@ -472,6 +620,7 @@ int vfs_unmount(char *name)
     }
   }
 
+  vfs_dcache_purge(fs);
   fs->unmount(fs);
   vfs_table.filesystems[row].filesystem = NULL;
 
@@ -496,28 +645,21 @@ openfile_t vfs_open(char *pathname)
 {
   openfile_t file;
   int fileid;
+  uint32_t generation;
   char volumename[VFS_NAME_LENGTH];
   char filename[VFS_NAME_LENGTH];
+  vfs_dentry_t *dentry;
   fs_t *fs = NULL;
 
   if (vfs_start_op() != VFS_OK)
     return VFS_UNUSABLE;
 
-  if (vfs_parse_pathname(pathname, volumename, filename) != VFS_OK) {
-    vfs_end_op();
-    return VFS_ERROR;
-  }
-
   semaphore_P(vfs_table.sem);
   semaphore_P(openfile_table.sem);
 
-  for(file=0; file<CONFIG_MAX_OPEN_FILES; file++) {
-    if(openfile_table.files[file].filesystem == NULL) {
-      break;
-    }
-  }
+  file = bitmap_findnset(openfile_table.used, CONFIG_MAX_OPEN_FILES);
 
-  if(file >= CONFIG_MAX_OPEN_FILES) {
+  if(file < 0) {
     semaphore_V(openfile_table.sem);
     semaphore_V(vfs_table.sem);
     kprintf("VFS: Warning, maximum number of open files exceeded.");
@@ -525,32 +667,68 @@ openfile_t vfs_open(char *pathname)
     return VFS_LIMIT;
   }
 
-  fs = vfs_get_filesystem(volumename);
-
-  if(fs == NULL) {
+  dentry = vfs_dcache_lookup(pathname);
+  if(dentry != NULL) {
+    fs = dentry->filesystem;
+    fileid = dentry->fileid;
+    openfile_table.files[file].filesystem = fs;
     semaphore_V(openfile_table.sem);
+
+    /* The file cannot be removed while the mount table is locked. */
+    if(fileid >= 0)
+      fileid = fs->reopen(fs, fileid);
+
     semaphore_V(vfs_table.sem);
-    vfs_end_op();
-    return VFS_NO_SUCH_FS;
-  }
+  } else {
+    if(vfs_parse_pathname(pathname, volumename, filename) != VFS_OK)
+      fileid = VFS_ERROR;
+    else if((fs = vfs_get_filesystem(volumename)) == NULL)
+      fileid = VFS_NO_SUCH_FS;
+    else
+      fileid = VFS_OK;
+
+    if(fileid != VFS_OK) {
+      bitmap_set(openfile_table.used, file, 0);
+      semaphore_V(openfile_table.sem);
+      semaphore_V(vfs_table.sem);
+      vfs_end_op();
+      return fileid;
+    }
 
-  openfile_table.files[file].filesystem = fs;
+    openfile_table.files[file].filesystem = fs;
+    generation = vfs_dcache.generation;
 
-  semaphore_V(openfile_table.sem);
-  semaphore_V(vfs_table.sem);
+    semaphore_V(openfile_table.sem);
+    semaphore_V(vfs_table.sem);
 
-  fileid = fs->open(fs, filename);
+    fileid = fs->open(fs, filename);
+
+    /* Remember the result, unless files were created or removed in
+       the meantime. Files found are only remembered if the filesystem
+       can open them again by their id. */
+    if(fileid == VFS_NOT_FOUND || (fileid >= 0 && fs->reopen != NULL)) {
+      semaphore_P(vfs_table.sem);
+      if(generation == vfs_dcache.generation)
+        vfs_dcache_insert(pathname, fs, fileid);
+      semaphore_V(vfs_table.sem);
+    }
+  }
 
   if(fileid < 0) {
     semaphore_P(openfile_table.sem);
     openfile_table.files[file].filesystem = NULL;
+    bitmap_set(openfile_table.used, file, 0);
     semaphore_V(openfile_table.sem);
     vfs_end_op();
     return fileid; /* negative -> error*/
   }
 
   openfile_table.files[file].fileid = fileid;
+  openfile_table.files[file].refs = 1;
   openfile_table.files[file].seek_position = 0;
+  openfile_table.files[file].ra_next = 0;
+  openfile_table.files[file].ra_end = 0;
+  openfile_table.files[file].ra_window = 0;
 
   vfs_end_op();
   return file;
@@ -584,7 +762,8 @@ static openfile_entry_t *vfs_verify_open(openfile_t file)
 
 
 /**
- * Close open file.
+ * Close open file. The file stays open as long as other handles of
+ * it (see vfs_dup()) do.
  *
  * @param file Openfile id
  *
@@ -606,13 +785,22 @@ int vfs_close(openfile_t file)
   openfile = vfs_verify_open(file);
   if (openfile == NULL) {
     semaphore_V(openfile_table.sem);
+    vfs_end_op();
     return VFS_INVALID_PARAMS;
   }
 
+  /* Other handles keep the file open. */
+  if (--openfile->refs > 0) {
+    semaphore_V(openfile_table.sem);
+    vfs_end_op();
+    return VFS_OK;
+  }
+
   fs = openfile->filesystem;
 
   ret = fs->close(fs, openfile->fileid);
   openfile->filesystem = NULL;
+  bitmap_set(openfile_table.used, file, 0);
 
   semaphore_V(openfile_table.sem);
 
@@ -620,6 +808,72 @@ int vfs_close(openfile_t file)
   return ret;
 }
 
+/**
+ * Creates another handle of an open file, such as for a descriptor
+ * inherited by a child process. The handles share the open file and
+ * its seek position, and the file is closed when vfs_close() has been
+ * called for all of them.
+ *
+ * @param file Openfile id
+ *
+ * @return VFS_OK on success, negative (VFS_*) on error.
+ */
+int vfs_dup(openfile_t file)
+{
+  openfile_entry_t *openfile;
+
+  semaphore_P(openfile_table.sem);
+
+  openfile = vfs_verify_open(file);
+  if (openfile == NULL) {
+    semaphore_V(openfile_table.sem);
+    return VFS_INVALID_PARAMS;
+  }
+
+  openfile->refs++;
+
+  semaphore_V(openfile_table.sem);
+  return VFS_OK;
+}
+
+
+/**
+ * Identifies the file behind an open file. Two open files refer to
+ * the same file exactly when both values are equal.
+ *
+ * @param file Openfile id
+ *
+ * @param fs Set to the filesystem of the file.
+ *
+ * @param fileid Set to the filesystem specific id of the file.
+ *
+ * @return VFS_OK on success, negative (VFS_*) on error.
+ */
+int vfs_identify(openfile_t file, void **fs, int *fileid)
+{
+  openfile_entry_t *openfile;
+
+  if (vfs_start_op() != VFS_OK)
+    return VFS_UNUSABLE;
+
+  semaphore_P(openfile_table.sem);
+
+  openfile = vfs_verify_open(file);
+  if (openfile == NULL) {
+    semaphore_V(openfile_table.sem);
+    vfs_end_op();
+    return VFS_INVALID_PARAMS;
+  }
+
+  *fs = openfile->filesystem;
+  *fileid = openfile->fileid;
+
+  semaphore_V(openfile_table.sem);
+
+  vfs_end_op();
+  return VFS_OK;
+}
+
 
 /**
  * Seek given file to given position. The position is not verified
@@ -641,6 +895,7 @@ int vfs_seek(openfile_t file, int seek_position)
   openfile = vfs_verify_open(file);
   if (openfile == NULL) {
     semaphore_V(openfile_table.sem);
+    vfs_end_op();
     return VFS_INVALID_PARAMS;
   }
 
@@ -653,6 +908,30 @@ int vfs_seek(openfile_t file, int seek_position)
 }
 
 
+/**
+ * Updates the read-ahead window of an open file after a read starting
+ * at offset start. A read continuing where the previous one ended
+ * doubles the window, up to VFS_READAHEAD_MAX; any other read turns
+ * read-ahead off until the file is read sequentially again. Must be
+ * called with the open file table lock held.
+ *
+ * @param openfile Open file entry, seek position already updated
+ *
+ * @param start Offset at which the read started
+ */
+static void vfs_readahead_window(openfile_entry_t *openfile, int start)
+{
+  if (start == openfile->ra_next) {
+    openfile->ra_window = MIN(MAX(2 * openfile->ra_window,
+                                  VFS_READAHEAD_MIN),
+                              VFS_READAHEAD_MAX);
+  } else {
+    openfile->ra_window = 0;
+    openfile->ra_end = 0;
+  }
+  openfile->ra_next = openfile->seek_position;
+}
+
 /**
  * Reads at most bufsize bytes from given open file to given buffer.
  * The read is started from current seek position and after read, the
@@ -674,12 +953,14 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
   openfile_entry_t *openfile;
   fs_t *fs;
   int ret;
+  int start, end;
 
   if (vfs_start_op() != VFS_OK)
     return VFS_UNUSABLE;
 
   openfile = vfs_verify_open(file);
   if (openfile == NULL) {
+    vfs_end_op();
     return VFS_INVALID_PARAMS;
   }
 
@@ -692,8 +973,17 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
 
   if(ret > 0) {
     semaphore_P(openfile_table.sem);
+    start = openfile->seek_position;
     openfile->seek_position += ret;
+    vfs_readahead_window(openfile, start);
+    start = MAX(openfile->seek_position, openfile->ra_end);
+    end = openfile->seek_position + openfile->ra_window;
+    if (end > start)
+      openfile->ra_end = end;
     semaphore_V(openfile_table.sem);
+
+    if (end > start && fs->readahead != NULL)
+      fs->readahead(fs, openfile->fileid, start, end - start);
   }
 
   vfs_end_op();
@@ -728,6 +1018,7 @@ int vfs_write(openfile_t file, void *buffer, int datasize)
 
   openfile = vfs_verify_open(file);
   if (openfile == NULL) {
+    vfs_end_op();
     return VFS_INVALID_PARAMS;
   }
 
@@ -790,6 +1081,8 @@ int vfs_create(char *pathname, int size)
   }
 
   ret = fs->create(fs, filename, size);
+  if(ret == VFS_OK)
+    vfs_dcache_purge(fs);
 
   semaphore_V(vfs_table.sem);
 
@@ -833,6 +1126,8 @@ int vfs_remove(char *pathname)
   }
 
   ret = fs->remove(fs, filename);
+  if(ret == VFS_OK)
+    vfs_dcache_purge(fs);
 
   semaphore_V(vfs_table.sem);
 
@@ -51,6 +51,13 @@ typedef struct fs_struct{
      must be unique for this filesystem. Negative values are errors. */
   int (*open)(struct fs_struct *fs, char *filename);
 
+  /* Function pointer to a function which opens a file again by the
+     file id which open returned for it earlier, without looking up
+     its name. The VFS calls it only while the file cannot be removed.
+     The pointer may be NULL, in which case files are always opened
+     by name. Returns the file id, negative values are errors. */
+  int (*reopen)(struct fs_struct *fs, int fileid);
+
   /* Function pointer to a function which closes the given (open) file.
      A pointer to this structure as will as fileid previously returned
      by open is given as argument. Zero return value is success,
@@ -81,6 +88,16 @@ typedef struct fs_struct{
   int (*write)(struct fs_struct *fs, int fileid, void *buffer,
                int datasize, int offset);
 
+  /* Function pointer to a function which starts reading length bytes
+     of given open file (fileid) from given absolute offset into
+     memory in the background, because they are about to be read. It
+     may do nothing. The pointer may be NULL if the filesystem does
+     not support read-ahead.
+
+     Returns success value as defined above (VFS_OK, etc.) */
+  int (*readahead)(struct fs_struct *fs, int fileid, int offset,
+                   int length);
+
   /* Function pointer to a function which creates new file in the
      filesystem. A pointer to this structure is given as the first
      argument, name of the file to be created as second argument and
@@ -131,9 +148,11 @@ int vfs_unmount(char *name);
 
 openfile_t vfs_open(char *pathname);
 int vfs_close(openfile_t file);
+int vfs_dup(openfile_t file);
 int vfs_seek(openfile_t file, int seek_position);
 int vfs_read(openfile_t file, void *buffer, int bufsize);
 int vfs_write(openfile_t file, void *buffer, int datasize);
+int vfs_identify(openfile_t file, void **fs, int *fileid);
 
 int vfs_create(char *pathname, int size);
 int vfs_remove(char *pathname);
@@ -10,6 +10,7 @@
 #include "drivers/metadev.h"
 #include "drivers/polltty.h"
 #include "fs/vfs.h"
+#include "fs/bcache.h"
 #include "kernel/assert.h"
 #include "kernel/config.h"
 #include "kernel/halt.h"
@@ -23,6 +24,8 @@
 #include "lib/debug.h"
 #include "lib/libc.h"
 #include "proc/process.h"
+#include "proc/mmap.h"
+#include "proc/shm.h"
 #include "vm/memory.h"
 
 /* Whether other processors than 0 may continue in SMP mode.
@@ -90,6 +93,9 @@ void init(void)
   kwrite("Initializing threading system\n");
   thread_table_init();
 
+  kwrite("Initializing process table\n");
+  process_init();
+
   kwrite("Initializing sleep queue\n");
   sleepq_init();
 
@@ -99,9 +105,18 @@ void init(void)
   kwrite("Initializing device drivers\n");
   device_init();
 
+  kwrite("Initializing block cache\n");
+  bcache_init();
+
   kprintf("Initializing virtual filesystem\n");
   vfs_init();
 
+  kwrite("Initializing memory mapped files\n");
+  mmap_init();
+
+  kwrite("Initializing shared memory\n");
+  shm_init();
+
   kwrite("Initializing scheduler\n");
   scheduler_init();
 
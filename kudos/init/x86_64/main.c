@@ -11,12 +11,17 @@
 #include "drivers/polltty.h"
 #include "kernel/stalloc.h"
 #include "kernel/thread.h"
+#include "proc/process.h"
+#include "proc/mmap.h"
+#include "proc/shm.h"
+#include "proc/swap.h"
 #include "kernel/sleepq.h"
 #include "kernel/semaphore.h"
 #include "kernel/scheduler.h"
 #include "drivers/device.h"
 #include "drivers/bootargs.h"
 #include "fs/vfs.h"
+#include "fs/bcache.h"
 #include <keyboard.h>
 #include "drivers/modules.h"
 
@@ -82,6 +87,9 @@ int init(uint64_t magic, uint8_t *multiboot)
   kprintf("Initializing threading table\n");
   thread_table_init();
 
+  kprintf("Initializing process table\n");
+  process_init();
+
   kprintf("Initializing sleep queue\n");
   sleepq_init();
 
@@ -100,9 +108,21 @@ int init(uint64_t magic, uint8_t *multiboot)
   kprintf("Initializing kernel modules\n");
   modules_init();
 
+  kprintf("Initializing block cache\n");
+  bcache_init();
+
   kprintf("Initializing virtual filesystem\n");
   vfs_init();
 
+  kprintf("Initializing memory mapped files\n");
+  mmap_init();
+
+  kprintf("Initializing shared memory\n");
+  shm_init();
+
+  kprintf("Initializing swapping\n");
+  swap_init();
+
   kprintf("Creating initialization thread\n");
   startup_thread = thread_create(init_startup_thread, 0);
   thread_run(startup_thread);
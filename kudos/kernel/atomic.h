@@ -0,0 +1,12 @@
+/*
+ * Atomic operations
+ */
+
+#ifndef KUDOS_KERNEL_ATOMIC_H
+#define KUDOS_KERNEL_ATOMIC_H
+
+/* Adds delta to *value as one indivisible operation, also with
+   respect to other CPUs, and returns the new value. */
+int atomic_add(int *value, int delta);
+
+#endif // KUDOS_KERNEL_ATOMIC_H
@@ -52,11 +52,11 @@ void interrupt_init(int num_cpus) {
     interrupt_stacks[i] = ret+PAGE_SIZE-4;
   }
 
-  /* Copy the interrupt vector code to its positions.All vectors
-   * will contain the same code.
+  /* Copy the interrupt vector code to its positions. The TLB refill
+   * vector gets the refill handler, the others the context switch.
    */
   for(i = 0 ; i < INTERRUPT_VECTOR_LENGTH ; i++) {
-    iv_area1[i] = ((uint32_t *) (uintptr_t) &_cswitch_vector_code)[i];
+    iv_area1[i] = ((uint32_t *) (uintptr_t) &_tlb_refill_vector_code)[i];
     iv_area2[i] = ((uint32_t *) (uintptr_t) &_cswitch_vector_code)[i];
     iv_area3[i] = ((uint32_t *) (uintptr_t) &_cswitch_vector_code)[i];
   }
@@ -155,17 +155,10 @@ void interrupt_handle(virtaddr_t cause) {
      scheduler_current_thread[this_cpu] == IDLE_THREAD_TID) {
     scheduler_schedule();
 
-    /* Until we have proper VM we must manually fill
-       the TLB with pagetable entries before running code using
-       given pagetable. Note that this method limits pagetable
-       rows (possible mapping pairs) to 16 and can't be used
-       with proper pagetables and VM.
-
-       Note that if you remove this call (which you probably do when
-       you implement proper VM), you must manually call _tlb_set_asid
-       here. See the implementation of tlb_fill on details how to do that.
-    */
-    tlb_fill(thread_get_current_thread_entry()->pagetable);
+    /* Point the TLB refill handler at the pagetable of the new
+       thread and switch to its ASID. Entries of other threads are
+       tagged with their own ASIDs and stay in the TLB. */
+    tlb_set_pagetable(thread_get_current_thread_entry()->pagetable);
   }
 }
 
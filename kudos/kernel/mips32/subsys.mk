@@ -4,7 +4,7 @@
 MODULE := kernel/mips32
 
 
-FILES := _cswitch.S cswitch.c _interrupt.S _spinlock.S \
+FILES := _cswitch.S cswitch.c _interrupt.S _spinlock.S _atomic.S \
 	idle.S interrupt.c exception.c
 
 MIPSSRC += $(patsubst %, $(MODULE)/%, $(FILES))
@@ -133,7 +133,7 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
                                                   +CONFIG_THREAD_STACKSIZE*tid + CONFIG_THREAD_STACKSIZE -
                                                   sizeof(context_t));
 
-  for (i=0; i< (int) sizeof(context_t)/4; i++) {
+  for (i=0; i< (int) (sizeof(context_t)/sizeof(virtaddr_t)); i++) {
     *(((virtaddr_t*) thread_table[tid].context) + i) = 0;
   }
 
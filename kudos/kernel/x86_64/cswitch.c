@@ -98,7 +98,7 @@ void _context_enter_userland(context_t *cxt)
   *(rsp--) = 0; //R10
   *(rsp--) = 0; //R9
   *(rsp--) = 0; //R8
-  *(rsp--) = 0; //RDI
+  *(rsp--) = cxt->arg;  //RDI
   *(rsp--) = 0; //RSI
   *(rsp--) = rbp;       //RBP
   *(rsp--) = 0; //RSP
@@ -127,6 +127,11 @@ void _context_set_ip(context_t *cxt, virtaddr_t ip)
   cxt->rip = ip;
 }
 
+void _context_set_arg(context_t *cxt, uint64_t arg)
+{
+  cxt->arg = arg;
+}
+
 void _context_enable_ints(context_t *cxt)
 {
   /* Modify status */
@@ -186,6 +191,6 @@ struct dirty_dirty_hack task_switch(uint64_t *stack)
   //return new_stack;
   struct dirty_dirty_hack tmp;
   tmp.stack = new_stack;              //RAX
-  tmp.pml4 = task->context->pml4;     //RDX
+  tmp.pml4 = vmm_switch_cr3(task->context->pml4); //RDX, 0 if unchanged
   return tmp;
 }
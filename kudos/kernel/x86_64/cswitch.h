@@ -14,6 +14,7 @@ typedef struct {
   uint64_t flags;
   uint64_t pml4;
   pagetable_t *virt_memory;
+  uint64_t arg;      /* First argument (rdi) when entering userland */
 
   void    *prev_context;   /* Previous context in a nested exception chain */
 } context_t;
@@ -30,6 +31,11 @@ void _context_init(context_t *cxt, virtaddr_t entry, virtaddr_t endentry,
 void _context_enter_userland(context_t *cxt);
 void _context_set_ip(context_t *cxt, virtaddr_t ip); /* Set new instruction pointer / program counter */
 void _context_set_sp(context_t *cxt, virtaddr_t sp); /* Sets a new stack pointer */
+void _context_set_arg(context_t *cxt, uint64_t arg); /* Sets the first argument */
 void _context_enable_ints(context_t *cxt); /* Masks interrupts */
 
+/* Continues on another stack by calling func(arg), which must not return */
+void _context_call_on_stack(virtaddr_t stack, void (*func)(uint32_t),
+                            uint32_t arg);
+
 #endif // KUDOS_KERNEL_X86_64_CSWITCH_H
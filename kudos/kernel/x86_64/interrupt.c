@@ -9,6 +9,8 @@
 #include <tss.h>
 #include <exception.h>
 #include "lib/libc.h"
+#include "proc/process.h"
+#include "kernel/thread.h"
 
 /* Initial stack start */
 uint64_t init_stack = 0x90000;
@@ -173,7 +175,39 @@ void interrupt_handle(virtaddr_t cause)
       /* Page Fault */
     case 14:
       {
-        kprintf("Page Fault!\n");
+        virtaddr_t fault_addr;
+        int handled;
+
+        /* CR2 must be read before anything can fault again */
+        asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
+
+        /* Demand paging may sleep on the disk, so resolve the fault
+         * with interrupts enabled if the faulting code had them on */
+        if(Registers->rflags & EFLAGS_INTERRUPT_FLAG)
+          _interrupt_enable();
+        handled = process_handle_page_fault(
+          fault_addr, Registers->errorcode & PAGE_FAULT_WRITE);
+        _interrupt_disable();
+
+        if(handled == 0)
+          return;
+
+        /* An illegal access by user code (or a jump to an unmapped
+         * address) kills the process rather than the system. So does
+         * a system call touching a bad user pointer, unless it faulted
+         * with interrupts off, when it may hold a spinlock */
+        if(thread_get_current_thread_entry()->process_id >= 0
+           && (Registers->rip > VMM_KERNEL_SPACE
+               || Registers->rip == fault_addr
+               || (fault_addr > VMM_KERNEL_SPACE
+                   && (Registers->rflags & EFLAGS_INTERRUPT_FLAG))))
+          {
+            kprintf("Page Fault at 0x%xl, killing process\n", fault_addr);
+            _interrupt_enable();
+            process_exit(-1);
+          }
+
+        kprintf("Page Fault at 0x%xl!\n", fault_addr);
       } break;
       /* Reserved Exception */
     case 15:
@@ -33,6 +33,10 @@ typedef void (*int_handler_t)(void);
 
 #define EFLAGS_INTERRUPT_FLAG (1 << 9)
 
+/* Page fault error code bits */
+#define PAGE_FAULT_PRESENT 0x1
+#define PAGE_FAULT_WRITE   0x2
+
 /* Interrupts */
 void isr_handler0(void);
 void isr_handler1(void);
@@ -4,6 +4,6 @@
 MODULE := kernel/x86_64
 
 FILES := _irq.S _spinlock.c cswitch.c interrupt.c stubs.c \
-	 gdt.c idt.c exception.c pic.c tss.c spinlock.S
+	 gdt.c idt.c exception.c pic.c tss.c spinlock.S atomic.S
 
 X64SRC += $(patsubst %, $(MODULE)/%, $(FILES))
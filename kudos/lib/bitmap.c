@@ -97,6 +97,111 @@ void bitmap_set(bitmap_t *bitmap, int pos, int value)
 }
 
 
+/* Bit positions of the de Bruijn sequence 0x077CB531, see
+   bitmap_ctz(). */
+static const uint8_t bitmap_debruijn[32] = {
+  0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+  31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
+
+/**
+ * Counts the trailing zero bits of a word. Isolating the lowest set
+ * bit and multiplying by a de Bruijn sequence puts a unique pattern in
+ * the top five bits, which needs neither a loop nor a libgcc helper.
+ *
+ * @param word The word, which must not be zero.
+ *
+ * @return The index of the lowest set bit of word.
+ */
+static int bitmap_ctz(bitmap_t word)
+{
+  return bitmap_debruijn[((word & -word) * 0x077CB531U) >> 27];
+}
+
+/**
+ * Finds the first word at or after word which is not full according
+ * to a summary bitmap.
+ *
+ * @param summary The summary bitmap
+ *
+ * @param word The word to start from
+ *
+ * @param words The number of words summarized
+ *
+ * @return Index of the word, at least words if there is none.
+ */
+static int bitmap_next_nonfull(bitmap_t *summary, int word, int words)
+{
+  bitmap_t free;
+
+  while (word < words) {
+    free = ~summary[word / 32] >> (word % 32);
+    if (free != 0) {
+      return word + bitmap_ctz(free);
+    }
+    word += 32 - word % 32;
+  }
+
+  return words;
+}
+
+/**
+ * Finds n consecutive zero bits between two positions. Runs of
+ * equal bits are skipped a word at a time.
+ *
+ * @param bitmap The bitmap
+ *
+ * @param summary Summary of full words in bitmap, or NULL.
+ *
+ * @param start First position to consider
+ *
+ * @param end Position after the last one to consider
+ *
+ * @param n Number of bits needed
+ *
+ * @return Position of the first bit of the run. Negative if none.
+ */
+static int bitmap_search(bitmap_t *bitmap, bitmap_t *summary,
+                         int start, int end, int n)
+{
+  int pos = start, first = start, run = 0;
+  int avail, len;
+  bitmap_t bits;
+
+  while (pos < end) {
+    if (run == 0 && summary != NULL && pos % 32 == 0) {
+      pos = 32 * bitmap_next_nonfull(summary, pos / 32, (end + 31) / 32);
+      if (pos >= end) {
+        break;
+      }
+    }
+
+    /* The bits of this word from pos onwards, shifted down. */
+    bits = bitmap[pos / 32] >> (pos % 32);
+    avail = MIN(32 - pos % 32, end - pos);
+
+    if (bits & 1) {
+      /* Skip the used bits. */
+      len = ~bits ? bitmap_ctz(~bits) : 32;
+      pos += MIN(len, avail);
+      run = 0;
+    } else {
+      len = bits ? bitmap_ctz(bits) : 32;
+      len = MIN(len, avail);
+      if (run == 0) {
+        first = pos;
+      }
+      run += len;
+      pos += len;
+      if (run >= n) {
+        return first;
+      }
+    }
+  }
+
+  return -1;
+}
+
 /**
  * Finds first zero and sets it to one.
  *
@@ -109,35 +214,187 @@ void bitmap_set(bitmap_t *bitmap, int pos, int value)
 
 int bitmap_findnset(bitmap_t *bitmap, int l)
 {
-  int i,j;
-
-  KERNEL_ASSERT(l >= 0);
-
-  /* Loop through words until a one with at least one free bit is found. */
-  for (i = 0; i < bitmap_sizeof(l)/4; i++) {
-    if (bitmap[i] != 0xffffffff) {
-      /* At least one bit in this word is zero */
-      int basepos=i*32; /* Bit position of the first bit in this word. */
-
-      /* Loop through the bits in the word until the free bit is found.*/
-      for (j = 0; j < 32; j++) {
-        if (bitmap_get(bitmap, basepos+j) == 0) {
-          if (basepos+j >= l) {
-            /* we are in the last word in the bitmap, but
-               it is not fully in use and the first "free"
-               bit is in unused portion -> return "not found". */
-            return -1;
-          }
-
-          bitmap_set(bitmap, basepos+j, 1);
-          return (basepos+j);
-        }
-      }
+  return bitmap_findnset_run(bitmap, l, 1);
+}
+
+/**
+ * Finds the first n consecutive zeros and sets them to one.
+ *
+ * @param bitmap The bitmap
+ *
+ * @param l Length of bitmap in bits
+ *
+ * @param n Number of bits to find
+ *
+ * @return Number of the first bit set. Negative if failed.
+ */
+int bitmap_findnset_run(bitmap_t *bitmap, int l, int n)
+{
+  int pos, i;
+
+  KERNEL_ASSERT(l >= 0 && n > 0);
+
+  pos = bitmap_search(bitmap, NULL, 0, l, n);
+  if (pos >= 0) {
+    for (i = pos; i < pos + n; i++) {
+      bitmap_set(bitmap, i, 1);
     }
   }
 
-  /* No free slots found */
-  return -1;
+  return pos;
+}
+
+/**
+ * Calculates the memory size in bytes needed to store the summary of
+ * a bitmap of a given number of bits.
+ *
+ * @param num_bits The number of bits in the bitmap.
+ *
+ * @return The size of the summary in bytes.
+ */
+int hbitmap_sizeof(int num_bits)
+{
+  return bitmap_sizeof((num_bits + 31) / 32);
+}
+
+/**
+ * Updates the summary bit of a word of a bitmap. The last word is
+ * full when all the bits inside the bitmap are set.
+ *
+ * @param hbitmap The bitmap
+ *
+ * @param word The index of the word
+ */
+static void hbitmap_update(hbitmap_t *hbitmap, int word)
+{
+  bitmap_t full = 0xffffffff;
+
+  if (hbitmap->size - 32 * word < 32) {
+    full >>= 32 - (hbitmap->size - 32 * word);
+  }
+
+  bitmap_set(hbitmap->summary, word,
+             (hbitmap->bits[word] & full) == full);
+}
+
+/**
+ * Initializes a bitmap with a summary. The contents of bits are kept,
+ * so the bitmap may have been read from a disk.
+ *
+ * @param hbitmap The bitmap to initialize
+ *
+ * @param bits Memory for the bits, of bitmap_sizeof(size) bytes.
+ *
+ * @param summary Memory for the summary, of hbitmap_sizeof(size)
+ * bytes.
+ *
+ * @param size The number of bits in the bitmap.
+ */
+void hbitmap_init(hbitmap_t *hbitmap, bitmap_t *bits, bitmap_t *summary,
+                  int size)
+{
+  int i;
+
+  KERNEL_ASSERT(size >= 0);
+
+  hbitmap->bits = bits;
+  hbitmap->summary = summary;
+  hbitmap->size = size;
+  hbitmap->hint = 0;
+
+  bitmap_init(summary, (size + 31) / 32);
+  for (i = 0; i < (size + 31) / 32; i++) {
+    hbitmap_update(hbitmap, i);
+  }
+}
+
+/**
+ * Gets the value of a given bit in the bitmap.
+ *
+ * @param hbitmap The bitmap
+ *
+ * @param pos The position of the bit, whose value will be returned.
+ *
+ * @return The value (0 or 1) of the given bit in the bitmap.
+ */
+int hbitmap_get(hbitmap_t *hbitmap, int pos)
+{
+  KERNEL_ASSERT(pos < hbitmap->size);
+
+  return bitmap_get(hbitmap->bits, pos);
+}
+
+/**
+ * Sets the given bit in the bitmap and updates the summary.
+ *
+ * @param hbitmap The bitmap
+ *
+ * @param pos The index of the bit to set
+ *
+ * @param value The new value of the given bit. Valid values are 0 and
+ * 1.
+ */
+void hbitmap_set(hbitmap_t *hbitmap, int pos, int value)
+{
+  KERNEL_ASSERT(pos < hbitmap->size);
+
+  bitmap_set(hbitmap->bits, pos, value);
+  hbitmap_update(hbitmap, pos / 32);
+}
+
+/**
+ * Finds a zero, starting where the previous search ended, and sets it
+ * to one.
+ *
+ * @param hbitmap The bitmap
+ *
+ * @return Number of bit set. Negative if failed.
+ */
+int hbitmap_findnset(hbitmap_t *hbitmap)
+{
+  return hbitmap_findnset_run(hbitmap, 1);
+}
+
+/**
+ * Finds n consecutive zeros, starting where the previous search ended
+ * and wrapping around to the beginning, and sets them to one.
+ *
+ * @param hbitmap The bitmap
+ *
+ * @param n Number of bits to find
+ *
+ * @return Number of the first bit set. Negative if failed.
+ */
+int hbitmap_findnset_run(hbitmap_t *hbitmap, int n)
+{
+  int start = 32 * hbitmap->hint;
+  int pos, i;
+
+  KERNEL_ASSERT(n > 0);
+
+  pos = bitmap_search(hbitmap->bits, hbitmap->summary,
+                      start, hbitmap->size, n);
+  if (pos < 0 && start > 0) {
+    pos = bitmap_search(hbitmap->bits, hbitmap->summary, 0,
+                        MIN(start + n - 1, hbitmap->size), n);
+  }
+  if (pos < 0) {
+    return pos;
+  }
+
+  for (i = pos; i < pos + n; i++) {
+    bitmap_set(hbitmap->bits, i, 1);
+  }
+  for (i = pos / 32; i <= (pos + n - 1) / 32; i++) {
+    hbitmap_update(hbitmap, i);
+  }
+
+  hbitmap->hint = (pos + n) / 32;
+  if (32 * hbitmap->hint >= hbitmap->size) {
+    hbitmap->hint = 0;
+  }
+
+  return pos;
 }
 
 /** @} */
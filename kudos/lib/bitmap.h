@@ -14,5 +14,24 @@ void bitmap_init(bitmap_t *bitmap, int size);
 int bitmap_get(bitmap_t *bitmap, int pos);
 void bitmap_set(bitmap_t *bitmap, int pos, int value);
 int bitmap_findnset(bitmap_t *bitmap, int l);
+int bitmap_findnset_run(bitmap_t *bitmap, int l, int n);
+
+/* A bitmap with a summary level for faster searching. Bit i of the
+   summary is set when word i of the bitmap is full. Searches start
+   where the previous allocation ended (next fit). */
+typedef struct {
+  bitmap_t *bits;     /* The bitmap itself */
+  bitmap_t *summary;  /* One bit per word of bits */
+  int size;           /* Number of bits in the bitmap */
+  int hint;           /* Word where the next search starts */
+} hbitmap_t;
+
+int hbitmap_sizeof(int num_bits);
+void hbitmap_init(hbitmap_t *hbitmap, bitmap_t *bits, bitmap_t *summary,
+                  int size);
+int hbitmap_get(hbitmap_t *hbitmap, int pos);
+void hbitmap_set(hbitmap_t *hbitmap, int pos, int value);
+int hbitmap_findnset(hbitmap_t *hbitmap);
+int hbitmap_findnset_run(hbitmap_t *hbitmap, int n);
 
 #endif // KUDOS_LIB_BITMAP_H
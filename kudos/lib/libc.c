@@ -136,78 +136,6 @@ char *stringcopy(char *target, const char *source, int buflen)
 }
 
 
-/**
- * Copies memory buffer of size buflen from source to target. The
- * target buffer should be at least buflen long.
- *
- * @param buflen The number of bytes to be copied.
- *
- * @param target The target buffer of the copy operation.
- *
- * @param source The source buffer to be copied.
- *
- */
-void memcopy(int buflen, void *target, const void *source)
-{
-  int i;
-  char *t;
-  const char *s;
-  uint32_t *tgt;
-  const uint32_t *src;
-
-  tgt = (uint32_t *) target;
-  src = (uint32_t *) source;
-
-  if(((uintptr_t)tgt % 4) != 0 || ((uintptr_t)src % 4) != 0 )
-    {
-      t = (char *)tgt;
-      s = (const char *)src;
-
-      for(i = 0; i < buflen; i++) {
-        t[i] = s[i];
-      }
-
-      return;
-    }
-
-  for(i = 0; i < (buflen/4); i++) {
-    *tgt = *src;
-    tgt++;
-    src++;
-  }
-
-
-  t = (char *)tgt;
-  s = (const char *)src;
-
-  for(i = 0; i < (buflen%4); i++) {
-    t[i] = s[i];
-  }
-
-  return;
-}
-
-
-/**
- * Sets size bytes in target to value.
- *
- * @param target The target buffer of the set operation.
- *
- * @param value What the bytes should be set to.
- *
- * @param size How many bytes to set.
- *
- */
-void memoryset(void *target, char value, int size)
-{
-  int i;
-  char *tgt;
-
-  tgt = (char *)target;
-  for(i = 0; i < size; i++)
-    tgt[i] = value;
-}
-
 /** Converts the initial portion of a string to an integer
  * (e.g. "-23av34" converts to -23 and "a123" to 0). Works just like
  * atoi() in the C library. Errors are ignored, so too long numbers
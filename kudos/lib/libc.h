@@ -36,10 +36,10 @@ int stringcmp(const char *str1, const char *str2);
 char *stringcopy(char *target, const char *source, int buflen);
 int strlen(const char *str);
 
-/* memory copy */
+/* memory copy (optimized for each architecture in lib/<arch>/memory.c) */
 void memcopy(int buflen, void *target, const void *source);
 
-/* memory set */
+/* memory set (lib/<arch>/memory.c) */
 void memoryset(void *target, char value, int size);
 
 /* convert string to integer */
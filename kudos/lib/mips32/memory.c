@@ -0,0 +1,118 @@
+/*
+ * Memory copying and filling for mips32.
+ */
+
+#include "lib/libc.h"
+
+/**
+ * Copies memory buffer of size buflen from source to target. The
+ * target buffer should be at least buflen long. The buffers must not
+ * overlap.
+ *
+ * If the buffers are equally aligned, the first bytes are copied one
+ * by one until they are word aligned, and the bulk of the buffer is
+ * then copied a word at a time, eight words per loop iteration.
+ * Otherwise, and for the last bytes, the copy is bytewise.
+ *
+ * @param buflen The number of bytes to be copied.
+ *
+ * @param target The target buffer of the copy operation.
+ *
+ * @param source The source buffer to be copied.
+ *
+ */
+void memcopy(int buflen, void *target, const void *source)
+{
+  uint8_t *t = (uint8_t *)target;
+  const uint8_t *s = (const uint8_t *)source;
+  uint32_t *tw;
+  const uint32_t *sw;
+
+  if ((((uintptr_t)t ^ (uintptr_t)s) & 3) == 0) {
+    while (((uintptr_t)t & 3) != 0 && buflen > 0) {
+      *t++ = *s++;
+      buflen--;
+    }
+
+    tw = (uint32_t *)t;
+    sw = (const uint32_t *)s;
+
+    while (buflen >= 32) {
+      tw[0] = sw[0];
+      tw[1] = sw[1];
+      tw[2] = sw[2];
+      tw[3] = sw[3];
+      tw[4] = sw[4];
+      tw[5] = sw[5];
+      tw[6] = sw[6];
+      tw[7] = sw[7];
+      tw += 8;
+      sw += 8;
+      buflen -= 32;
+    }
+
+    while (buflen >= 4) {
+      *tw++ = *sw++;
+      buflen -= 4;
+    }
+
+    t = (uint8_t *)tw;
+    s = (const uint8_t *)sw;
+  }
+
+  while (buflen > 0) {
+    *t++ = *s++;
+    buflen--;
+  }
+}
+
+/**
+ * Sets size bytes in target to value.
+ *
+ * Like memcopy(), the bulk of the buffer is stored a word at a time,
+ * eight words per loop iteration.
+ *
+ * @param target The target buffer of the set operation.
+ *
+ * @param value What the bytes should be set to.
+ *
+ * @param size How many bytes to set.
+ *
+ */
+void memoryset(void *target, char value, int size)
+{
+  uint8_t *t = (uint8_t *)target;
+  uint32_t *tw;
+  uint32_t pattern = 0x01010101 * (uint8_t)value;
+
+  while (((uintptr_t)t & 3) != 0 && size > 0) {
+    *t++ = value;
+    size--;
+  }
+
+  tw = (uint32_t *)t;
+
+  while (size >= 32) {
+    tw[0] = pattern;
+    tw[1] = pattern;
+    tw[2] = pattern;
+    tw[3] = pattern;
+    tw[4] = pattern;
+    tw[5] = pattern;
+    tw[6] = pattern;
+    tw[7] = pattern;
+    tw += 8;
+    size -= 32;
+  }
+
+  while (size >= 4) {
+    *tw++ = pattern;
+    size -= 4;
+  }
+
+  t = (uint8_t *)tw;
+  while (size > 0) {
+    *t++ = value;
+    size--;
+  }
+}
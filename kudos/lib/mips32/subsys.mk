@@ -3,6 +3,6 @@
 # Set the module name
 MODULE := lib/mips32
 
-FILES := rand.S
+FILES := rand.S memory.c
 
 MIPSSRC += $(patsubst %, $(MODULE)/%, $(FILES))
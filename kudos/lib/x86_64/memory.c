@@ -0,0 +1,95 @@
+/*
+ * Memory copying and filling for x86_64.
+ */
+
+#include "lib/libc.h"
+
+/* Buffers shorter than this are handled bytewise; aligning them would
+   cost more than it saves */
+#define MEMORY_ALIGN_THRESHOLD 64
+
+/**
+ * Copies memory buffer of size buflen from source to target. The
+ * target buffer should be at least buflen long. The buffers must not
+ * overlap.
+ *
+ * The bulk of the buffer is copied 8 bytes at a time with rep movsq,
+ * after aligning the target to 8 bytes, and the remaining bytes with
+ * rep movsb.
+ *
+ * @param buflen The number of bytes to be copied.
+ *
+ * @param target The target buffer of the copy operation.
+ *
+ * @param source The source buffer to be copied.
+ *
+ */
+void memcopy(int buflen, void *target, const void *source)
+{
+  uint64_t count, head;
+
+  if (buflen <= 0) {
+    return;
+  }
+  count = buflen;
+
+  if (count >= MEMORY_ALIGN_THRESHOLD) {
+    head = -(uintptr_t)target & 7;
+    count -= head;
+    asm volatile("rep movsb"
+                 : "+D" (target), "+S" (source), "+c" (head)
+                 : : "memory");
+
+    head = count / 8;
+    count %= 8;
+    asm volatile("rep movsq"
+                 : "+D" (target), "+S" (source), "+c" (head)
+                 : : "memory");
+  }
+
+  asm volatile("rep movsb"
+               : "+D" (target), "+S" (source), "+c" (count)
+               : : "memory");
+}
+
+/**
+ * Sets size bytes in target to value.
+ *
+ * Like memcopy(), the bulk of the buffer is stored 8 bytes at a time
+ * with rep stosq after aligning the target.
+ *
+ * @param target The target buffer of the set operation.
+ *
+ * @param value What the bytes should be set to.
+ *
+ * @param size How many bytes to set.
+ *
+ */
+void memoryset(void *target, char value, int size)
+{
+  uint64_t count, head;
+  uint64_t pattern = 0x0101010101010101ULL * (uint8_t)value;
+
+  if (size <= 0) {
+    return;
+  }
+  count = size;
+
+  if (count >= MEMORY_ALIGN_THRESHOLD) {
+    head = -(uintptr_t)target & 7;
+    count -= head;
+    asm volatile("rep stosb"
+                 : "+D" (target), "+c" (head)
+                 : "a" (pattern) : "memory");
+
+    head = count / 8;
+    count %= 8;
+    asm volatile("rep stosq"
+                 : "+D" (target), "+c" (head)
+                 : "a" (pattern) : "memory");
+  }
+
+  asm volatile("rep stosb"
+               : "+D" (target), "+c" (count)
+               : "a" (pattern) : "memory");
+}
@@ -3,6 +3,6 @@
 # Set the module name
 MODULE := lib/x86_64
 
-FILES := asm.c srand.c _asm.S
+FILES := asm.c srand.c memory.c _asm.S
 
 X64SRC += $(patsubst %, $(MODULE)/%, $(FILES))
@@ -0,0 +1,140 @@
+/*
+ * File descriptor tables.
+ */
+
+#include "proc/fd.h"
+#include "proc/syscall.h"
+#include "fs/vfs.h"
+#include "kernel/assert.h"
+#include "lib/libc.h"
+
+/** @name File descriptor tables
+ *
+ * Maps the small integers userland uses for files to open files of
+ * VFS. Each process has a table of its own, in which a new descriptor
+ * is always the lowest one free. A table is only used by the thread
+ * of its process, so it needs no lock.
+ *
+ * @{
+ */
+
+/**
+ * Initializes the descriptor table of a new process. The console is
+ * open as FILEHANDLE_STDIN, FILEHANDLE_STDOUT and FILEHANDLE_STDERR.
+ *
+ * @param table The table
+ */
+void fd_init(fd_table_t *table)
+{
+  int fd;
+
+  bitmap_init(table->used, FD_MAX_FILES);
+  for (fd = FILEHANDLE_STDIN; fd <= FILEHANDLE_STDERR; fd++) {
+    bitmap_set(table->used, fd, 1);
+    table->files[fd] = FD_CONSOLE;
+  }
+}
+
+/**
+ * Gives a forked process the descriptors of its parent. The files
+ * are shared, seek positions included.
+ *
+ * @param parent Table of the parent
+ *
+ * @param child Table of the child
+ */
+void fd_fork(fd_table_t *parent, fd_table_t *child)
+{
+  int fd;
+
+  *child = *parent;
+  for (fd = 0; fd < FD_MAX_FILES; fd++) {
+    if (bitmap_get(child->used, fd) && child->files[fd] != FD_CONSOLE) {
+      vfs_dup(child->files[fd]);
+    }
+  }
+}
+
+/**
+ * Gives an open file a descriptor. The descriptor takes over the
+ * caller's reference to the file.
+ *
+ * @param table The table
+ *
+ * @param file The open file
+ *
+ * @return The lowest free descriptor, or negative if the table is full.
+ */
+int fd_alloc(fd_table_t *table, openfile_t file)
+{
+  int fd = bitmap_findnset(table->used, FD_MAX_FILES);
+
+  if (fd >= 0) {
+    table->files[fd] = file;
+  }
+  return fd;
+}
+
+/**
+ * Looks up the open file of a descriptor.
+ *
+ * @param table The table
+ *
+ * @param fd The descriptor
+ *
+ * @param file Set to the open file, or FD_CONSOLE
+ *
+ * @return 0, or negative if fd is not in use.
+ */
+int fd_get(fd_table_t *table, int fd, openfile_t *file)
+{
+  if (fd < 0 || fd >= FD_MAX_FILES || !bitmap_get(table->used, fd)) {
+    return -1;
+  }
+
+  *file = table->files[fd];
+  return 0;
+}
+
+/**
+ * Frees a descriptor, closing its file if this was the last reference.
+ *
+ * @param table The table
+ *
+ * @param fd The descriptor
+ *
+ * @return VFS_OK, or negative on error.
+ */
+int fd_close(fd_table_t *table, int fd)
+{
+  openfile_t file;
+
+  if (fd_get(table, fd, &file) < 0) {
+    return VFS_INVALID_PARAMS;
+  }
+
+  bitmap_set(table->used, fd, 0);
+  if (file == FD_CONSOLE) {
+    return VFS_OK;
+  }
+  return vfs_close(file);
+}
+
+/**
+ * Frees all descriptors of an exiting process.
+ *
+ * @param table The table
+ */
+void fd_close_all(fd_table_t *table)
+{
+  int fd;
+
+  for (fd = 0; fd < FD_MAX_FILES; fd++) {
+    if (bitmap_get(table->used, fd) && table->files[fd] != FD_CONSOLE) {
+      vfs_close(table->files[fd]);
+    }
+  }
+  bitmap_init(table->used, FD_MAX_FILES);
+}
+
+/** @} */
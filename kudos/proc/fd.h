@@ -0,0 +1,35 @@
+/*
+ * File descriptor tables.
+ */
+
+#ifndef KUDOS_PROC_FD_H
+#define KUDOS_PROC_FD_H
+
+#include "lib/bitmap.h"
+
+/* Number of descriptors of a process */
+#define FD_MAX_FILES 32
+
+/* Open file of the console descriptors (FILEHANDLE_STDIN etc.) */
+#define FD_CONSOLE (-1)
+
+/* Descriptor table of a process. A descriptor is an index to files.
+   Descriptors referring to the same open file share its seek
+   position; each holds a reference to it (see vfs_dup()). */
+typedef struct {
+  /* Descriptors in use */
+  bitmap_t used[(FD_MAX_FILES + 31) / 32];
+  /* Open file (an openfile_t) of each descriptor in use, or
+     FD_CONSOLE */
+  int files[FD_MAX_FILES];
+} fd_table_t;
+
+void fd_init(fd_table_t *table);
+void fd_fork(fd_table_t *parent, fd_table_t *child);
+
+int fd_alloc(fd_table_t *table, int file);
+int fd_get(fd_table_t *table, int fd, int *file);
+int fd_close(fd_table_t *table, int fd);
+void fd_close_all(fd_table_t *table);
+
+#endif // KUDOS_PROC_FD_H
@@ -13,10 +13,9 @@ void process_set_pagetable(pagetable_t *pagetable)
 {
   interrupt_status_t intr_status;
 
-  /* Put the mapped pages into TLB. Here we assume that the pages fit
-     into the TLB. After writing proper TLB exception handling this
-     call should be skipped, leaving the function empty. */
+  /* The TLB is filled on demand by the refill handler, which only
+     needs to know the pagetable and ASID. */
   intr_status = _interrupt_disable();
-  tlb_fill(pagetable);
+  tlb_set_pagetable(pagetable);
   _interrupt_set_state(intr_status);
 }
@@ -0,0 +1,121 @@
+/*
+ * Function Stubs
+ */
+#include "proc/mmap.h"
+#include "proc/shm.h"
+#include "proc/swap.h"
+
+/* Memory mapped files, shared memory and swapping (proc/mmap.c,
+   proc/shm.c and proc/swap.c) need the page frame reference counts of
+   x86_64. On mips32 they are not supported: mappings and segments
+   cannot be created, and nothing is ever swapped out. */
+
+void mmap_init(void)
+{
+}
+
+int mmap_open(const char *pathname, uint64_t pages)
+{
+  pathname = pathname;
+  pages = pages;
+  return -1;
+}
+
+void mmap_ref(int mapping)
+{
+  mapping = mapping;
+}
+
+void mmap_release(int mapping)
+{
+  mapping = mapping;
+}
+
+physaddr_t mmap_get_page(int mapping, uint64_t index)
+{
+  mapping = mapping;
+  index = index;
+  return 0;
+}
+
+void shm_init(void)
+{
+}
+
+int shm_create(const char *name, uint64_t pages)
+{
+  name = name;
+  pages = pages;
+  return -1;
+}
+
+int shm_attach(const char *name, uint64_t *pages)
+{
+  name = name;
+  pages = pages;
+  return -1;
+}
+
+void shm_ref(int segment)
+{
+  segment = segment;
+}
+
+void shm_release(int segment)
+{
+  segment = segment;
+}
+
+physaddr_t shm_get_page(int segment, uint64_t index)
+{
+  segment = segment;
+  index = index;
+  return 0;
+}
+
+void swap_init(void)
+{
+}
+
+void swap_balance(void)
+{
+}
+
+int swap_in(process_control_block_t *process, virtaddr_t vaddr, int flags)
+{
+  process = process;
+  vaddr = vaddr;
+  flags = flags;
+  return -1;
+}
+
+void swap_lock(void)
+{
+}
+
+void swap_unlock(void)
+{
+}
+
+void swap_fork(process_control_block_t *parent,
+               process_control_block_t *child,
+               virtaddr_t start, virtaddr_t end)
+{
+  parent = parent;
+  child = child;
+  start = start;
+  end = end;
+}
+
+void swap_discard(process_control_block_t *process,
+                  virtaddr_t start, virtaddr_t end)
+{
+  process = process;
+  start = start;
+  end = end;
+}
+
+void swap_meminfo(meminfo_t *info)
+{
+  info = info;
+}
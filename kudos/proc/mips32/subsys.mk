@@ -3,7 +3,7 @@
 # Set the module name
 MODULE := proc/mips32
 
-FILES := exception.c _syscall.c _proc.c
+FILES := exception.c _syscall.c _proc.c stubs.c
 
 MIPSSRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
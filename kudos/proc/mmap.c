@@ -0,0 +1,242 @@
+/*
+ * Memory mapped files.
+ */
+
+#include <arch.h>
+#include "proc/mmap.h"
+#include "fs/vfs.h"
+#include "kernel/semaphore.h"
+#include "kernel/assert.h"
+#include "kernel/panic.h"
+#include "lib/libc.h"
+#include "vm/memory.h"
+
+/** @name Memory mapped files
+ *
+ * Keeps the pages of files mapped into user processes. Every file is
+ * read into memory at most once, no matter how many processes map
+ * it: all mappings of a file share the same page frames read-only.
+ * Pages are read in when first touched and stay until the last
+ * mapping of the file is released. Writes to the file through VFS are
+ * not seen by pages that have already been read.
+ *
+ * @{
+ */
+
+typedef struct {
+  /* Identity of the file (see vfs_identify()), NULL fs if unused */
+  void *fs;
+  int fileid;
+  /* Our own handle of the file, used to read pages */
+  openfile_t file;
+  /* Number of mappings of the file */
+  int refs;
+  /* Frames holding the pages of the file, 0 for pages not yet read.
+     This table holds one reference to each frame. */
+  physaddr_t *frames;
+  /* Number of entries in frames */
+  uint64_t pages;
+} mmap_file_t;
+
+/** The mapped files */
+static mmap_file_t mmap_files[MMAP_MAX_FILES];
+
+/** Lock for the table and for reading pages in */
+static semaphore_t *mmap_sem;
+
+/* Number of frames backing a frame table of the given length */
+static uint64_t mmap_table_frames(uint64_t pages)
+{
+  uint64_t bytes = pages * sizeof(physaddr_t);
+
+  return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* Makes the frame table of file hold at least pages entries. Must be
+   called with mmap_sem held. */
+static void mmap_grow(mmap_file_t *file, uint64_t pages)
+{
+  physaddr_t *frames;
+
+  if (pages <= file->pages) {
+    return;
+  }
+
+  frames = kmalloc(pages * sizeof(physaddr_t));
+  memoryset(frames, 0, pages * sizeof(physaddr_t));
+  if (file->frames != NULL) {
+    memcopy(file->pages * sizeof(physaddr_t), frames, file->frames);
+    physmem_freeblocks(file->frames, mmap_table_frames(file->pages));
+  }
+
+  file->frames = frames;
+  file->pages = pages;
+}
+
+/**
+ * Initializes the table of mapped files. Must be called after
+ * semaphore_init().
+ */
+void mmap_init(void)
+{
+  int i;
+
+  mmap_sem = semaphore_create(1);
+  KERNEL_ASSERT(mmap_sem != NULL);
+
+  for (i = 0; i < MMAP_MAX_FILES; i++) {
+    memoryset(&mmap_files[i], 0, sizeof(mmap_file_t));
+  }
+}
+
+/**
+ * Starts a mapping of the first pages of a file. If the file is
+ * already mapped, its pages are shared with the existing mappings.
+ *
+ * @param pathname The file to map.
+ *
+ * @param pages Number of pages of the file to map.
+ *
+ * @return The mapping, for use with the other mmap_* functions, or
+ * negative on error.
+ */
+int mmap_open(const char *pathname, uint64_t pages)
+{
+  openfile_t file;
+  void *fs;
+  int fileid;
+  int i, free_slot = -1;
+
+  file = vfs_open((char *)pathname);
+  if (file < 0) {
+    return -1;
+  }
+
+  if (vfs_identify(file, &fs, &fileid) != VFS_OK) {
+    vfs_close(file);
+    return -1;
+  }
+
+  semaphore_P(mmap_sem);
+
+  for (i = 0; i < MMAP_MAX_FILES; i++) {
+    if (mmap_files[i].fs == fs && mmap_files[i].fileid == fileid) {
+      break;
+    }
+    if (mmap_files[i].fs == NULL && free_slot < 0) {
+      free_slot = i;
+    }
+  }
+
+  if (i < MMAP_MAX_FILES) {
+    /* Already mapped, our own handle is not needed */
+    vfs_close(file);
+  } else if (free_slot >= 0) {
+    i = free_slot;
+    mmap_files[i].fs = fs;
+    mmap_files[i].fileid = fileid;
+    mmap_files[i].file = file;
+  } else {
+    semaphore_V(mmap_sem);
+    vfs_close(file);
+    return -1;
+  }
+
+  mmap_grow(&mmap_files[i], pages);
+  mmap_files[i].refs++;
+
+  semaphore_V(mmap_sem);
+  return i;
+}
+
+/**
+ * Adds a mapping of an already mapped file, e.g. when a process with
+ * mappings is forked.
+ */
+void mmap_ref(int mapping)
+{
+  KERNEL_ASSERT(mapping >= 0 && mapping < MMAP_MAX_FILES);
+
+  semaphore_P(mmap_sem);
+  KERNEL_ASSERT(mmap_files[mapping].refs > 0);
+  mmap_files[mapping].refs++;
+  semaphore_V(mmap_sem);
+}
+
+/**
+ * Ends a mapping. When the last mapping of a file ends, its pages are
+ * dropped and the file is closed. Pages still mapped in page tables
+ * keep their own references and are freed when those go away.
+ */
+void mmap_release(int mapping)
+{
+  mmap_file_t *file;
+  uint64_t i;
+
+  KERNEL_ASSERT(mapping >= 0 && mapping < MMAP_MAX_FILES);
+  file = &mmap_files[mapping];
+
+  semaphore_P(mmap_sem);
+  KERNEL_ASSERT(file->refs > 0);
+
+  if (--file->refs > 0) {
+    semaphore_V(mmap_sem);
+    return;
+  }
+
+  for (i = 0; i < file->pages; i++) {
+    if (file->frames[i] != 0) {
+      physmem_unref(file->frames[i], 1);
+    }
+  }
+  physmem_freeblocks(file->frames, mmap_table_frames(file->pages));
+  vfs_close(file->file);
+  memoryset(file, 0, sizeof(mmap_file_t));
+
+  semaphore_V(mmap_sem);
+}
+
+/**
+ * Returns the frame holding a page of a mapped file, reading it in
+ * if this is the first time the page is used. The frame gets an extra
+ * reference, which belongs to the caller's page table mapping. The
+ * part of the page beyond the end of the file is zero. May sleep.
+ *
+ * @param mapping The mapping.
+ *
+ * @param index Page number in the file.
+ *
+ * @return The frame, or 0 if the page could not be read, which is
+ * also the case for pages wholly beyond the end of the file.
+ */
+physaddr_t mmap_get_page(int mapping, uint64_t index)
+{
+  mmap_file_t *file;
+  physaddr_t frame;
+
+  KERNEL_ASSERT(mapping >= 0 && mapping < MMAP_MAX_FILES);
+  file = &mmap_files[mapping];
+
+  semaphore_P(mmap_sem);
+  KERNEL_ASSERT(index < file->pages);
+
+  frame = file->frames[index];
+  if (frame == 0) {
+    frame = physmem_alloc_zeroed();
+    if (vfs_seek(file->file, index * PAGE_SIZE) != VFS_OK
+        || vfs_read(file->file, (void*)ADDR_PHYS_TO_KERNEL(frame),
+                    PAGE_SIZE) <= 0) {
+      physmem_unref(frame, 1);
+      semaphore_V(mmap_sem);
+      return 0;
+    }
+    file->frames[index] = frame;
+  }
+
+  physmem_ref(frame, 1);
+
+  semaphore_V(mmap_sem);
+  return frame;
+}
+
+/** @} */
@@ -0,0 +1,20 @@
+/*
+ * Memory mapped files.
+ */
+
+#ifndef KUDOS_PROC_MMAP_H
+#define KUDOS_PROC_MMAP_H
+
+#include "lib/types.h"
+
+/* Maximum number of different files mapped at the same time */
+#define MMAP_MAX_FILES 16
+
+void mmap_init(void);
+
+int mmap_open(const char *pathname, uint64_t pages);
+void mmap_ref(int mapping);
+void mmap_release(int mapping);
+physaddr_t mmap_get_page(int mapping, uint64_t index);
+
+#endif // KUDOS_PROC_MMAP_H
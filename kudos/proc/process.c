@@ -5,12 +5,17 @@
 #include <arch.h>
 #include "proc/process.h"
 #include "proc/elf.h"
+#include "proc/mmap.h"
+#include "proc/shm.h"
+#include "proc/swap.h"
 #include "kernel/thread.h"
 #include "kernel/assert.h"
 #include "kernel/interrupt.h"
 #include "kernel/config.h"
+#include "kernel/spinlock.h"
 #include "fs/vfs.h"
 #include "kernel/sleepq.h"
+#include "lib/libc.h"
 #include "vm/memory.h"
 
 
@@ -19,7 +24,367 @@
  * This module contains functions for starting and managing userland
  * processes.
  */
-extern void process_set_pagetable(pagetable_t*);
+
+/** The process table */
+static process_control_block_t process_table[PROCESS_MAX_PROCESSES];
+
+/** Lock protecting the state fields of the process table */
+static spinlock_t process_table_slock;
+
+/**
+ * Initializes the process table. Must be called before any process
+ * is started.
+ */
+void process_init(void)
+{
+  int i;
+
+  spinlock_reset(&process_table_slock);
+
+  for (i = 0; i < PROCESS_MAX_PROCESSES; i++) {
+    memoryset(&process_table[i], 0, sizeof(process_control_block_t));
+    process_table[i].state = PROCESS_FREE;
+    process_table[i].executable = -1;
+  }
+}
+
+/**
+ * Reserves a free process table entry.
+ *
+ * @return The PID of the reserved entry, or PROCESS_PTABLE_FULL.
+ */
+static process_id_t process_alloc(void)
+{
+  interrupt_status_t intr_status;
+  process_id_t pid;
+
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&process_table_slock);
+
+  for (pid = 0; pid < PROCESS_MAX_PROCESSES; pid++) {
+    if (process_table[pid].state == PROCESS_FREE) {
+      memoryset(&process_table[pid], 0, sizeof(process_control_block_t));
+      process_table[pid].state = PROCESS_RUNNING;
+      process_table[pid].executable = -1;
+      break;
+    }
+  }
+
+  spinlock_release(&process_table_slock);
+  _interrupt_set_state(intr_status);
+
+  if (pid == PROCESS_MAX_PROCESSES) {
+    return PROCESS_PTABLE_FULL;
+  }
+  return pid;
+}
+
+/**
+ * Returns the process control block of the process the current thread
+ * belongs to, or NULL for kernel threads.
+ */
+process_control_block_t *process_get_current_process_entry(void)
+{
+  process_id_t pid = thread_get_current_thread_entry()->process_id;
+
+  if (pid < 0) {
+    return NULL;
+  }
+  return &process_table[pid];
+}
+
+/**
+ * Returns the process control block of the given process.
+ */
+process_control_block_t *process_get_process_entry(process_id_t pid)
+{
+  KERNEL_ASSERT(pid >= 0 && pid < PROCESS_MAX_PROCESSES);
+  return &process_table[pid];
+}
+
+/**
+ * Adds a demand paged region to the address space of a process. No
+ * memory is allocated until the pages are touched.
+ *
+ * @param process The process.
+ *
+ * @param start Page aligned start address of the region.
+ *
+ * @param size Size of the region in bytes (a multiple of PAGE_SIZE).
+ *
+ * @param flags PROCESS_REGION_* flags.
+ *
+ * @param file Backing file, or negative for zero filled memory.
+ *
+ * @param offset Offset of the region in the backing file.
+ *
+ * @param filesize Number of bytes backed by the file; the rest of the
+ * region is zero filled.
+ *
+ * @return 0 on success, negative if the region table is full.
+ */
+int process_add_region(process_control_block_t *process,
+                       virtaddr_t start, uint64_t size, int flags,
+                       int file, uint64_t offset, uint64_t filesize)
+{
+  int i;
+
+  KERNEL_ASSERT((start & PAGE_OFFSET_MASK) == 0);
+  KERNEL_ASSERT((size & PAGE_OFFSET_MASK) == 0);
+
+  for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+    process_region_t *region = &process->regions[i];
+    if (region->size == 0) {
+      region->start = start;
+      region->size = size;
+      region->flags = flags;
+      region->file = file;
+      region->offset = offset;
+      region->filesize = filesize;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Finds the region of a process containing the given address.
+ *
+ * @return The region, or NULL if vaddr is not in any region.
+ */
+process_region_t *process_find_region(process_control_block_t *process,
+                                      virtaddr_t vaddr)
+{
+  int i;
+
+  for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+    process_region_t *region = &process->regions[i];
+    if (region->size != 0 && vaddr >= region->start
+        && vaddr - region->start < region->size) {
+      return region;
+    }
+  }
+
+  return NULL;
+}
+
+/* Gives the process a private copy of the page at vaddr, which is
+   mapped read-only because it is shared copy-on-write. If no other
+   address space maps the frames any more they are simply made
+   writable again. */
+static int process_copy_on_write(pagetable_t *pagetable, virtaddr_t vaddr)
+{
+  physaddr_t old_frame, new_frame;
+  virtaddr_t page;
+  uint64_t i;
+  int shared = 0;
+
+  if (vm_is_huge_mapping(pagetable, vaddr)) {
+    page = vaddr & PAGE_HUGE_MASK;
+    old_frame = vm_getmap(pagetable, page);
+
+    for (i = 0; i < PAGE_HUGE_SIZE; i += PAGE_SIZE) {
+      if (physmem_refcount(old_frame + i) > 1) {
+        shared = 1;
+      }
+    }
+
+    if (!shared) {
+      vm_set_dirty(pagetable, page, 1);
+      return 0;
+    }
+
+    new_frame = physmem_allochuge();
+    if (new_frame != 0) {
+      memcopy(PAGE_HUGE_SIZE, (void*)ADDR_PHYS_TO_KERNEL(new_frame),
+              (void*)ADDR_PHYS_TO_KERNEL(old_frame));
+      vm_map_huge(pagetable, new_frame, page, PAGE_USER | PAGE_WRITE);
+      physmem_unref(old_frame, PAGE_HUGE_SIZE / PAGE_SIZE);
+      return 0;
+    }
+
+    /* No free 2 MiB run, so only copy the 4 KiB page that faulted */
+    vm_split_huge(pagetable, page);
+  }
+
+  page = vaddr & PAGE_SIZE_MASK;
+  old_frame = vm_getmap(pagetable, page);
+
+  if (physmem_refcount(old_frame) == 1) {
+    vm_set_dirty(pagetable, page, 1);
+    return 0;
+  }
+
+  new_frame = physmem_allocblock();
+  KERNEL_ASSERT(new_frame != 0);
+  memcopy(PAGE_SIZE, (void*)ADDR_PHYS_TO_KERNEL(new_frame),
+          (void*)ADDR_PHYS_TO_KERNEL(old_frame));
+  vm_map(pagetable, new_frame, page, PAGE_USER | PAGE_WRITE);
+  physmem_unref(old_frame, 1);
+
+  return 0;
+}
+
+/* Returns non-zero if nothing in the 2 MiB page at vaddr is mapped. */
+static int process_huge_page_unmapped(pagetable_t *pagetable,
+                                      virtaddr_t vaddr)
+{
+  virtaddr_t end = vaddr + PAGE_HUGE_SIZE;
+
+  /* Swapped out pages count as mapped */
+  return vm_find_page(pagetable, vaddr, end, 0) == end
+    && vm_find_page(pagetable, vaddr, end, 1) == end;
+}
+
+/**
+ * Resolves a page fault in the current process by allocating and
+ * filling the page from the region containing the faulting address.
+ * When the region covers the whole 2 MiB aligned block around the
+ * address, a 2 MiB page is used if one is available. The page is
+ * filled through the identity mapping, so it only becomes visible to
+ * the process once it is complete. May sleep while reading the
+ * backing file. Writes to pages shared copy-on-write are resolved by
+ * copying the page.
+ *
+ * @param vaddr The faulting address.
+ *
+ * @param write Non-zero if the access was a write.
+ *
+ * @return 0 if the fault was resolved, negative if the access is
+ * illegal.
+ */
+int process_handle_page_fault(virtaddr_t vaddr, int write)
+{
+  process_control_block_t *process;
+  process_region_t *region;
+  physaddr_t frame = 0;
+  virtaddr_t page;
+  uint64_t size = PAGE_SIZE;
+  uint64_t offset, to_read;
+  int flags = PAGE_USER;
+
+  process = process_get_current_process_entry();
+  if (process == NULL) {
+    return -1;
+  }
+
+  region = process_find_region(process, vaddr);
+  if (region == NULL) {
+    return -1;
+  }
+
+  if (write && !(region->flags & PROCESS_REGION_WRITE)) {
+    return -1;
+  }
+
+  if (region->flags & PROCESS_REGION_WRITE) {
+    flags |= PAGE_WRITE;
+  }
+
+  /* Make sure there is a frame to resolve the fault with */
+  swap_balance();
+
+  /* The page is present, so this is a protection fault. In a
+     writable region that means the page is shared copy-on-write. */
+  if (vm_getmap(process->pagetable, vaddr) != 0) {
+    if (write) {
+      return process_copy_on_write(process->pagetable, vaddr);
+    }
+    return -1;
+  }
+
+  if (vm_get_swapped(process->pagetable, vaddr) != 0) {
+    return swap_in(process, vaddr & PAGE_SIZE_MASK, flags);
+  }
+
+  if (region->flags & PROCESS_REGION_MAPPED) {
+    page = vaddr & PAGE_SIZE_MASK;
+    frame = mmap_get_page(region->mapping,
+                          (page - region->start) / PAGE_SIZE);
+    if (frame == 0) {
+      return -1;
+    }
+    vm_map(process->pagetable, frame, page, PAGE_USER);
+    return 0;
+  }
+
+  if (region->flags & PROCESS_REGION_SHARED) {
+    page = vaddr & PAGE_SIZE_MASK;
+    frame = shm_get_page(region->mapping,
+                         (page - region->start) / PAGE_SIZE);
+    vm_map(process->pagetable, frame, page, PAGE_USER | PAGE_WRITE);
+    return 0;
+  }
+
+  page = vaddr & PAGE_HUGE_MASK;
+  if (page >= region->start
+      && page - region->start + PAGE_HUGE_SIZE <= region->size
+      && process_huge_page_unmapped(process->pagetable, page)) {
+    frame = physmem_allochuge();
+    if (frame != 0) {
+      size = PAGE_HUGE_SIZE;
+    }
+  }
+
+  if (frame == 0) {
+    page = vaddr & PAGE_SIZE_MASK;
+    frame = physmem_alloc_zeroed();
+    KERNEL_ASSERT(frame != 0);
+  } else {
+    memoryset((void*)ADDR_PHYS_TO_KERNEL(frame), 0, size);
+  }
+
+  offset = page - region->start;
+  if (region->file >= 0 && offset < region->filesize) {
+    to_read = MIN(size, region->filesize - offset);
+    if (vfs_seek(region->file, region->offset + offset) != VFS_OK
+        || vfs_read(region->file, (void*)ADDR_PHYS_TO_KERNEL(frame),
+                    to_read) != (int)to_read) {
+      if (size == PAGE_HUGE_SIZE) {
+        physmem_freehuge(frame);
+      } else {
+        physmem_freeblock((void*)frame);
+      }
+      return -1;
+    }
+  }
+
+  if (size == PAGE_HUGE_SIZE) {
+    vm_map_huge(process->pagetable, frame, page, flags);
+  } else {
+    vm_map(process->pagetable, frame, page, flags);
+  }
+
+  return 0;
+}
+
+/* Allocates, zeroes and maps the user stack of a process. The stack
+   cannot be demand paged, since page faults are taken on the current
+   stack. The pages are usually zeroed ahead of time by the idle
+   thread (see physmem_alloc_zeroed()). */
+static void process_setup_stack(process_control_block_t *process)
+{
+  physaddr_t phys_page;
+  virtaddr_t virt_page;
+  int i;
+
+  swap_balance();
+
+  for(i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++) {
+    phys_page = physmem_alloc_zeroed();
+    KERNEL_ASSERT(phys_page != 0);
+    virt_page = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE;
+    vm_map(process->pagetable, phys_page,
+           virt_page, PAGE_USER | PAGE_WRITE);
+  }
+  process_add_region(process,
+                     (USERLAND_STACK_TOP & PAGE_SIZE_MASK)
+                     - (CONFIG_USERLAND_STACK_SIZE - 1)*PAGE_SIZE,
+                     CONFIG_USERLAND_STACK_SIZE*PAGE_SIZE,
+                     PROCESS_REGION_WRITE | PROCESS_REGION_STACK,
+                     -1, 0, 0);
+}
 
 /* Return non-zero on error. */
 int setup_new_process(TID_t thread,
@@ -29,17 +394,14 @@ int setup_new_process(TID_t thread,
   pagetable_t *pagetable;
   elf_info_t elf;
   openfile_t file;
-  uintptr_t phys_page;
-  virtaddr_t virt_page;
-  int i, res;
-  interrupt_status_t intr_status;
-  TID_t current_thread = thread_get_current_thread();
-  pml4_t *current_pml4;
+  int res;
   thread_table_t *thread_entry = thread_get_thread_entry(thread);
+  process_control_block_t *process;
+
+  argv_src = argv_src;
 
-  //Save the currently running threads page table
-  current_pml4 = thread_get_thread_entry(current_thread)
-      ->context->virt_memory;
+  KERNEL_ASSERT(thread_entry->process_id >= 0);
+  process = &process_table[thread_entry->process_id];
 
   file = vfs_open((char *)executable);
 
@@ -50,11 +412,13 @@ int setup_new_process(TID_t thread,
 
   res = elf_parse_header(&elf, file);
   if (res < 0) {
+    vfs_close(file);
     return -1;
   }
 
   /* Trivial and naive sanity check for entry point: */
   if (elf.entry_point <= VMM_KERNEL_SPACE) {
+    vfs_close(file);
     return -1;
   }
 
@@ -63,88 +427,41 @@ int setup_new_process(TID_t thread,
   //Create new page table
   pagetable = vm_create_pagetable(thread);
 
-  //We don't want to be interrupted when we potentially
-  //is running with the wrong page tables mapped in ;)
-  intr_status = _interrupt_disable();
+  thread_entry->pagetable = pagetable;
+  process->pagetable = pagetable;
+  process->executable = file;
 
-  //Change the page table of the currently running thread
-  process_set_pagetable(pagetable);
+  stringcopy(process->name, executable, PROCESS_MAX_FILELENGTH);
+  fd_init(&process->files);
 
-  thread_entry->pagetable = pagetable;
+  process_setup_stack(process);
 
-  /* Allocate and map stack */
-  for(i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++) {
-    phys_page = physmem_allocblock();
-    KERNEL_ASSERT(phys_page != 0);
-    virt_page = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE;
-    vm_map(pagetable, phys_page,
-           virt_page, PAGE_USER | PAGE_WRITE);
-    /* Zero the page */
-    memoryset((void*)virt_page, 0, PAGE_SIZE);
+  /* The ELF segments are demand paged: their pages are allocated and
+     read from the executable by process_handle_page_fault() when they
+     are first touched. We assume that the segments begin at a page
+     boundary. (The linker script in the userland directory helps
+     users get this right.) */
+  if (elf.ro_pages > 0) {
+    process_add_region(process, elf.ro_vaddr, elf.ro_pages*PAGE_SIZE,
+                       0, file, elf.ro_location, elf.ro_size);
   }
-
-  /* Allocate and map pages for the ELF segments. We assume that
-     the segments begin at a page boundary. (The linker script
-     in the userland directory helps users get this right.) */
-  for(i = 0; i < (int)elf.ro_pages; i++) {
-    int left_to_read = elf.ro_size - i*PAGE_SIZE;
-    phys_page = physmem_allocblock();
-    KERNEL_ASSERT(phys_page != 0);
-    virt_page = elf.ro_vaddr + i*PAGE_SIZE;
-    vm_map(pagetable, phys_page,
-           virt_page, PAGE_USER | PAGE_WRITE);
-    /* Zero the page */
-    memoryset((void*)virt_page, 0, PAGE_SIZE);
-    /* Fill the page from ro segment */
-    if (left_to_read > 0) {
-      KERNEL_ASSERT(vfs_seek(file, elf.ro_location + i*PAGE_SIZE) == VFS_OK);
-      KERNEL_ASSERT(vfs_read(file, virt_page,
-                             MIN(PAGE_SIZE, left_to_read))
-                    == (int) MIN(PAGE_SIZE, left_to_read));
-    }
-    //Make the page read only
-    vm_map(pagetable, phys_page,
-            virt_page, PAGE_USER);
-  }
-
-  for(i = 0; i < (int)elf.rw_pages; i++) {
-    int left_to_read = elf.rw_size - i*PAGE_SIZE;
-    phys_page = physmem_allocblock();
-    KERNEL_ASSERT(phys_page != 0);
-    virt_page = elf.rw_vaddr + i*PAGE_SIZE;
-    vm_map(pagetable, phys_page,
-           virt_page, PAGE_USER | PAGE_WRITE);
-    /* Zero the page */
-    memoryset((void*)virt_page, 0, PAGE_SIZE);
-    /* Fill the page from rw segment */
-    if (left_to_read > 0) {
-      KERNEL_ASSERT(vfs_seek(file, elf.rw_location + i*PAGE_SIZE) == VFS_OK);
-      KERNEL_ASSERT(vfs_read(file, (void*)virt_page,
-                             MIN(PAGE_SIZE, left_to_read))
-                    == (int) MIN(PAGE_SIZE, left_to_read));
-    }
+  if (elf.rw_pages > 0) {
+    process_add_region(process, elf.rw_vaddr, elf.rw_pages*PAGE_SIZE,
+                       PROCESS_REGION_WRITE, file,
+                       elf.rw_location, elf.rw_size);
   }
 
-  /* Done with the file. */
-  vfs_close(file);
+  /* The heap starts out empty right after the last segment */
+  process->heap_start = MAX(elf.ro_vaddr + elf.ro_pages*PAGE_SIZE,
+                            elf.rw_vaddr + elf.rw_pages*PAGE_SIZE);
+  process->heap_end = process->heap_start;
 
   *stack_top = USERLAND_STACK_TOP;
 
-  /* We restore the currently running threads page table
-   * here. And saves the new page table to the new threads
-   * context
-   */
-  //restore
-  process_set_pagetable(current_pml4);
-
   //save new page table to new threads context
   thread_entry->context->pml4 = (uintptr_t)pagetable;
   thread_entry->context->virt_memory = pagetable;
 
-  //enable interrupts
-  _interrupt_set_state(intr_status);
-
-
   return 0;
 }
 
@@ -155,13 +472,24 @@ void process_start(const char *executable, const char **argv)
   int ret;
   context_t user_context;
   virtaddr_t stack_top;
+  process_id_t pid;
+
+  pid = process_alloc();
+  if (pid < 0) {
+    return;
+  }
 
   my_thread = thread_get_current_thread();
+  thread_get_thread_entry(my_thread)->process_id = pid;
+
   ret = setup_new_process(my_thread, executable, argv,
                           &entry_point, &stack_top);
 
   if (ret != 0) {
-    return; /* Something went wrong. */
+    /* Something went wrong. */
+    thread_get_thread_entry(my_thread)->process_id = -1;
+    process_table[pid].state = PROCESS_FREE;
+    return;
   }
 
   /* Initialize the user context. (Status register is handled by
@@ -176,3 +504,556 @@ void process_start(const char *executable, const char **argv)
 
   thread_goto_userland(&user_context);
 }
+
+/* Finds an address from PROCESS_MMAP_BASE upwards where size bytes
+   fit between the regions of process. */
+static virtaddr_t process_find_free_range(process_control_block_t *process,
+                                          uint64_t size)
+{
+  virtaddr_t start = PROCESS_MMAP_BASE;
+  process_region_t *region;
+  int i;
+
+  /* Move past every region in the way, and check all of them again
+     whenever we move */
+  for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+    region = &process->regions[i];
+    if (region->size != 0 && start < region->start + region->size
+        && region->start < start + size) {
+      start = region->start + region->size;
+      i = -1;
+    }
+  }
+
+  return start;
+}
+
+/* Unmaps the pages of process between the page aligned addresses
+   start and end. 2 MiB pages reaching below start are split first. */
+static void process_unmap_range(process_control_block_t *process,
+                                virtaddr_t start, virtaddr_t end)
+{
+  virtaddr_t page;
+
+  for (page = start; page < end; page += PAGE_SIZE) {
+    if (vm_getmap(process->pagetable, page) == 0) {
+      continue;
+    }
+    if (vm_is_huge_mapping(process->pagetable, page)
+        && (page & PAGE_HUGE_MASK) < start) {
+      vm_split_huge(process->pagetable, page);
+    }
+    vm_unmap(process->pagetable, page);
+  }
+}
+
+/* Adds a region of the given type (PROCESS_REGION_MAPPED or
+   PROCESS_REGION_SHARED) for mapping to the address space of process,
+   at a free address. Returns the start of the region, or 0 if the
+   region table is full. */
+static virtaddr_t process_add_mapping(process_control_block_t *process,
+                                      uint64_t size, int flags,
+                                      int mapping)
+{
+  virtaddr_t start = process_find_free_range(process, size);
+
+  if (flags & PROCESS_REGION_SHARED) {
+    flags |= PROCESS_REGION_WRITE;
+  }
+
+  if (process_add_region(process, start, size, flags, -1, 0, 0) < 0) {
+    return 0;
+  }
+  process_find_region(process, start)->mapping = mapping;
+
+  return start;
+}
+
+/* Removes the region of the given type starting at addr from the
+   address space of the current process, unmapping its pages. Returns
+   the mapping of the region, or negative if there is no such
+   region. */
+static int process_remove_mapping(virtaddr_t addr, int flags)
+{
+  process_control_block_t *process;
+  process_region_t *region;
+
+  process = process_get_current_process_entry();
+  if (process == NULL) {
+    return -1;
+  }
+
+  region = process_find_region(process, addr);
+  if (region == NULL || region->start != addr
+      || !(region->flags & flags)) {
+    return -1;
+  }
+
+  process_unmap_range(process, region->start,
+                      region->start + region->size);
+
+  region->size = 0;
+  return region->mapping;
+}
+
+/**
+ * Maps the first length bytes of a file read-only into the address
+ * space of the calling process. Nothing is read up front; pages are
+ * read from the file when first touched, and processes mapping the
+ * same file share the pages (see proc/mmap.c).
+ *
+ * @param pathname The file to map.
+ *
+ * @param length Number of bytes to map, rounded up to whole pages.
+ *
+ * @return Start address of the mapping, or 0 on error.
+ */
+virtaddr_t process_mmap(const char *pathname, uint64_t length)
+{
+  process_control_block_t *process;
+  char name[VFS_PATH_LENGTH];
+  virtaddr_t start;
+  uint64_t size;
+  int mapping;
+
+  process = process_get_current_process_entry();
+  if (process == NULL || length == 0 || length > PROCESS_MMAP_MAX_SIZE) {
+    return 0;
+  }
+
+  size = (length + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+
+  stringcopy(name, pathname, VFS_PATH_LENGTH);
+  mapping = mmap_open(name, size / PAGE_SIZE);
+  if (mapping < 0) {
+    return 0;
+  }
+
+  start = process_add_mapping(process, size, PROCESS_REGION_MAPPED,
+                              mapping);
+  if (start == 0) {
+    mmap_release(mapping);
+  }
+
+  return start;
+}
+
+/**
+ * Removes a mapping made by process_mmap() from the address space of
+ * the calling process.
+ *
+ * @param addr Start address of the mapping.
+ *
+ * @return 0 on success, negative if addr does not start a mapping.
+ */
+int process_munmap(virtaddr_t addr)
+{
+  int mapping = process_remove_mapping(addr, PROCESS_REGION_MAPPED);
+
+  if (mapping < 0) {
+    return -1;
+  }
+
+  mmap_release(mapping);
+  return 0;
+}
+
+/**
+ * Creates a named shared memory segment and attaches the calling
+ * process to it (see proc/shm.c).
+ *
+ * @param name Name of the segment.
+ *
+ * @param length Size of the segment in bytes, rounded up to whole
+ * pages.
+ *
+ * @return Start address of the segment in the process, or 0 on error.
+ */
+virtaddr_t process_shm_create(const char *name, uint64_t length)
+{
+  process_control_block_t *process;
+  char shm_name[SHM_NAME_LENGTH + 1];
+  virtaddr_t start;
+  uint64_t size;
+  int segment;
+
+  process = process_get_current_process_entry();
+  if (process == NULL || length == 0 || length > SHM_MAX_SIZE) {
+    return 0;
+  }
+
+  size = (length + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+
+  stringcopy(shm_name, name, SHM_NAME_LENGTH + 1);
+  segment = shm_create(shm_name, size / PAGE_SIZE);
+  if (segment < 0) {
+    return 0;
+  }
+
+  start = process_add_mapping(process, size, PROCESS_REGION_SHARED,
+                              segment);
+  if (start == 0) {
+    shm_release(segment);
+  }
+
+  return start;
+}
+
+/**
+ * Attaches the calling process to an existing shared memory segment.
+ *
+ * @param name Name of the segment.
+ *
+ * @return Start address of the segment in the process, or 0 on error.
+ */
+virtaddr_t process_shm_attach(const char *name)
+{
+  process_control_block_t *process;
+  char shm_name[SHM_NAME_LENGTH + 1];
+  virtaddr_t start;
+  uint64_t pages;
+  int segment;
+
+  process = process_get_current_process_entry();
+  if (process == NULL) {
+    return 0;
+  }
+
+  stringcopy(shm_name, name, SHM_NAME_LENGTH + 1);
+  segment = shm_attach(shm_name, &pages);
+  if (segment < 0) {
+    return 0;
+  }
+
+  start = process_add_mapping(process, pages * PAGE_SIZE,
+                              PROCESS_REGION_SHARED, segment);
+  if (start == 0) {
+    shm_release(segment);
+  }
+
+  return start;
+}
+
+/**
+ * Detaches the calling process from a shared memory segment.
+ *
+ * @param addr Start address of the segment in the process.
+ *
+ * @return 0 on success, negative if addr does not start a segment.
+ */
+int process_shm_detach(virtaddr_t addr)
+{
+  int segment = process_remove_mapping(addr, PROCESS_REGION_SHARED);
+
+  if (segment < 0) {
+    return -1;
+  }
+
+  shm_release(segment);
+  return 0;
+}
+
+/**
+ * Moves the end of the heap of the calling process. The heap is a
+ * demand paged region starting right after the executable, so growing
+ * it allocates nothing until the new pages are touched. Shrinking it
+ * frees the pages past the new end.
+ *
+ * @param heap_end The new end of the heap, or 0 to only query it.
+ *
+ * @return The new end of the heap, or 0 if the heap cannot be moved
+ * there.
+ */
+virtaddr_t process_memlimit(virtaddr_t heap_end)
+{
+  process_control_block_t *process;
+  process_region_t *heap;
+  virtaddr_t old_top, new_top;
+  int i;
+
+  process = process_get_current_process_entry();
+  if (process == NULL) {
+    return 0;
+  }
+
+  if (heap_end == 0) {
+    return process->heap_end;
+  }
+
+  if (heap_end < process->heap_start || heap_end > PROCESS_MMAP_BASE) {
+    return 0;
+  }
+
+  old_top = (process->heap_end + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+  new_top = (heap_end + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+  heap = process_find_region(process, process->heap_start);
+
+  if (new_top > old_top) {
+    /* The heap must not grow into the stack or a mapping */
+    for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+      process_region_t *region = &process->regions[i];
+      if (region->size != 0 && region->start < new_top
+          && old_top < region->start + region->size) {
+        return 0;
+      }
+    }
+
+    if (heap == NULL) {
+      if (process_add_region(process, process->heap_start,
+                             new_top - process->heap_start,
+                             PROCESS_REGION_WRITE, -1, 0, 0) < 0) {
+        return 0;
+      }
+    } else {
+      heap->size = new_top - process->heap_start;
+    }
+  } else if (new_top < old_top) {
+    /* An empty heap frees its region slot */
+    heap->size = new_top - process->heap_start;
+    swap_discard(process, new_top, old_top);
+    process_unmap_range(process, new_top, old_top);
+  }
+
+  process->heap_end = heap_end;
+  return heap_end;
+}
+
+/* The first thread of a forked process, see process_fork(). */
+static void process_fork_entry(uint32_t pid)
+{
+  context_t user_context;
+
+  memoryset(&user_context, 0, sizeof(user_context));
+
+  _context_set_ip(&user_context, process_table[pid].fork_func);
+  _context_set_sp(&user_context, USERLAND_STACK_TOP);
+  _context_set_arg(&user_context, process_table[pid].fork_arg);
+
+  vmm_setcr3(thread_get_current_thread_entry()->context->pml4);
+
+  thread_goto_userland(&user_context);
+}
+
+/**
+ * Creates a new process whose memory is a copy of the memory of the
+ * calling process, and starts it running func(arg) on a fresh stack.
+ * Nothing is copied up front: all mapped pages, except the stack, are
+ * shared read-only between the two processes and copied by the page
+ * fault handler when either process writes to them. Pages that have
+ * not been touched yet are demand paged independently by each. The
+ * child inherits the file descriptors of the parent, sharing the open
+ * files.
+ *
+ * @param func Userland function the new process starts in.
+ *
+ * @param arg Argument passed to func.
+ *
+ * @return The PID of the new process, or negative on error.
+ */
+process_id_t process_fork(virtaddr_t func, int arg)
+{
+  process_control_block_t *parent, *child;
+  thread_table_t *thread_entry;
+  process_region_t *region;
+  process_id_t pid;
+  TID_t tid;
+  int i;
+
+  parent = process_get_current_process_entry();
+  if (parent == NULL) {
+    return -1;
+  }
+
+  pid = process_alloc();
+  if (pid < 0) {
+    return pid;
+  }
+  child = &process_table[pid];
+
+  /* The child demand pages through its own handle of the executable,
+     so the two processes never race on one seek position. */
+  child->executable = vfs_open(parent->name);
+  if (child->executable < 0) {
+    child->state = PROCESS_FREE;
+    return -1;
+  }
+
+  tid = thread_create(process_fork_entry, pid);
+  if (tid < 0) {
+    vfs_close(child->executable);
+    child->state = PROCESS_FREE;
+    return -1;
+  }
+
+  stringcopy(child->name, parent->name, PROCESS_MAX_FILELENGTH);
+  fd_fork(&parent->files, &child->files);
+  child->pagetable = vm_create_pagetable(tid);
+  child->fork_func = func;
+  child->fork_arg = arg;
+  child->heap_start = parent->heap_start;
+  child->heap_end = parent->heap_end;
+
+  /* Share everything but the stack, which is the stack of the running
+     system call and must stay writable. The child gets its own. */
+  swap_lock();
+  for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+    region = &parent->regions[i];
+    if (region->size == 0 || (region->flags & PROCESS_REGION_STACK)) {
+      continue;
+    }
+
+    child->regions[i] = *region;
+    if (region->file == parent->executable) {
+      child->regions[i].file = child->executable;
+    }
+    if (region->flags & PROCESS_REGION_MAPPED) {
+      mmap_ref(region->mapping);
+    }
+
+    /* Shared memory must stay shared, not become copy-on-write. The
+       child faults the pages in from the segment itself. */
+    if (region->flags & PROCESS_REGION_SHARED) {
+      shm_ref(region->mapping);
+      continue;
+    }
+
+    vm_share_range(parent->pagetable, child->pagetable,
+                   region->start, region->size);
+    swap_fork(parent, child, region->start, region->start + region->size);
+  }
+  swap_unlock();
+
+  process_setup_stack(child);
+
+  thread_entry = thread_get_thread_entry(tid);
+  thread_entry->process_id = pid;
+  thread_entry->pagetable = child->pagetable;
+  thread_entry->context->pml4 = (uintptr_t)child->pagetable;
+  thread_entry->context->virt_memory = child->pagetable;
+
+  thread_run(tid);
+
+  return pid;
+}
+
+/* Second half of process_exit(), running on the kernel stack of the
+   exiting thread. Destroys the address space and ends the thread. */
+static void process_reap(uint32_t pid)
+{
+  thread_table_t *thread_entry = thread_get_current_thread_entry();
+  process_control_block_t *process = &process_table[pid];
+
+  /* Leave the address space before destroying it */
+  thread_entry->context->pml4 = (uintptr_t)vmm_get_kernel_pml4();
+  thread_entry->context->virt_memory = vmm_get_kernel_pml4();
+  vmm_setcr3(thread_entry->context->pml4);
+
+  vm_destroy_pagetable(process->pagetable);
+  process->pagetable = NULL;
+  thread_entry->pagetable = NULL;
+  thread_entry->process_id = -1;
+
+  spinlock_acquire(&process_table_slock);
+  process->state = PROCESS_ZOMBIE;
+  sleepq_wake_all(process);
+  spinlock_release(&process_table_slock);
+
+  thread_finish();
+}
+
+/**
+ * Terminates the calling process. Its files are closed, and all of
+ * its memory and page tables are returned to the system. The process
+ * stays a zombie until it is joined.
+ *
+ * @param retval The exit status, returned by process_join().
+ */
+void process_exit(int retval)
+{
+  thread_table_t *thread_entry = thread_get_current_thread_entry();
+  process_control_block_t *process = process_get_current_process_entry();
+  interrupt_status_t intr_status;
+  int i;
+
+  KERNEL_ASSERT(process != NULL);
+  process->retval = retval;
+
+  /* Stop the clock hand of the swapper (see proc/swap.c) here */
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&process_table_slock);
+  process->state = PROCESS_EXITING;
+  spinlock_release(&process_table_slock);
+  _interrupt_set_state(intr_status);
+
+  for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+    if (process->regions[i].size == 0) {
+      continue;
+    }
+    swap_discard(process, process->regions[i].start,
+                 process->regions[i].start + process->regions[i].size);
+    if (process->regions[i].flags & PROCESS_REGION_MAPPED) {
+      mmap_release(process->regions[i].mapping);
+    } else if (process->regions[i].flags & PROCESS_REGION_SHARED) {
+      shm_release(process->regions[i].mapping);
+    } else if (process->regions[i].file >= 0
+               && process->regions[i].file != process->executable) {
+      vfs_close(process->regions[i].file);
+    }
+  }
+  if (process->executable >= 0) {
+    vfs_close(process->executable);
+    process->executable = -1;
+  }
+  fd_close_all(&process->files);
+
+  /* The user stack, which we are running on, is freed along with the
+     address space, so continue on the kernel stack of this thread. It
+     is unused while the thread is in userland. */
+  _interrupt_disable();
+  thread_entry->attribs &= ~THREAD_FLAG_USERMODE;
+  _context_call_on_stack((virtaddr_t)thread_entry->context & ~0xFULL,
+                         process_reap, thread_entry->process_id);
+}
+
+/**
+ * Waits until the given process has exited, and frees its process
+ * table entry.
+ *
+ * @param pid The process to wait for.
+ *
+ * @return The exit status of the process, or PROCESS_ILLEGAL_JOIN if
+ * there is no such process.
+ */
+int process_join(process_id_t pid)
+{
+  interrupt_status_t intr_status;
+  int retval;
+
+  if (pid < 0 || pid >= PROCESS_MAX_PROCESSES) {
+    return PROCESS_ILLEGAL_JOIN;
+  }
+
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&process_table_slock);
+
+  if (process_table[pid].state == PROCESS_FREE) {
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+    return PROCESS_ILLEGAL_JOIN;
+  }
+
+  while (process_table[pid].state != PROCESS_ZOMBIE) {
+    sleepq_add(&process_table[pid]);
+    spinlock_release(&process_table_slock);
+    thread_switch();
+    spinlock_acquire(&process_table_slock);
+  }
+
+  retval = process_table[pid].retval;
+  process_table[pid].state = PROCESS_FREE;
+
+  spinlock_release(&process_table_slock);
+  _interrupt_set_state(intr_status);
+
+  return retval;
+}
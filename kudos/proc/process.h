@@ -7,16 +7,108 @@
 
 #include "lib/types.h"
 #include "vm/memory.h"
+#include "proc/fd.h"
 
 #define PROCESS_PTABLE_FULL  -1
 #define PROCESS_ILLEGAL_JOIN -2
 
 #define PROCESS_MAX_FILELENGTH 256
 #define PROCESS_MAX_PROCESSES  128
-#define PROCESS_MAX_FILES      10
+
+#define PROCESS_MAX_REGIONS    16
+
+/* Region flags */
+#define PROCESS_REGION_WRITE   0x1
+#define PROCESS_REGION_STACK   0x2
+#define PROCESS_REGION_MAPPED  0x4
+#define PROCESS_REGION_SHARED  0x8
+
+/* Memory mapped files and shared memory are placed from here up */
+#define PROCESS_MMAP_BASE      0xFFFFC00000000000
+/* Largest size of a single mapping */
+#define PROCESS_MMAP_MAX_SIZE  0x40000000
 
 typedef int process_id_t;
 
+typedef enum {
+  PROCESS_FREE,
+  PROCESS_RUNNING,
+  PROCESS_EXITING,
+  PROCESS_ZOMBIE
+} process_state_t;
+
+/* A range of user memory whose pages are allocated when first
+   touched. Pages are zero filled, and the first filesize bytes of the
+   region are read from file (if file is non-negative). The pages of a
+   PROCESS_REGION_MAPPED region come from a memory mapped file
+   instead (see proc/mmap.c), and those of a PROCESS_REGION_SHARED
+   region from a shared memory segment (see proc/shm.c). */
+typedef struct {
+  /* Page aligned start address */
+  virtaddr_t start;
+  /* Size in bytes, a multiple of PAGE_SIZE; 0 if the slot is unused */
+  uint64_t size;
+  /* PROCESS_REGION_* flags */
+  int flags;
+  /* Backing file (an openfile_t), or negative for anonymous memory */
+  int file;
+  /* Offset of the region in the file */
+  uint64_t offset;
+  /* Number of bytes backed by the file */
+  uint64_t filesize;
+  /* The mapped file of a PROCESS_REGION_MAPPED region, or the
+     segment of a PROCESS_REGION_SHARED region */
+  int mapping;
+} process_region_t;
+
+typedef struct {
+  process_state_t state;
+  /* Path of the executable */
+  char name[PROCESS_MAX_FILELENGTH];
+  /* The address space of the process */
+  pagetable_t *pagetable;
+  /* The executable (an openfile_t), kept open for demand paging */
+  int executable;
+  /* Files opened by the process */
+  fd_table_t files;
+  process_region_t regions[PROCESS_MAX_REGIONS];
+  /* Start and current end of the heap, which is a region from
+     heap_start to heap_end rounded up to a page (see memlimit) */
+  virtaddr_t heap_start;
+  virtaddr_t heap_end;
+  /* Number of pages swapped out (see proc/swap.c) */
+  int swapped_pages;
+  /* Function and argument the first thread of a forked process runs */
+  virtaddr_t fork_func;
+  int fork_arg;
+  /* Exit status, valid once the process is a zombie */
+  int retval;
+} process_control_block_t;
+
+void process_init(void);
 void process_start(const char *executable, const char **argv);
 
+process_control_block_t *process_get_current_process_entry(void);
+process_control_block_t *process_get_process_entry(process_id_t pid);
+
+int process_add_region(process_control_block_t *process,
+                       virtaddr_t start, uint64_t size, int flags,
+                       int file, uint64_t offset, uint64_t filesize);
+process_region_t *process_find_region(process_control_block_t *process,
+                                      virtaddr_t vaddr);
+int process_handle_page_fault(virtaddr_t vaddr, int write);
+
+virtaddr_t process_mmap(const char *pathname, uint64_t length);
+int process_munmap(virtaddr_t addr);
+
+virtaddr_t process_shm_create(const char *name, uint64_t length);
+virtaddr_t process_shm_attach(const char *name);
+int process_shm_detach(virtaddr_t addr);
+
+virtaddr_t process_memlimit(virtaddr_t heap_end);
+
+process_id_t process_fork(virtaddr_t func, int arg);
+void process_exit(int retval);
+int process_join(process_id_t pid);
+
 #endif // KUDOS_PROC_PROCESS_H
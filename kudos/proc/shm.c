@@ -0,0 +1,232 @@
+/*
+ * Named shared memory segments.
+ */
+
+#include <arch.h>
+#include "proc/shm.h"
+#include "kernel/semaphore.h"
+#include "kernel/assert.h"
+#include "lib/libc.h"
+#include "vm/memory.h"
+
+/** @name Shared memory
+ *
+ * Named segments of memory that several processes can map at the same
+ * time. Every process attached to a segment maps the same page frames
+ * writable, so data written by one process is seen by the others
+ * immediately. Frames are allocated, zeroed, when a page of the
+ * segment is first touched by any process. A segment is destroyed
+ * when the last process detaches from it.
+ *
+ * @{
+ */
+
+typedef struct {
+  /* Name of the segment, empty if the slot is unused */
+  char name[SHM_NAME_LENGTH];
+  /* Number of attachments */
+  int refs;
+  /* Frames of the segment, 0 for pages not yet touched. This table
+     holds one reference to each frame. */
+  physaddr_t *frames;
+  /* Size of the segment in pages */
+  uint64_t pages;
+} shm_segment_t;
+
+/** The segments */
+static shm_segment_t shm_segments[SHM_MAX_SEGMENTS];
+
+/** Lock for the segment table */
+static semaphore_t *shm_sem;
+
+/* Number of frames backing a frame table of the given length */
+static uint64_t shm_table_frames(uint64_t pages)
+{
+  uint64_t bytes = pages * sizeof(physaddr_t);
+
+  return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* Returns the segment called name, or negative if there is none.
+   Must be called with shm_sem held. */
+static int shm_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+    if (shm_segments[i].refs > 0
+        && stringcmp(shm_segments[i].name, name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Initializes the segment table. Must be called after
+ * semaphore_init().
+ */
+void shm_init(void)
+{
+  int i;
+
+  shm_sem = semaphore_create(1);
+  KERNEL_ASSERT(shm_sem != NULL);
+
+  for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+    memoryset(&shm_segments[i], 0, sizeof(shm_segment_t));
+  }
+}
+
+/**
+ * Creates a new segment and attaches the caller to it.
+ *
+ * @param name Name of the segment, at most SHM_NAME_LENGTH - 1
+ * characters.
+ *
+ * @param pages Size of the segment in pages.
+ *
+ * @return The segment, or negative if a segment with the same name
+ * exists, the name is too long, or the segment table is full.
+ */
+int shm_create(const char *name, uint64_t pages)
+{
+  int i;
+
+  if (strlen(name) >= SHM_NAME_LENGTH || name[0] == '\0') {
+    return -1;
+  }
+
+  semaphore_P(shm_sem);
+
+  if (shm_find(name) >= 0) {
+    semaphore_V(shm_sem);
+    return -1;
+  }
+
+  for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+    if (shm_segments[i].refs == 0) {
+      break;
+    }
+  }
+
+  if (i == SHM_MAX_SEGMENTS) {
+    semaphore_V(shm_sem);
+    return -1;
+  }
+
+  stringcopy(shm_segments[i].name, name, SHM_NAME_LENGTH);
+  shm_segments[i].frames = kmalloc(pages * sizeof(physaddr_t));
+  memoryset(shm_segments[i].frames, 0, pages * sizeof(physaddr_t));
+  shm_segments[i].pages = pages;
+  shm_segments[i].refs = 1;
+
+  semaphore_V(shm_sem);
+  return i;
+}
+
+/**
+ * Attaches the caller to an existing segment.
+ *
+ * @param name Name of the segment.
+ *
+ * @param pages Set to the size of the segment in pages.
+ *
+ * @return The segment, or negative if there is no such segment.
+ */
+int shm_attach(const char *name, uint64_t *pages)
+{
+  int segment;
+
+  semaphore_P(shm_sem);
+
+  segment = shm_find(name);
+  if (segment >= 0) {
+    shm_segments[segment].refs++;
+    *pages = shm_segments[segment].pages;
+  }
+
+  semaphore_V(shm_sem);
+  return segment;
+}
+
+/**
+ * Adds an attachment to a segment, e.g. when a process attached to it
+ * is forked.
+ */
+void shm_ref(int segment)
+{
+  KERNEL_ASSERT(segment >= 0 && segment < SHM_MAX_SEGMENTS);
+
+  semaphore_P(shm_sem);
+  KERNEL_ASSERT(shm_segments[segment].refs > 0);
+  shm_segments[segment].refs++;
+  semaphore_V(shm_sem);
+}
+
+/**
+ * Detaches from a segment. The last detach destroys the segment;
+ * frames still mapped in page tables are freed when those mappings go
+ * away.
+ */
+void shm_release(int segment)
+{
+  shm_segment_t *seg;
+  uint64_t i;
+
+  KERNEL_ASSERT(segment >= 0 && segment < SHM_MAX_SEGMENTS);
+  seg = &shm_segments[segment];
+
+  semaphore_P(shm_sem);
+  KERNEL_ASSERT(seg->refs > 0);
+
+  if (--seg->refs > 0) {
+    semaphore_V(shm_sem);
+    return;
+  }
+
+  for (i = 0; i < seg->pages; i++) {
+    if (seg->frames[i] != 0) {
+      physmem_unref(seg->frames[i], 1);
+    }
+  }
+  physmem_freeblocks(seg->frames, shm_table_frames(seg->pages));
+  memoryset(seg, 0, sizeof(shm_segment_t));
+
+  semaphore_V(shm_sem);
+}
+
+/**
+ * Returns the frame holding a page of a segment, allocating a zeroed
+ * frame if the page has not been touched before. The frame gets an
+ * extra reference, which belongs to the caller's page table mapping.
+ *
+ * @param segment The segment.
+ *
+ * @param index Page number in the segment.
+ *
+ * @return The frame.
+ */
+physaddr_t shm_get_page(int segment, uint64_t index)
+{
+  shm_segment_t *seg;
+  physaddr_t frame;
+
+  KERNEL_ASSERT(segment >= 0 && segment < SHM_MAX_SEGMENTS);
+  seg = &shm_segments[segment];
+
+  semaphore_P(shm_sem);
+  KERNEL_ASSERT(index < seg->pages);
+
+  if (seg->frames[index] == 0) {
+    seg->frames[index] = physmem_alloc_zeroed();
+  }
+  frame = seg->frames[index];
+  physmem_ref(frame, 1);
+
+  semaphore_V(shm_sem);
+  return frame;
+}
+
+/** @} */
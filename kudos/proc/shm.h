@@ -0,0 +1,25 @@
+/*
+ * Named shared memory segments.
+ */
+
+#ifndef KUDOS_PROC_SHM_H
+#define KUDOS_PROC_SHM_H
+
+#include "lib/types.h"
+
+/* Maximum number of segments existing at the same time */
+#define SHM_MAX_SEGMENTS 16
+/* Maximum length of a segment name, including the terminating zero */
+#define SHM_NAME_LENGTH  16
+/* Largest size of a segment in bytes */
+#define SHM_MAX_SIZE     0x1000000
+
+void shm_init(void);
+
+int shm_create(const char *name, uint64_t pages);
+int shm_attach(const char *name, uint64_t *pages);
+void shm_ref(int segment);
+void shm_release(int segment);
+physaddr_t shm_get_page(int segment, uint64_t index);
+
+#endif // KUDOS_PROC_SHM_H
@@ -3,7 +3,12 @@
 # Set the module name
 MODULE := proc
 
-FILES := elf.c syscall.c process.c
+FILES := elf.c syscall.c process.c fd.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
+# Memory mapped files, shared memory and swapping use the x86_64
+# virtual memory interface.
+X64FILES := mmap.c shm.c swap.c
+
+X64SRC += $(patsubst %, $(MODULE)/%, $(X64FILES))
@@ -0,0 +1,465 @@
+/*
+ * Swapping of user pages.
+ */
+
+#include <arch.h>
+#include "proc/swap.h"
+#include "kernel/semaphore.h"
+#include "kernel/assert.h"
+#include "drivers/device.h"
+#include "drivers/gbd.h"
+#include "drivers/bootargs.h"
+#include "lib/libc.h"
+#include "vm/memory.h"
+
+/** @name Swapping
+ *
+ * When free page frames run low, cold pages of user processes are
+ * written to a swap disk and unmapped. The page table entry of a
+ * swapped out page remembers the swap slot holding it, and the page is
+ * read back by the page fault handler when it is touched again.
+ *
+ * Victims are chosen with the clock (second chance) algorithm. A hand
+ * sweeps over the resident pages of all processes. A page that was
+ * accessed since the hand last passed has its accessed bit cleared
+ * and is skipped; the first page found not accessed is swapped out.
+ * Only private pages of demand paged regions are swapped: not the
+ * stack, on which page faults are handled, not memory mapped files or
+ * shared memory, not 2 MiB pages, and not frames shared copy-on-write,
+ * which are mapped by more than one page table.
+ *
+ * The swap disk is given by the "swapdisk" boot argument (an index
+ * among the disks of the system), and is not mounted as a filesystem.
+ * Without it nothing is swapped. A swap slot is one page worth of
+ * blocks; slot 0 is never used.
+ *
+ * @{
+ */
+
+/* Regions whose pages are never swapped out */
+#define SWAP_PINNED_REGION (PROCESS_REGION_STACK | PROCESS_REGION_MAPPED \
+                            | PROCESS_REGION_SHARED)
+
+/** The swap disk, NULL if swapping is disabled */
+static gbd_t *swap_gbd;
+
+/** Number of disk blocks in a swap slot */
+static uint32_t swap_blocks_per_page;
+
+/** Number of swap slots on the disk */
+static uint64_t swap_slots;
+
+/** Number of page table entries referring to each swap slot, 0 for
+    free slots. Swap entries are copied on fork. */
+static uint16_t *swap_refs;
+
+/** Where to start looking for a free slot */
+static uint64_t swap_next_slot;
+
+/** Serializes all swapping, and the forking of address spaces */
+static semaphore_t *swap_sem;
+
+/** The clock hand: a process and an address in it */
+static process_id_t swap_hand_pid;
+static virtaddr_t swap_hand_vaddr;
+
+/** Bounce buffer in the kernel image, below 4 GiB, for frames the disk
+    cannot address */
+static uint64_t swap_bounce[PAGE_SIZE / 8];
+
+/**
+ * Initializes swapping, if a swap disk is given on the command
+ * line. Must be called after device_init().
+ */
+void swap_init(void)
+{
+  char *disk = bootargs_get("swapdisk");
+  device_t *dev;
+  gbd_t *gbd;
+  uint32_t block_size;
+
+  swap_sem = semaphore_create(1);
+  KERNEL_ASSERT(swap_sem != NULL);
+
+  if (disk == NULL) {
+    return;
+  }
+
+  dev = device_get(TYPECODE_DISK, atoi(disk));
+  if (dev == NULL || dev->generic_device == NULL) {
+    kprintf("Swap: No disk %s, swapping disabled\n", disk);
+    return;
+  }
+  gbd = (gbd_t *)dev->generic_device;
+
+  block_size = gbd->block_size(gbd);
+  if (block_size == 0 || PAGE_SIZE % block_size != 0) {
+    kprintf("Swap: Unusable block size %d, swapping disabled\n",
+            block_size);
+    return;
+  }
+
+  swap_blocks_per_page = PAGE_SIZE / block_size;
+  swap_slots = gbd->total_blocks(gbd) / swap_blocks_per_page;
+  if (swap_slots < 2) {
+    return;
+  }
+
+  swap_refs = kmalloc(swap_slots * sizeof(uint16_t));
+  memoryset(swap_refs, 0, swap_slots * sizeof(uint16_t));
+  swap_next_slot = 1;
+  swap_gbd = gbd;
+
+  kprintf("Swap: %d pages on disk %s\n", (int)swap_slots - 1, disk);
+}
+
+/* Returns a free swap slot with one reference, or 0 if the swap disk
+   is full. */
+static uint64_t swap_alloc_slot(void)
+{
+  uint64_t i, slot;
+
+  for (i = 1; i < swap_slots; i++) {
+    slot = swap_next_slot;
+    if (++swap_next_slot == swap_slots) {
+      swap_next_slot = 1;
+    }
+    if (swap_refs[slot] == 0) {
+      swap_refs[slot] = 1;
+      return slot;
+    }
+  }
+
+  return 0;
+}
+
+/* Reads or writes the page frame at frame from or to a swap slot.
+   Returns 0 on success, negative on a disk error. The disk takes 32
+   bit physical addresses, so a frame above 4 GiB is transferred
+   through swap_bounce. */
+static int swap_transfer(uint64_t slot, physaddr_t frame,
+                         gbd_operation_t operation)
+{
+  gbd_request_t req;
+  physaddr_t buf = frame;
+  uint32_t i;
+  int r;
+
+  if (frame + PAGE_SIZE > 0x100000000ULL) {
+    buf = ADDR_KERNEL_TO_PHYS((uintptr_t)swap_bounce);
+    KERNEL_ASSERT(buf + PAGE_SIZE <= 0x100000000ULL);
+    if (operation == GBD_OPERATION_WRITE) {
+      memcopy(PAGE_SIZE, swap_bounce, (void *)ADDR_PHYS_TO_KERNEL(frame));
+    }
+  }
+
+  for (i = 0; i < swap_blocks_per_page; i++) {
+    req.block = slot * swap_blocks_per_page + i;
+    req.buf = buf + i * (PAGE_SIZE / swap_blocks_per_page);
+    req.sem = NULL;
+    if (operation == GBD_OPERATION_READ) {
+      r = swap_gbd->read_block(swap_gbd, &req);
+    } else {
+      r = swap_gbd->write_block(swap_gbd, &req);
+    }
+    if (r <= 0) {
+      return -1;
+    }
+  }
+
+  if (buf != frame && operation == GBD_OPERATION_READ) {
+    memcopy(PAGE_SIZE, (void *)ADDR_PHYS_TO_KERNEL(frame), swap_bounce);
+  }
+
+  return 0;
+}
+
+/* Returns the first page at or above vaddr which may be swapped out
+   from process, or 0 if there is none. */
+static virtaddr_t swap_next_page(process_control_block_t *process,
+                                 virtaddr_t vaddr)
+{
+  process_region_t *region, *next;
+  virtaddr_t end, page;
+  int i;
+
+  for (;;) {
+    /* Find the lowest region ending above vaddr */
+    next = NULL;
+    for (i = 0; i < PROCESS_MAX_REGIONS; i++) {
+      region = &process->regions[i];
+      if (region->size == 0 || (region->flags & SWAP_PINNED_REGION)
+          || region->start + region->size <= vaddr) {
+        continue;
+      }
+      if (next == NULL || region->start < next->start) {
+        next = region;
+      }
+    }
+
+    if (next == NULL) {
+      return 0;
+    }
+
+    end = next->start + next->size;
+    page = vm_find_page(process->pagetable, MAX(vaddr, next->start),
+                        end, 0);
+    if (page != end) {
+      return page;
+    }
+    vaddr = end;
+  }
+}
+
+/* Swaps out the page at vaddr of process, which lies in a region with
+   the given flags. Returns 0 on success. */
+static int swap_out(process_control_block_t *process, virtaddr_t vaddr,
+                    int region_flags)
+{
+  physaddr_t frame;
+  uint64_t slot;
+
+  slot = swap_alloc_slot();
+  if (slot == 0) {
+    return -1;
+  }
+
+  /* From here on, touching the page faults and waits in swap_in()
+     until the page is on the disk */
+  frame = vm_swap_out(process->pagetable, vaddr, slot);
+  KERNEL_ASSERT(frame != 0);
+
+  if (swap_transfer(slot, frame, GBD_OPERATION_WRITE) < 0) {
+    kprintf("Swap: Write error in slot %d\n", (int)slot);
+    swap_refs[slot] = 0;
+    vm_set_swapped(process->pagetable, vaddr, 0);
+    vm_map(process->pagetable, frame, vaddr,
+           (region_flags & PROCESS_REGION_WRITE)
+           ? PAGE_USER | PAGE_WRITE : PAGE_USER);
+    return -1;
+  }
+
+  physmem_unref(frame, 1);
+  process->swapped_pages++;
+  return 0;
+}
+
+/* Moves the clock hand to the next page that is not recently used, and
+   swaps it out. Returns 0 on success, or negative if no page could be
+   swapped out. Must be called with swap_sem held. */
+static int swap_clock(void)
+{
+  process_control_block_t *process;
+  virtaddr_t page;
+  physaddr_t frame;
+  int wraps = 0;
+
+  for (;;) {
+    process = process_get_process_entry(swap_hand_pid);
+    page = 0;
+    if (process->state == PROCESS_RUNNING && process->pagetable != NULL) {
+      page = swap_next_page(process, swap_hand_vaddr);
+    }
+
+    if (page == 0) {
+      /* Go on to the next process. Every page has had its second
+         chance after the hand has gone all the way round twice. */
+      swap_hand_vaddr = 0;
+      if (++swap_hand_pid == PROCESS_MAX_PROCESSES) {
+        swap_hand_pid = 0;
+        if (++wraps > 2) {
+          return -1;
+        }
+      }
+      continue;
+    }
+
+    swap_hand_vaddr = page + PAGE_SIZE;
+
+    frame = vm_getmap(process->pagetable, page);
+    if (physmem_refcount(frame) != 1) {
+      continue;
+    }
+
+    if (vm_clear_accessed(process->pagetable, page)) {
+      continue;
+    }
+
+    return swap_out(process, page,
+                    process_find_region(process, page)->flags);
+  }
+}
+
+/**
+ * Swaps pages out if free page frames are running low. Called before
+ * memory is allocated for user pages; may sleep.
+ */
+void swap_balance(void)
+{
+  if (swap_gbd == NULL || physmem_available() >= SWAP_LOW_WATER) {
+    return;
+  }
+
+  semaphore_P(swap_sem);
+  while (physmem_available() < SWAP_HIGH_WATER) {
+    if (swap_clock() < 0) {
+      break;
+    }
+  }
+  semaphore_V(swap_sem);
+}
+
+/**
+ * Reads a swapped out page back in and maps it. Called by the page
+ * fault handler.
+ *
+ * @param process The process the page belongs to.
+ *
+ * @param vaddr Page aligned address of the page.
+ *
+ * @param flags Page attributes for vm_map().
+ *
+ * @return 0 on success, negative on a disk error.
+ */
+int swap_in(process_control_block_t *process, virtaddr_t vaddr, int flags)
+{
+  physaddr_t frame;
+  uint64_t slot;
+
+  frame = physmem_allocblock();
+
+  semaphore_P(swap_sem);
+
+  slot = vm_get_swapped(process->pagetable, vaddr);
+  if (slot == 0) {
+    /* Someone beat us to it */
+    semaphore_V(swap_sem);
+    physmem_freeblock((void*)frame);
+    return 0;
+  }
+
+  if (swap_transfer(slot, frame, GBD_OPERATION_READ) < 0) {
+    kprintf("Swap: Read error in slot %d\n", (int)slot);
+    semaphore_V(swap_sem);
+    physmem_freeblock((void*)frame);
+    return -1;
+  }
+
+  vm_map(process->pagetable, frame, vaddr, flags);
+  swap_refs[slot]--;
+  process->swapped_pages--;
+
+  semaphore_V(swap_sem);
+  return 0;
+}
+
+/**
+ * Keeps pages from being swapped out or in. Held while an address
+ * space is shared with a forked child, so that the two page tables
+ * and the swap references stay consistent.
+ */
+void swap_lock(void)
+{
+  semaphore_P(swap_sem);
+}
+
+/**
+ * Undoes swap_lock().
+ */
+void swap_unlock(void)
+{
+  semaphore_V(swap_sem);
+}
+
+/**
+ * Gives a forked child the swapped out pages of its parent in
+ * [start, end). Both processes refer to the same swap slots, and each
+ * reads its own copy back in. Must be called between swap_lock() and
+ * swap_unlock().
+ *
+ * @param parent The forking process.
+ *
+ * @param child The new process.
+ *
+ * @param start Page aligned start of the range.
+ *
+ * @param end End of the range.
+ */
+void swap_fork(process_control_block_t *parent,
+               process_control_block_t *child,
+               virtaddr_t start, virtaddr_t end)
+{
+  virtaddr_t page;
+  uint64_t slot;
+
+  if (parent->swapped_pages == 0) {
+    return;
+  }
+
+  for (page = vm_find_page(parent->pagetable, start, end, 1); page != end;
+       page = vm_find_page(parent->pagetable, page + PAGE_SIZE, end, 1)) {
+    slot = vm_get_swapped(parent->pagetable, page);
+    vm_set_swapped(child->pagetable, page, slot);
+    swap_refs[slot]++;
+    child->swapped_pages++;
+  }
+}
+
+/**
+ * Forgets the swapped out pages of process in [start, end), freeing
+ * their swap slots. Used when memory is unmapped or the process exits.
+ *
+ * @param process The process.
+ *
+ * @param start Page aligned start of the range.
+ *
+ * @param end End of the range.
+ */
+void swap_discard(process_control_block_t *process,
+                  virtaddr_t start, virtaddr_t end)
+{
+  virtaddr_t page;
+  uint64_t slot;
+
+  semaphore_P(swap_sem);
+
+  if (process->swapped_pages > 0) {
+    for (page = vm_find_page(process->pagetable, start, end, 1);
+         page != end;
+         page = vm_find_page(process->pagetable, page + PAGE_SIZE, end, 1)) {
+      slot = vm_get_swapped(process->pagetable, page);
+      vm_set_swapped(process->pagetable, page, 0);
+      swap_refs[slot]--;
+      process->swapped_pages--;
+    }
+  }
+
+  semaphore_V(swap_sem);
+}
+
+/**
+ * Fills in the swap statistics of info.
+ *
+ * @param info The statistics to fill in.
+ */
+void swap_meminfo(meminfo_t *info)
+{
+  uint64_t slot, used = 0;
+
+  if (swap_gbd == NULL) {
+    return;
+  }
+
+  semaphore_P(swap_sem);
+  for (slot = 1; slot < swap_slots; slot++) {
+    if (swap_refs[slot] != 0) {
+      used++;
+    }
+  }
+  semaphore_V(swap_sem);
+
+  info->swap_total = swap_slots - 1;
+  info->swap_used = used;
+}
+
+/** @} */
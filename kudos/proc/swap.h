@@ -0,0 +1,32 @@
+/*
+ * Swapping of user pages.
+ */
+
+#ifndef KUDOS_PROC_SWAP_H
+#define KUDOS_PROC_SWAP_H
+
+#include "lib/types.h"
+#include "proc/process.h"
+#include "vm/meminfo.h"
+
+/* Pages are swapped out when fewer than SWAP_LOW_WATER frames are
+   free, until SWAP_HIGH_WATER frames are free again */
+#define SWAP_LOW_WATER  32
+#define SWAP_HIGH_WATER 64
+
+void swap_init(void);
+
+void swap_balance(void);
+int swap_in(process_control_block_t *process, virtaddr_t vaddr, int flags);
+
+void swap_lock(void);
+void swap_unlock(void);
+void swap_fork(process_control_block_t *parent,
+               process_control_block_t *child,
+               virtaddr_t start, virtaddr_t end);
+void swap_discard(process_control_block_t *process,
+                  virtaddr_t start, virtaddr_t end);
+
+void swap_meminfo(meminfo_t *info);
+
+#endif // KUDOS_PROC_SWAP_H
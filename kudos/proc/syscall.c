@@ -8,6 +8,153 @@
 #include "lib/libc.h"
 #include "kernel/assert.h"
 #include "vm/memory.h"
+#include "proc/process.h"
+#include "proc/swap.h"
+#include "drivers/metadev.h"
+#include "drivers/device.h"
+#include "drivers/gcd.h"
+#include "fs/vfs.h"
+
+/* Bytes of a file read or write moved through a buffer on the stack
+   at a time. System calls run on the user stack, whose addresses the
+   disk cannot use, so the buffer must stay smaller than a disk block:
+   then filesystems never hand it to bcache_read_direct(), and copy
+   into it from the block cache instead. */
+#define SYSCALL_IO_CHUNK 256
+
+/* Fills in the memory statistics in info, a userland buffer. */
+static int syscall_meminfo(meminfo_t *info)
+{
+  meminfo_t stats;
+
+  memoryset(&stats, 0, sizeof(stats));
+  physmem_meminfo(&stats);
+  vm_meminfo(&stats);
+  swap_meminfo(&stats);
+
+  memcopy(sizeof(stats), info, &stats);
+  return 0;
+}
+
+/* Returns the system console, which the console descriptors use. */
+static gcd_t *syscall_console(void)
+{
+  device_t *dev = device_get(TYPECODE_TTY, 0);
+
+  KERNEL_ASSERT(dev != NULL);
+  return (gcd_t *)dev->generic_device;
+}
+
+/* Opens a file and returns its descriptor, or negative on error. */
+static int syscall_open(const char *pathname)
+{
+  process_control_block_t *process = process_get_current_process_entry();
+  openfile_t file;
+  int fd;
+
+  file = vfs_open((char *)pathname);
+  if (file < 0) {
+    return file;
+  }
+
+  fd = fd_alloc(&process->files, file);
+  if (fd < 0) {
+    vfs_close(file);
+    return VFS_LIMIT;
+  }
+  return fd;
+}
+
+/* Closes a descriptor. */
+static int syscall_close(int fd)
+{
+  return fd_close(&process_get_current_process_entry()->files, fd);
+}
+
+/* Sets the seek position of the file of a descriptor. */
+static int syscall_seek(int fd, int offset)
+{
+  openfile_t file;
+
+  if (fd_get(&process_get_current_process_entry()->files, fd, &file) < 0
+      || file == FD_CONSOLE) {
+    return VFS_INVALID_PARAMS;
+  }
+  return vfs_seek(file, offset);
+}
+
+/* Reads at most length bytes from a descriptor into buffer, a
+   userland buffer. Returns the number of bytes read, or negative on
+   error. */
+static int syscall_read(int fd, void *buffer, int length)
+{
+  char chunk[SYSCALL_IO_CHUNK];
+  gcd_t *gcd;
+  openfile_t file;
+  int done = 0;
+  int n;
+
+  if (length < 0
+      || fd_get(&process_get_current_process_entry()->files, fd, &file) < 0) {
+    return VFS_INVALID_PARAMS;
+  }
+
+  if (file == FD_CONSOLE) {
+    gcd = syscall_console();
+    return gcd->read(gcd, buffer, length);
+  }
+
+  while (done < length) {
+    n = vfs_read(file, chunk, MIN(length - done, SYSCALL_IO_CHUNK));
+    if (n < 0) {
+      return (done > 0) ? done : n;
+    }
+    if (n == 0) {
+      break;
+    }
+    memcopy(n, (char *)buffer + done, chunk);
+    done += n;
+  }
+
+  return done;
+}
+
+/* Writes length bytes from buffer, a userland buffer, to a
+   descriptor. Returns the number of bytes written, or negative on
+   error. */
+static int syscall_write(int fd, const void *buffer, int length)
+{
+  char chunk[SYSCALL_IO_CHUNK];
+  gcd_t *gcd;
+  openfile_t file;
+  int done = 0;
+  int n, size;
+
+  if (length < 0
+      || fd_get(&process_get_current_process_entry()->files, fd, &file) < 0) {
+    return VFS_INVALID_PARAMS;
+  }
+
+  if (file == FD_CONSOLE) {
+    gcd = syscall_console();
+    return gcd->write(gcd, buffer, length);
+  }
+
+  while (done < length) {
+    size = MIN(length - done, SYSCALL_IO_CHUNK);
+    memcopy(size, chunk, (const char *)buffer + done);
+    n = vfs_write(file, chunk, size);
+    if (n < 0) {
+      return (done > 0) ? done : n;
+    }
+    done += n;
+    if (n < size) {
+      break;
+    }
+  }
+
+  return done;
+}
 
 /**
  * Handle system calls. Interrupts are enabled when this function is
@@ -33,6 +180,39 @@ uintptr_t syscall_entry(uintptr_t syscall,
     kprintf("CALLED syscall halt_kernel\n");
     halt_kernel();
     break;
+  case SYSCALL_TIME:
+    return rtc_get_msec();
+  case SYSCALL_EXIT:
+    process_exit((int)arg0);
+    break;
+  case SYSCALL_JOIN:
+    return process_join((process_id_t)arg0);
+  case SYSCALL_FORK:
+    return process_fork(arg0, (int)arg1);
+  case SYSCALL_MEMLIMIT:
+    return process_memlimit(arg0);
+  case SYSCALL_MMAP:
+    return process_mmap((const char *)arg0, arg1);
+  case SYSCALL_MUNMAP:
+    return process_munmap(arg0);
+  case SYSCALL_SHM_CREATE:
+    return process_shm_create((const char *)arg0, arg1);
+  case SYSCALL_SHM_ATTACH:
+    return process_shm_attach((const char *)arg0);
+  case SYSCALL_SHM_DETACH:
+    return process_shm_detach(arg0);
+  case SYSCALL_MEMINFO:
+    return syscall_meminfo((meminfo_t *)arg0);
+  case SYSCALL_OPEN:
+    return syscall_open((const char *)arg0);
+  case SYSCALL_CLOSE:
+    return syscall_close((int)arg0);
+  case SYSCALL_SEEK:
+    return syscall_seek((int)arg0, (int)arg1);
+  case SYSCALL_READ:
+    return syscall_read((int)arg0, (void *)arg1, (int)arg2);
+  case SYSCALL_WRITE:
+    return syscall_write((int)arg0, (const void *)arg1, (int)arg2);
   default:
     KERNEL_PANIC("Unhandled system call\n");
   }
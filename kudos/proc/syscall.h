@@ -9,12 +9,19 @@
  * modify the existing ones.
  */
 #define SYSCALL_HALT      0x001
+#define SYSCALL_TIME      0x002
 
 #define SYSCALL_SPAWN     0x101
 #define SYSCALL_EXIT      0x102
 #define SYSCALL_JOIN      0x103
 #define SYSCALL_FORK      0x104
 #define SYSCALL_MEMLIMIT  0x105
+#define SYSCALL_MMAP      0x106
+#define SYSCALL_MUNMAP    0x107
+#define SYSCALL_SHM_CREATE 0x108
+#define SYSCALL_SHM_ATTACH 0x109
+#define SYSCALL_SHM_DETACH 0x10A
+#define SYSCALL_MEMINFO   0x10B
 
 #define SYSCALL_OPEN      0x201
 #define SYSCALL_CLOSE     0x202
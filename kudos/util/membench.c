@@ -0,0 +1,206 @@
+/*
+ * Host benchmark of the kernel memcopy() and memoryset().
+ *
+ * Compares the original portable implementations with the ones in
+ * lib/x86_64/memory.c and lib/mips32/memory.c (the latter is plain C,
+ * so it runs on the host too). The kernel is built without
+ * optimization, and so is this benchmark. Every implementation is
+ * first checked against the C library.
+ *
+ * Build with "make util/membench".
+ * Usage: util/membench [megabytes per test]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KUDOS_LIB_LIBC_H 1
+
+#define memcopy   x86_64_memcopy
+#define memoryset x86_64_memoryset
+#include "lib/x86_64/memory.c"
+#undef memcopy
+#undef memoryset
+
+#define memcopy   mips32_memcopy
+#define memoryset mips32_memoryset
+#include "lib/mips32/memory.c"
+#undef memcopy
+#undef memoryset
+
+#define MEMBENCH_BUFFER_SIZE 0x20000
+
+/* The original memcopy() from lib/libc.c */
+static void old_memcopy(int buflen, void *target, const void *source)
+{
+  int i;
+  char *t;
+  const char *s;
+  uint32_t *tgt;
+  const uint32_t *src;
+
+  tgt = (uint32_t *) target;
+  src = (uint32_t *) source;
+
+  if(((uintptr_t)tgt % 4) != 0 || ((uintptr_t)src % 4) != 0 )
+    {
+      t = (char *)tgt;
+      s = (const char *)src;
+
+      for(i = 0; i < buflen; i++) {
+        t[i] = s[i];
+      }
+
+      return;
+    }
+
+  for(i = 0; i < (buflen/4); i++) {
+    *tgt = *src;
+    tgt++;
+    src++;
+  }
+
+  t = (char *)tgt;
+  s = (const char *)src;
+
+  for(i = 0; i < (buflen%4); i++) {
+    t[i] = s[i];
+  }
+}
+
+/* The original memoryset() from lib/libc.c */
+static void old_memoryset(void *target, char value, int size)
+{
+  int i;
+  char *tgt;
+
+  tgt = (char *)target;
+  for(i = 0; i < size; i++)
+    tgt[i] = value;
+}
+
+typedef struct {
+  const char *name;
+  void (*copy)(int, void *, const void *);
+  void (*set)(void *, char, int);
+} membench_impl_t;
+
+static const membench_impl_t impls[] = {
+  { "old", old_memcopy, old_memoryset },
+  { "mips32", mips32_memcopy, mips32_memoryset },
+  { "x86_64", x86_64_memcopy, x86_64_memoryset },
+};
+
+#define MEMBENCH_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static const int sizes[] = { 16, 64, 512, 4096, 65536 };
+
+#define MEMBENCH_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static uint8_t src_buf[MEMBENCH_BUFFER_SIZE + 64];
+static uint8_t dst_buf[MEMBENCH_BUFFER_SIZE + 64];
+static uint8_t ref_buf[MEMBENCH_BUFFER_SIZE + 64];
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Checks every implementation on all small sizes and alignments, and
+   on random large ones. Returns the number of failures. */
+static int check(void)
+{
+  unsigned int i, n;
+  int len, soff, doff, failures = 0;
+
+  for (i = 0; i < sizeof(src_buf); i++) {
+    src_buf[i] = rand();
+  }
+
+  for (i = 0; i < MEMBENCH_IMPLS; i++) {
+    for (n = 0; n < 20000; n++) {
+      len = n < 4096 ? (int)(n / 16) : rand() % MEMBENCH_BUFFER_SIZE;
+      soff = n < 4096 ? (int)(n % 8) : rand() % 32;
+      doff = n < 4096 ? (int)(n / 8 % 8) : rand() % 32;
+
+      memset(dst_buf, 0xAA, sizeof(dst_buf));
+      memset(ref_buf, 0xAA, sizeof(ref_buf));
+      impls[i].copy(len, dst_buf + doff, src_buf + soff);
+      memcpy(ref_buf + doff, src_buf + soff, len);
+      if (memcmp(dst_buf, ref_buf, sizeof(dst_buf)) != 0) {
+        printf("%s: memcopy(%d) at offsets %d/%d failed\n",
+               impls[i].name, len, soff, doff);
+        failures++;
+      }
+
+      impls[i].set(dst_buf + doff, (char)n, len);
+      memset(ref_buf + doff, (char)n, len);
+      if (memcmp(dst_buf, ref_buf, sizeof(dst_buf)) != 0) {
+        printf("%s: memoryset(%d) at offset %d failed\n",
+               impls[i].name, len, doff);
+        failures++;
+      }
+    }
+  }
+
+  return failures;
+}
+
+/* Returns the throughput of one implementation in MiB/s. */
+static double bench(const membench_impl_t *impl, int set, int size,
+                    int misalign, long total)
+{
+  long iterations = total / size, i;
+  double start;
+
+  start = now();
+  for (i = 0; i < iterations; i++) {
+    if (set) {
+      impl->set(dst_buf + misalign, (char)i, size);
+    } else {
+      impl->copy(size, dst_buf, src_buf + misalign);
+    }
+  }
+
+  return (double)iterations * size / (now() - start) / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+  long total = 64L << 20;
+  unsigned int i, j, k;
+
+  if (argc > 1) {
+    total = atol(argv[1]) << 20;
+  }
+
+  if (check() != 0) {
+    return 1;
+  }
+
+  for (k = 0; k < 4; k++) {
+    printf("\n%s, %s (MiB/s)\n%8s",
+           k < 2 ? "memcopy" : "memoryset",
+           k % 2 ? "misaligned by 1" : "aligned", "bytes");
+    for (i = 0; i < MEMBENCH_IMPLS; i++) {
+      printf("%10s", impls[i].name);
+    }
+    printf("\n");
+
+    for (j = 0; j < MEMBENCH_SIZES; j++) {
+      printf("%8d", sizes[j]);
+      for (i = 0; i < MEMBENCH_IMPLS; i++) {
+        printf("%10.0f", bench(&impls[i], k >= 2, sizes[j], k % 2, total));
+      }
+      printf("\n");
+    }
+  }
+
+  return 0;
+}
@@ -6,13 +6,17 @@ MODULE := util
 EXTRAINC      := -I./drivers/mips -I./drivers/x86_64 -I./vm/mips -I./vm/x86_64 -I./kernel/mips -I./kernel/x86_64
 NATIVECC      := gcc
 NATIVECFLAGS  += -O2 -g -I. -Wall -W
-TARGETS       += util/tfstool
+TARGETS       += util/tfstool util/membench
 
 util/tfstool: util/tfstool.o
 	$(NATIVECC) -o $@ $^
 
-util/tfstool.o: util/tfstool.c util/tfstool.h fs/tfs.h lib/bitmap.h
+util/tfstool.o: util/tfstool.c util/tfstool.h fs/tfs.h fs/efs_constants.h lib/bitmap.h
 	$(NATIVECC) $(EXTRAINC) -o $@  $(NATIVECFLAGS) -c $<
 
+# Built like the kernel, without optimization
+util/membench: util/membench.c lib/x86_64/memory.c lib/mips32/memory.c
+	$(NATIVECC) -o $@ -g -I. -Wall -W -fno-builtin $<
+
 utilclean:
-	rm -f util/*.[od] util/tfstool
+	rm -f util/*.[od] util/tfstool util/membench
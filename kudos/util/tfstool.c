@@ -15,6 +15,7 @@
 #define KUDOS_LIB_LIBC_H 1
 
 #include "fs/tfs_constants.h"
+#include "fs/efs_constants.h"
 #include "lib/bitmap.h"
 #include "util/tfstool.h"
 
@@ -28,6 +29,14 @@ void tfstool_read(char *diskname, char *source, char *target);
 FILE *openfile(char *filename, const char *mode);
 void read_block(block_t data, int block);
 void write_block(block_t data, int block);
+void tfstool_efs_createvol(char *diskname, uint32_t size, char *volname);
+void tfstool_efs_list(char *filename);
+void tfstool_efs_write(char *diskname, char *source, char *target);
+void tfstool_efs_delete(char *diskname, char *filename);
+void tfstool_efs_read(char *diskname, char *source, char *target);
+int is_efs(char *diskname);
+void efs_read_block(void *data, uint32_t block);
+void efs_write_block(const void *data, uint32_t block);
 
 FILE *disk;
 
@@ -51,9 +60,13 @@ void print_usage(void)
   printf("  write  <image name> <local file name> [<tfs filename>]\n");
   printf("  read   <image name> <TFS filename> [<local filename>]\n");
   printf("  delete <image name> <TFS filename>\n");
+  printf("  efscreate <image name> <size in %d-byte blocks> <volume name>\n",
+         EFS_BLOCK_SIZE);
   printf("\n");
   printf("N.B.: You need to make the size at least 3 blocks in order to\n");
   printf("      include header, allocaton table and master directory.\n");
+  printf("      efscreate creates an Extent Filesystem (EFS) volume for\n");
+  printf("      large files, the other commands handle both kinds.\n");
   exit(EXIT_FAILURE);
 }
 
@@ -73,54 +86,92 @@ int main(int argc, char *argv[])
     if (argc != 5)
       print_usage();
 
-    strncpy(diskfilename, argv[2], FILENAME_MAX);
+    strncpy(diskfilename, argv[2], FILENAME_MAX - 1);
+    diskfilename[FILENAME_MAX - 1] = '\0';
     size = (size_t)strtoul(argv[3], NULL, 10);
-    strncpy(volname, argv[4], TFS_VOLNAME_MAX);
-    volname[TFS_FILENAME_MAX - 1] = '\0';
+    strncpy(volname, argv[4], TFS_VOLNAME_MAX - 1);
+    volname[TFS_VOLNAME_MAX - 1] = '\0';
 
     tfstool_createvol(diskfilename, size, volname);
+  } else if (!strncmp(argv[1], "efscreate", 9)) {
+    if (argc != 5)
+      print_usage();
+
+    strncpy(diskfilename, argv[2], FILENAME_MAX - 1);
+    diskfilename[FILENAME_MAX - 1] = '\0';
+    size = (size_t)strtoul(argv[3], NULL, 10);
+    strncpy(volname, argv[4], TFS_VOLNAME_MAX - 1);
+    volname[TFS_VOLNAME_MAX - 1] = '\0';
+
+    /* The size in sectors must fit in 32 bits */
+    if (size == 0 || size > 0xffffffff / EFS_SECTORS_PER_BLOCK) {
+      printf("tfstool: Invalid disk size.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    tfstool_efs_createvol(diskfilename, size, volname);
   } else if (!strncmp(argv[1], "list", 4)) {
     if (argc != 3)
       print_usage();
 
-    strncpy(diskfilename, argv[2], FILENAME_MAX);
+    strncpy(diskfilename, argv[2], FILENAME_MAX - 1);
+    diskfilename[FILENAME_MAX - 1] = '\0';
 
-    tfstool_list(diskfilename);
+    if (is_efs(diskfilename))
+      tfstool_efs_list(diskfilename);
+    else
+      tfstool_list(diskfilename);
   } else if (!strncmp(argv[1], "write", 5)) {
     if (argc < 4 || argc > 5)
       print_usage();
 
-    strncpy(diskfilename, argv[2], FILENAME_MAX);
-    strncpy(localfilename, argv[3], FILENAME_MAX);
+    strncpy(diskfilename, argv[2], FILENAME_MAX - 1);
+    diskfilename[FILENAME_MAX - 1] = '\0';
+    strncpy(localfilename, argv[3], FILENAME_MAX - 1);
+    localfilename[FILENAME_MAX - 1] = '\0';
 
     if (argc == 5)
-      strncpy(tfsfilename, argv[4], TFS_FILENAME_MAX);
+      strncpy(tfsfilename, argv[4], TFS_FILENAME_MAX - 1);
     else
-      strncpy(tfsfilename, localfilename, TFS_FILENAME_MAX);
+      strncpy(tfsfilename, localfilename, TFS_FILENAME_MAX - 1);
     tfsfilename[TFS_FILENAME_MAX - 1] = '\0';
 
-    tfstool_write(diskfilename, localfilename, tfsfilename);
+    if (is_efs(diskfilename))
+      tfstool_efs_write(diskfilename, localfilename, tfsfilename);
+    else
+      tfstool_write(diskfilename, localfilename, tfsfilename);
   } else if (!strncmp(argv[1], "read", 4)) {
     if (argc < 4 || argc > 5)
       print_usage();
 
-    strncpy(diskfilename, argv[2], FILENAME_MAX);
-    strncpy(tfsfilename, argv[3], TFS_FILENAME_MAX);
+    strncpy(diskfilename, argv[2], FILENAME_MAX - 1);
+    diskfilename[FILENAME_MAX - 1] = '\0';
+    strncpy(tfsfilename, argv[3], TFS_FILENAME_MAX - 1);
+    tfsfilename[TFS_FILENAME_MAX - 1] = '\0';
 
 
     if (argc == 5)
-      strncpy(localfilename, argv[4], FILENAME_MAX);
+      strncpy(localfilename, argv[4], FILENAME_MAX - 1);
     else
-      strncpy(localfilename, tfsfilename, FILENAME_MAX);
+      strncpy(localfilename, tfsfilename, FILENAME_MAX - 1);
+    localfilename[FILENAME_MAX - 1] = '\0';
 
-    tfstool_read(diskfilename, tfsfilename, localfilename);
+    if (is_efs(diskfilename))
+      tfstool_efs_read(diskfilename, tfsfilename, localfilename);
+    else
+      tfstool_read(diskfilename, tfsfilename, localfilename);
   } else if (!strncmp(argv[1], "delete", 6)) {
     if (argc != 4)
       print_usage();
-    strncpy(diskfilename, argv[2], FILENAME_MAX);
-    strncpy(tfsfilename, argv[3], TFS_FILENAME_MAX);
+    strncpy(diskfilename, argv[2], FILENAME_MAX - 1);
+    diskfilename[FILENAME_MAX - 1] = '\0';
+    strncpy(tfsfilename, argv[3], TFS_FILENAME_MAX - 1);
+    tfsfilename[TFS_FILENAME_MAX - 1] = '\0';
 
-    tfstool_delete(diskfilename, tfsfilename);
+    if (is_efs(diskfilename))
+      tfstool_efs_delete(diskfilename, tfsfilename);
+    else
+      tfstool_delete(diskfilename, tfsfilename);
   } else {
     print_usage();
   }
@@ -468,6 +519,430 @@ void tfstool_delete(char *diskfilename, char *filename)
   printf("File '%s' deleted from '%s'.\n", filename, diskfilename);
 }
 
+/* EFS volumes. The allocation bitmap, the directory inode and the
+   directory of the volume are kept in memory by efs_load() and
+   written back by efs_store(). */
+
+efs_header_t efs_header;
+uint8_t *efs_bitmap;
+efs_inode_t efs_dirinode;
+efs_direntry_t *efs_dir;
+uint32_t efs_direntries;
+
+/* Returns nonzero if the image file 'diskfilename' holds an EFS
+   volume. */
+int is_efs(char *diskfilename)
+{
+  FILE *fp;
+  uint32_t magic = 0;
+
+  fp = openfile(diskfilename, "r");
+  if (fread(&magic, sizeof(magic), 1, fp) != 1)
+    magic = 0;
+  fclose(fp);
+
+  return ntohl(magic) == EFS_MAGIC;
+}
+
+/* Marks 'length' blocks starting from 'start' used (value 1) or free
+   (value 0) in the EFS allocation bitmap. */
+void efs_mark(uint32_t start, uint32_t length, int value)
+{
+  uint32_t b;
+
+  for (b = start; b < start + length; b++) {
+    if (value)
+      efs_bitmap[b / 8] |= 1 << (b % 8);
+    else
+      efs_bitmap[b / 8] &= ~(1 << (b % 8));
+  }
+}
+
+/* Finds the first run of at least 'count' free blocks, or the longest
+   run if there is none, like the kernel does. Returns its length (at
+   most 'count'), 0 if the volume is full. */
+uint32_t efs_find_run(uint32_t count, uint32_t *start)
+{
+  uint32_t b, run = 0, best = 0;
+
+  for (b = 0; b < ntohl(efs_header.totalblocks) && best < count; b++) {
+    if (efs_bitmap[b / 8] & (1 << (b % 8))) {
+      run = 0;
+    } else if (++run > best) {
+      best = run;
+      *start = b + 1 - run;
+    }
+  }
+
+  return best;
+}
+
+/* Adds blocks to the end of the extents of 'inode'. Returns 0 if the
+   inode has no room for another extent. */
+int efs_append(efs_inode_t *inode, uint32_t start, uint32_t length)
+{
+  uint32_t n = ntohl(inode->extents);
+
+  if (n > 0 && ntohl(inode->extent[n - 1].start)
+      + ntohl(inode->extent[n - 1].length) == start) {
+    inode->extent[n - 1].length =
+      htonl(ntohl(inode->extent[n - 1].length) + length);
+    return 1;
+  }
+
+  if (n >= EFS_EXTENTS_MAX)
+    return 0;
+
+  inode->extent[n].start = htonl(start);
+  inode->extent[n].length = htonl(length);
+  inode->extents = htonl(n + 1);
+  return 1;
+}
+
+/* Returns the disk block holding block 'fblock' of the file of
+   'inode', 0 if there is none. */
+uint32_t efs_map(efs_inode_t *inode, uint32_t fblock)
+{
+  uint32_t i, length;
+
+  for (i = 0; i < ntohl(inode->extents) && i < EFS_EXTENTS_MAX; i++) {
+    length = ntohl(inode->extent[i].length);
+    if (fblock < length)
+      return ntohl(inode->extent[i].start) + fblock;
+    fblock -= length;
+  }
+
+  return 0;
+}
+
+/* Reads the metadata of the EFS volume in 'disk'. Room is left for
+   adding one block to the directory. */
+void efs_load(void)
+{
+  uint8_t block[EFS_BLOCK_SIZE];
+  uint32_t i, size;
+
+  efs_read_block(block, EFS_HEADER_BLOCK);
+  memcpy(&efs_header, block, sizeof(efs_header_t));
+
+  size = ntohl(efs_header.bitmapblocks) * EFS_BLOCK_SIZE;
+  efs_bitmap = malloc(size);
+  if (efs_bitmap == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < ntohl(efs_header.bitmapblocks); i++)
+    efs_read_block(efs_bitmap + i * EFS_BLOCK_SIZE, EFS_BITMAP_BLOCK + i);
+
+  efs_read_block(&efs_dirinode, ntohl(efs_header.directory));
+  size = ntohl(efs_dirinode.filesize);
+  efs_dir = malloc(size + EFS_BLOCK_SIZE);
+  if (efs_dir == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < size / EFS_BLOCK_SIZE; i++)
+    efs_read_block((uint8_t *)efs_dir + i * EFS_BLOCK_SIZE,
+                   efs_map(&efs_dirinode, i));
+  efs_direntries = size / sizeof(efs_direntry_t);
+}
+
+/* Writes the metadata read by efs_load() back to 'disk'. */
+void efs_store(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < ntohl(efs_header.bitmapblocks); i++)
+    efs_write_block(efs_bitmap + i * EFS_BLOCK_SIZE, EFS_BITMAP_BLOCK + i);
+
+  efs_write_block(&efs_dirinode, ntohl(efs_header.directory));
+  for (i = 0; i < ntohl(efs_dirinode.filesize) / EFS_BLOCK_SIZE; i++)
+    efs_write_block((uint8_t *)efs_dir + i * EFS_BLOCK_SIZE,
+                    efs_map(&efs_dirinode, i));
+}
+
+/* Returns the index of the EFS directory entry of 'filename', -1 if
+   there is none. */
+int efs_lookup(char *filename)
+{
+  uint32_t i;
+
+  for (i = 0; i < efs_direntries; i++) {
+    if (efs_dir[i].inode != 0 &&
+        strncmp(efs_dir[i].name, filename, EFS_FILENAME_MAX) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+/* Creates an EFS volume named 'volname' in the image file
+   'diskfilename', the size of the volume is 'size' blocks (a block is
+   4096 bytes). */
+void tfstool_efs_createvol(char *diskfilename, uint32_t size, char *volname)
+{
+  uint8_t header[EFS_BLOCK_SIZE];
+  efs_header_t *h = (efs_header_t *)header;
+  efs_inode_t dirinode;
+  uint32_t i, bitmapblocks, directory;
+
+  bitmapblocks = (size + EFS_BITS_PER_BLOCK - 1) / EFS_BITS_PER_BLOCK;
+  directory = EFS_BITMAP_BLOCK + bitmapblocks;
+
+  disk = fopen(diskfilename, "r");
+  if (disk != NULL) {
+    printf("tfstool: File '%s' already exists?\n", diskfilename);
+    exit(EXIT_FAILURE);
+  }
+
+  /* check that there is room for the system blocks and the first
+     directory block, and that all sectors can be addressed */
+  if (size < directory + 2 || size > 0xffffffff / EFS_SECTORS_PER_BLOCK) {
+    printf("tfstool: Invalid disk size. Disk size must be");
+    printf(" at least %u blocks.\n", (unsigned int) directory + 2);
+    exit(EXIT_FAILURE);
+  }
+
+  disk = openfile(diskfilename, "wb");
+
+  /* set up the header block and write it */
+  memset(header, 0, EFS_BLOCK_SIZE);
+  h->magic = htonl(EFS_MAGIC);
+  h->totalblocks = htonl(size);
+  h->bitmapblocks = htonl(bitmapblocks);
+  h->directory = htonl(directory);
+  memcpy(h->volname, volname, EFS_VOLNAME_MAX);
+  efs_write_block(header, EFS_HEADER_BLOCK);
+
+  /* the system blocks and the directory block are in use */
+  efs_bitmap = calloc(bitmapblocks, EFS_BLOCK_SIZE);
+  if (efs_bitmap == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  efs_mark(0, directory + 2, 1);
+  for (i = 0; i < bitmapblocks; i++)
+    efs_write_block(efs_bitmap + i * EFS_BLOCK_SIZE, EFS_BITMAP_BLOCK + i);
+
+  /* the directory is one empty block */
+  memset(&dirinode, 0, sizeof(dirinode));
+  dirinode.filesize = htonl(EFS_BLOCK_SIZE);
+  dirinode.extents = htonl(1);
+  dirinode.extent[0].start = htonl(directory + 1);
+  dirinode.extent[0].length = htonl(1);
+  efs_write_block(&dirinode, directory);
+  efs_write_block(NULL, directory + 1);
+
+  /* The data blocks are left as a hole in the image file, which
+     reads as zeros. */
+  if (size > directory + 2)
+    efs_write_block(NULL, size - 1);
+
+  fclose(disk);
+
+  printf("Disk image '%s', EFS volume name '%s', size %u blocks created.\n",
+         diskfilename, volname, (unsigned int) size);
+}
+
+/* Copy a file 'source' from host file system to kudos efs filesystem
+   as 'target'. The blocks are allocated in as few extents as
+   possible. */
+void tfstool_efs_write(char *diskfilename, char *source, char *target)
+{
+  efs_inode_t inode;
+  uint8_t data[EFS_BLOCK_SIZE];
+  uint32_t i, index, inode_bnum, start, run, numblocks;
+  uint32_t filesize = 0;
+
+  /* Pointer to source file in host file system. */
+  FILE *source_fp;
+  unsigned long source_filesize;
+
+  disk = openfile(diskfilename, "r+");
+
+  source_fp = openfile(source, "r");
+  source_filesize = getfilesize(source_fp);
+  if (source_filesize > EFS_MAX_FILESIZE) {
+    printf("Error: File '%s' is too large.\n", source);
+    exit(EXIT_FAILURE);
+  }
+
+  efs_load();
+
+  /* Find a free directory entry, or add a directory block. */
+  if (efs_lookup(target) >= 0) {
+    printf("File %s already exists in EFS.\n", target);
+    exit(EXIT_FAILURE);
+  }
+  for (index = 0; index < efs_direntries; index++) {
+    if (efs_dir[index].inode == 0)
+      break;
+  }
+  if (index == efs_direntries) {
+    if (efs_find_run(1, &start) != 1 || !efs_append(&efs_dirinode, start, 1)) {
+      printf("EFS full.\n");
+      exit(EXIT_FAILURE);
+    }
+    efs_mark(start, 1, 1);
+    memset(&efs_dir[index], 0, EFS_BLOCK_SIZE);
+    efs_dirinode.filesize = htonl(ntohl(efs_dirinode.filesize)
+                                  + EFS_BLOCK_SIZE);
+    efs_direntries += EFS_BLOCK_SIZE / sizeof(efs_direntry_t);
+  }
+
+  if (efs_find_run(1, &inode_bnum) != 1) {
+    printf("Error: Could not allocate inode (disk full?).\n");
+    exit(EXIT_FAILURE);
+  }
+  efs_mark(inode_bnum, 1, 1);
+  memset(&inode, 0, sizeof(inode));
+
+  /* Write the file one run of free blocks at a time. Nothing is
+     stored in the volume before efs_store(), so it does not matter
+     that blocks were written if we fail. */
+  numblocks = (source_filesize + EFS_BLOCK_SIZE - 1) / EFS_BLOCK_SIZE;
+  while (numblocks > 0) {
+    run = efs_find_run(numblocks, &start);
+    if (run == 0 || !efs_append(&inode, start, run)) {
+      printf("Error: while writing file to efs-file (disk full?)\n");
+      exit(EXIT_FAILURE);
+    }
+    efs_mark(start, run, 1);
+
+    for (i = 0; i < run; i++) {
+      memset(data, 0, EFS_BLOCK_SIZE);
+      filesize += fread(data, 1, EFS_BLOCK_SIZE, source_fp);
+      efs_write_block(data, start + i);
+    }
+    numblocks -= run;
+  }
+
+  if (filesize != source_filesize) {
+    printf("Error: Only %u bytes (of %lu bytes) could be read"
+           " -- wrote nothing.\n", (unsigned int) filesize, source_filesize);
+    exit(EXIT_FAILURE);
+  }
+
+  inode.filesize = htonl(filesize);
+  efs_write_block(&inode, inode_bnum);
+
+  efs_dir[index].inode = htonl(inode_bnum);
+  memset(efs_dir[index].name, 0, EFS_FILENAME_MAX);
+  strncpy(efs_dir[index].name, target, EFS_FILENAME_MAX - 1);
+  efs_store();
+
+  fclose(source_fp);
+  fclose(disk);
+
+  printf("File '%s' written to '%s' as '%s' in %u extents.\n",
+         source, diskfilename, target, (unsigned int) ntohl(inode.extents));
+}
+
+/* Copy a file 'source' from kudos efs filesystem to host filesystem
+   as 'target'. */
+void tfstool_efs_read(char *diskfilename, char *source, char *target)
+{
+  efs_inode_t inode;
+  uint8_t data[EFS_BLOCK_SIZE];
+  uint32_t i, size, filesize, count = 0;
+  int index;
+
+  /* target file on host file system */
+  FILE *t;
+
+  disk = openfile(diskfilename, "r");
+  efs_load();
+
+  index = efs_lookup(source);
+  if (index < 0) {
+    printf("File '%s' not found.\n", source);
+    exit(EXIT_FAILURE);
+  }
+
+  t = openfile(target, "w");
+
+  efs_read_block(&inode, ntohl(efs_dir[index].inode));
+  filesize = ntohl(inode.filesize);
+  for (i = 0; count < filesize; i++) {
+    efs_read_block(data, efs_map(&inode, i));
+
+    size = filesize - count;
+    if (size > EFS_BLOCK_SIZE)
+      size = EFS_BLOCK_SIZE;
+
+    count += fwrite(data, 1, size, t);
+  }
+
+  printf("%u bytes written to file '%s'.\n", (unsigned int) count, target);
+
+  fclose(t);
+  fclose(disk);
+}
+
+/* Lists the files in the EFS image file named 'diskfilename'. */
+void tfstool_efs_list(char *diskfilename)
+{
+  efs_inode_t inode;
+  uint32_t i, j;
+
+  disk = openfile(diskfilename, "r");
+  efs_load();
+
+  printf("diskfilename: %s, EFS volume name: %.16s, volume blocks: %u\n\n",
+         diskfilename, efs_header.volname,
+         (unsigned int) ntohl(efs_header.totalblocks));
+
+  printf("inode       size  name                          extents\n");
+  for (i = 0; i < efs_direntries; i++) {
+    if (efs_dir[i].inode != 0) {
+      efs_read_block(&inode, ntohl(efs_dir[i].inode));
+
+      printf("%5u %10u  %-28.28s",
+             (unsigned int) ntohl(efs_dir[i].inode),
+             (unsigned int) ntohl(inode.filesize),
+             efs_dir[i].name);
+      for (j = 0; j < ntohl(inode.extents) && j < EFS_EXTENTS_MAX; j++)
+        printf(" %u+%u", (unsigned int) ntohl(inode.extent[j].start),
+               (unsigned int) ntohl(inode.extent[j].length));
+      printf("\n");
+    }
+  }
+
+  fclose(disk);
+}
+
+/* Deletes file 'filename' from the EFS disk 'diskfilename'. */
+void tfstool_efs_delete(char *diskfilename, char *filename)
+{
+  efs_inode_t inode;
+  uint32_t i, inode_bn;
+  int index;
+
+  disk = openfile(diskfilename, "r+");
+  efs_load();
+
+  index = efs_lookup(filename);
+  if (index < 0) {
+    printf("File '%s' not found.\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Release the extents and the inode block. */
+  inode_bn = ntohl(efs_dir[index].inode);
+  efs_read_block(&inode, inode_bn);
+  for (i = 0; i < ntohl(inode.extents) && i < EFS_EXTENTS_MAX; i++)
+    efs_mark(ntohl(inode.extent[i].start), ntohl(inode.extent[i].length), 0);
+  efs_mark(inode_bn, 1, 0);
+
+  efs_dir[index].inode = 0;
+  efs_dir[index].name[0] = '\0';
+  efs_store();
+
+  fclose(disk);
+
+  printf("File '%s' deleted from '%s'.\n", filename, diskfilename);
+}
+
 unsigned long getfilesize(FILE *fp)
 {
   long size, pos;
@@ -547,6 +1022,39 @@ void write_block(block_t data, int block)
 }
 
 
+/* Read EFS block 'block' to 'data'. */
+void efs_read_block(void *data, uint32_t block)
+{
+  if (fseeko(disk, (off_t)block * EFS_BLOCK_SIZE, SEEK_SET) != 0) {
+    perror("efs_read_block:fseek");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fread(data, EFS_BLOCK_SIZE, 1, disk) != 1) {
+    printf("error reading block: %u\n", (unsigned int) block);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Write 'data' to EFS block 'block', zeros if 'data' is NULL. */
+void efs_write_block(const void *data, uint32_t block)
+{
+  static uint8_t nullblock[EFS_BLOCK_SIZE];
+
+  if (fseeko(disk, (off_t)block * EFS_BLOCK_SIZE, SEEK_SET) != 0) {
+    perror("fseek");
+    exit(EXIT_FAILURE);
+  }
+
+  if (data == NULL)
+    data = nullblock;
+  if (fwrite(data, EFS_BLOCK_SIZE, 1, disk) != 1) {
+    perror("fwrite");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
 /* bitmap routines taken from kudos/bitmap.c */
 
 /**
@@ -7,7 +7,7 @@
 
 #include "fs/tfs_constants.h"
 
-#define TFSTOOL_VERSION "1.01"
+#define TFSTOOL_VERSION "1.02"
 
 typedef uint8_t block_t[TFS_BLOCK_SIZE];
 
@@ -0,0 +1,40 @@
+/*
+ * Memory statistics.
+ */
+
+#ifndef KUDOS_VM_MEMINFO_H
+#define KUDOS_VM_MEMINFO_H
+
+#include "lib/types.h"
+
+/* Snapshot of memory use, filled in by SYSCALL_MEMINFO. Sizes are in
+   pages of page_size bytes. Counters an architecture does not keep
+   are 0. This header is shared with userland. */
+typedef struct {
+  uint64_t page_size;
+
+  /* Page frames */
+  uint64_t total_frames;
+  uint64_t used_frames;
+  uint64_t free_frames;
+  /* Free frames zeroed ahead of time (counted in free_frames) */
+  uint64_t zeroed_frames;
+  /* Used frames mapped by more than one address space */
+  uint64_t shared_frames;
+  /* Longest run of contiguous free frames */
+  uint64_t largest_free_run;
+
+  /* Size of the page table pool (0 if page tables are allocated from
+     the page frames), and page tables in use */
+  uint64_t pagetables_total;
+  uint64_t pagetables_used;
+
+  /* Frames handed out by kmalloc since boot */
+  uint64_t kmalloc_frames;
+
+  /* Swap slots (see proc/swap.c) */
+  uint64_t swap_total;
+  uint64_t swap_used;
+} meminfo_t;
+
+#endif // KUDOS_VM_MEMINFO_H
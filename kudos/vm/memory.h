@@ -7,6 +7,7 @@
 
 /* Includes */
 #include "lib/types.h"
+#include "vm/meminfo.h"
 #include <mem.h>
 #include <pagetable.h>
 
@@ -22,6 +23,8 @@ physaddr_t physmem_allocblocks(uint32_t count);
 void physmem_freeblock(void *ptr);
 void physmem_freeblocks(void *ptr, uint32_t size);
 
+void physmem_meminfo(meminfo_t *info);
+
 /* Virtual Memory Management */
 #define USERLAND_STACK_TOP 0xFFFFFFFFFFFFFFFF
 
@@ -39,6 +42,8 @@ pagetable_t *vm_create_pagetable(uint32_t asid);
 void vm_destroy_pagetable(pagetable_t *pagetable);
 void vm_update_mappings(virtaddr_t *thread);
 
+void vm_meminfo(meminfo_t *info);
+
 void* kmalloc(uint64_t size);
 
 //void vm_memwrite(pagetable_t *pagetable, unsigned int buflen,
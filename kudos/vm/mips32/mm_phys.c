@@ -16,9 +16,9 @@
  * @{
  */
 
-/* Bitmap field of physical pages. Length is number of physical pages
-   rounded up to a word boundary */
-static bitmap_t *physmem_free_pages;
+/* Bitmap field of physical pages, with a summary of the full words
+   of the bitmap. */
+static hbitmap_t physmem_free_pages;
 
 /* Number of physical pages */
 static int physmem_num_pages;
@@ -99,6 +99,7 @@ int physmem_get_reserved_size()
 void physmem_init(void *bootinfo)
 {
   int num_res_pages;
+  bitmap_t *bits;
   int i;
 
   /* We dont use this */
@@ -106,9 +107,11 @@ void physmem_init(void *bootinfo)
 
   physmem_num_pages = physmem_get_size();
 
-  physmem_free_pages =
-    (uint32_t *)stalloc(bitmap_sizeof(physmem_num_pages));
-  bitmap_init(physmem_free_pages, physmem_num_pages);
+  bits = (bitmap_t *)stalloc(bitmap_sizeof(physmem_num_pages));
+  bitmap_init(bits, physmem_num_pages);
+  hbitmap_init(&physmem_free_pages, bits,
+               (bitmap_t *)stalloc(hbitmap_sizeof(physmem_num_pages)),
+               physmem_num_pages);
 
   /* Note that number of reserved pages must be get after we have
      (staticly) reserved memory for bitmap. */
@@ -117,7 +120,7 @@ void physmem_init(void *bootinfo)
   physmem_static_end = num_res_pages;
 
   for (i = 0; i < num_res_pages; i++)
-    bitmap_set(physmem_free_pages, i, 1);
+    hbitmap_set(&physmem_free_pages, i, 1);
 
   spinlock_reset(&physmem_slock);
 
@@ -142,7 +145,7 @@ physaddr_t physmem_allocblock(void)
   spinlock_acquire(&physmem_slock);
 
   if (physmem_num_free_pages > 0) {
-    i = bitmap_findnset(physmem_free_pages,physmem_num_pages);
+    i = hbitmap_findnset(&physmem_free_pages);
     physmem_num_free_pages--;
 
     /* There should have been a free page. Check that the physmem
@@ -178,9 +181,9 @@ void physmem_freeblock(void *Ptr)
   spinlock_acquire(&physmem_slock);
 
   /* Check that the page was reserved. */
-  KERNEL_ASSERT(bitmap_get(physmem_free_pages, i) == 1);
+  KERNEL_ASSERT(hbitmap_get(&physmem_free_pages, i) == 1);
 
-  bitmap_set(physmem_free_pages, i, 0);
+  hbitmap_set(&physmem_free_pages, i, 0);
   physmem_num_free_pages++;
 
   spinlock_release(&physmem_slock);
@@ -189,4 +192,35 @@ void physmem_freeblock(void *Ptr)
 
 
 
+/**
+ * Fills in the page frame statistics of info.
+ *
+ * @param info The statistics to fill in.
+ */
+void physmem_meminfo(meminfo_t *info)
+{
+  interrupt_status_t intr_status;
+  int i, run = 0, longest = 0;
+
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&physmem_slock);
+
+  for (i = physmem_static_end; i < physmem_num_pages; i++) {
+    if (hbitmap_get(&physmem_free_pages, i)) {
+      run = 0;
+    } else if (++run > longest) {
+      longest = run;
+    }
+  }
+
+  info->page_size = PAGE_SIZE;
+  info->total_frames = physmem_num_pages;
+  info->used_frames = physmem_num_pages - physmem_num_free_pages;
+  info->free_frames = physmem_num_free_pages;
+  info->largest_free_run = longest;
+
+  spinlock_release(&physmem_slock);
+  _interrupt_set_state(intr_status);
+}
+
 /** @} */
@@ -7,6 +7,8 @@
 #include "vm/memory.h"
 #include "kernel/stalloc.h"
 #include "kernel/assert.h"
+#include "kernel/panic.h"
+#include "lib/libc.h"
 
 /** @name Virtual memory system
  *
@@ -15,6 +17,9 @@
  * @{
  */
 
+/* Number of pages used for pagetables and second-level tables */
+static int vm_pagetable_pages;
+
 /**
  * Initializes virtual memory system. Initialization consists of page
  * pool initialization and disabling static memory reservation. After
@@ -36,6 +41,7 @@ void vm_init(void)
 /**
  *  Creates a new page table. Reserves memory (one page) for the table
  *  and sets the address space identifier for the created page table.
+ *  Stale TLB entries left by an earlier owner of the ASID are removed.
  *
  *  @param asid Address space identifier
  *
@@ -58,16 +64,21 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
      this way works only for pages allocated in the first 512MB of
      physical memory. */
   table = (pagetable_t *) (ADDR_PHYS_TO_KERNEL(addr));
+  vm_pagetable_pages++;
 
+  memoryset(table, 0, sizeof(pagetable_t));
   table->ASID        = asid;
   table->valid_count = 0;
 
+  tlb_invalidate_asid(asid);
+
   return table;
 }
 
 /**
- * Destroys given pagetable. Frees the memory (one page) allocated for
- * the pagetable. Does not remove mappings from the TLB.
+ * Destroys given pagetable. Frees the memory allocated for the
+ * pagetable and its second-level tables, and removes its entries from
+ * the TLB. The mapped pages themselves are not freed.
  *
  * @param pagetable Page table to destroy
  *
@@ -75,12 +86,60 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
 
 void vm_destroy_pagetable(pagetable_t *pagetable)
 {
+  unsigned int i;
+
+  for(i = 0; i < PAGETABLE_DIRECTORY_ENTRIES; i++) {
+    if(pagetable->directory[i] != NULL) {
+      physmem_freeblock((void*)ADDR_KERNEL_TO_PHYS(
+                          (uint32_t) pagetable->directory[i]));
+      vm_pagetable_pages--;
+    }
+  }
+
+  tlb_invalidate_asid(pagetable->ASID);
+
   physmem_freeblock((void*)ADDR_KERNEL_TO_PHYS((uint32_t) pagetable));
+  vm_pagetable_pages--;
+}
+
+/* Returns the EntryLo word mapping vaddr in pagetable. If there is no
+   second-level table for vaddr, one is allocated when create is set,
+   otherwise NULL is returned. */
+static uint32_t *vm_get_entrylo(pagetable_t *pagetable, virtaddr_t vaddr,
+                                int create)
+{
+  pagetable_pair_t **pairs;
+  pagetable_pair_t *pair;
+  physaddr_t addr;
+
+  /* Only the user segment is mapped through pagetables */
+  KERNEL_ASSERT(vaddr < 0x80000000);
+
+  pairs = &pagetable->directory[PAGETABLE_DIRECTORY_INDEX(vaddr)];
+  if(*pairs == NULL) {
+    if(!create)
+      return NULL;
+
+    addr = physmem_allocblock();
+    if(addr == 0)
+      KERNEL_PANIC("Out of memory for pagetables");
+
+    *pairs = (pagetable_pair_t *) ADDR_PHYS_TO_KERNEL(addr);
+    vm_pagetable_pages++;
+    memoryset(*pairs, 0, PAGETABLE_PAIRS * sizeof(pagetable_pair_t));
+  }
+
+  pair = &(*pairs)[PAGETABLE_PAIR_INDEX(vaddr)];
+  if(ADDR_IS_ON_EVEN_PAGE(vaddr))
+    return &pair->entrylo0;
+  else
+    return &pair->entrylo1;
 }
 
 /**
  * Maps given virtual address to given physical address in given page
- * table. Does not modify TLB. The mapping is done in 4k chunks (pages).
+ * table. The mapping is done in 4k chunks (pages). The TLB entry of
+ * the page pair is removed, so that the next access refills it.
  *
  * @param pagetable Page table in which to do the mapping
  *
@@ -101,7 +160,7 @@ void vm_map(pagetable_t *pagetable,
             virtaddr_t vaddr,
             int flags)
 {
-  unsigned int i;
+  uint32_t *entrylo;
 
   /* Sanity */
   if(pagetable == 0)
@@ -109,71 +168,23 @@ void vm_map(pagetable_t *pagetable,
 
   KERNEL_ASSERT(flags == 0 || flags == 1);
 
-  for(i=0; i<pagetable->valid_count; i++) {
-    if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-      /* TLB has separate mappings for even and odd
-         virtual pages. Let's handle them separately here,
-         and we have much more fun when updating the TLB later.*/
-      if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-        if(pagetable->entries[i].V0 == 1) {
-          KERNEL_PANIC("Tried to re-map same virtual page");
-        } else {
-          /* Map the page on a pair entry */
-          pagetable->entries[i].PFN0 = physaddr >> 12;
-          pagetable->entries[i].V0 = 1;
-          pagetable->entries[i].G0 = 0;
-          pagetable->entries[i].D0 = flags;
-          return;
-        }
-      } else {
-        if(pagetable->entries[i].V1 == 1) {
-          KERNEL_PANIC("Tried to re-map same virtual page");
-        } else {
-          /* Map the page on a pair entry */
-          pagetable->entries[i].PFN1 = physaddr >> 12;
-          pagetable->entries[i].V1 = 1;
-          pagetable->entries[i].G1 = 0;
-          pagetable->entries[i].D1 = flags;
-          return;
-        }
-      }
-    }
-  }
-  /* No previous or pairing mapping was found */
-
-  /* Make sure that pagetable is not full */
-  if(pagetable->valid_count >= PAGETABLE_ENTRIES) {
-    kprintf("Thread with ASID=%d run out of pagetable mapping entries\n",
-            pagetable->ASID);
-    kprintf("during an attempt to map vaddr 0x%8.8x => phys 0x%8.8x.\n",
-            vaddr, physaddr);
-    KERNEL_PANIC("Thread run out of pagetable mapping entries.");
-  }
-
-  /* Map the page on a new entry */
-
-  pagetable->entries[pagetable->valid_count].VPN2 = vaddr >> 13;
-  pagetable->entries[pagetable->valid_count].ASID = pagetable->ASID;
-
-  if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-    pagetable->entries[pagetable->valid_count].PFN0 = physaddr >> 12;
-    pagetable->entries[pagetable->valid_count].D0   = flags;
-    pagetable->entries[pagetable->valid_count].V0   = 1;
-    pagetable->entries[pagetable->valid_count].G0   = 0;
-    pagetable->entries[pagetable->valid_count].V1   = 0;
-  } else {
-    pagetable->entries[pagetable->valid_count].PFN1 = physaddr >> 12;
-    pagetable->entries[pagetable->valid_count].D1   = flags;
-    pagetable->entries[pagetable->valid_count].V1   = 1;
-    pagetable->entries[pagetable->valid_count].G1   = 0;
-    pagetable->entries[pagetable->valid_count].V0   = 0;
-  }
+  entrylo = vm_get_entrylo(pagetable, vaddr, 1);
+  if(*entrylo & PAGETABLE_ENTRYLO_VALID)
+    KERNEL_PANIC("Tried to re-map same virtual page");
 
+  *entrylo = ((physaddr >> 12) << PAGETABLE_ENTRYLO_PFN_SHIFT)
+    | PAGETABLE_ENTRYLO_VALID
+    | (flags ? PAGETABLE_ENTRYLO_DIRTY : 0);
   pagetable->valid_count++;
+
+  /* The other page of the pair may be in the TLB, with this one
+     still invalid */
+  tlb_invalidate_page(pagetable->ASID, vaddr);
 }
 
 /**
- * Unmaps given virtual address from given pagetable.
+ * Unmaps given virtual address from given pagetable. The mapped page
+ * is not freed.
  *
  * @param pagetable Page table to operate on
  *
@@ -183,29 +194,25 @@ void vm_map(pagetable_t *pagetable,
 
 void vm_unmap(pagetable_t *pagetable, virtaddr_t vaddr)
 {
-  pagetable = pagetable;
-  vaddr     = vaddr;
+  uint32_t *entrylo = vm_get_entrylo(pagetable, vaddr, 0);
+
+  if(entrylo == NULL || !(*entrylo & PAGETABLE_ENTRYLO_VALID))
+    return;
 
-  /* Not implemented */
+  *entrylo = 0;
+  pagetable->valid_count--;
+
+  tlb_invalidate_page(pagetable->ASID, vaddr);
 }
 
 physaddr_t vm_getmap(pagetable_t *pagetable, virtaddr_t vaddr)
 {
-  virtaddr_t vpn = vaddr >> 12; /* Get page number, as 2**12 = 4096 = page size */
-  virtaddr_t vpn2 = vpn >> 1; /* Get double-page number. */
-  unsigned int i;
+  uint32_t *entrylo = vm_get_entrylo(pagetable, vaddr, 0);
 
-  for(i = 0; i < pagetable->valid_count; i++) {
-    tlb_entry_t *entry = &pagetable->entries[i];
-    if (entry->VPN2 == vpn2) {
-      if (ADDR_IS_ON_EVEN_PAGE(vaddr) && entry->V0) {
-        return pagetable->entries[i].PFN0 << 12;
-      } else if (entry->V1) {
-        return pagetable->entries[i].PFN1 << 12;
-      }
-    }
-  }
-  return 0;
+  if(entrylo == NULL || !(*entrylo & PAGETABLE_ENTRYLO_VALID))
+    return 0;
+
+  return (*entrylo >> PAGETABLE_ENTRYLO_PFN_SHIFT) << 12;
 }
 
 /**
@@ -222,35 +229,31 @@ physaddr_t vm_getmap(pagetable_t *pagetable, virtaddr_t vaddr)
  */
 void vm_set_dirty(pagetable_t *pagetable, virtaddr_t vaddr, int dirty)
 {
-  unsigned int i;
+  uint32_t *entrylo = vm_get_entrylo(pagetable, vaddr, 0);
 
   KERNEL_ASSERT(dirty == 0 || dirty == 1);
 
-  for(i=0; i<pagetable->valid_count; i++) {
-    if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-      /* Check whether this is an even or odd page */
-      if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-        if(pagetable->entries[i].V0 == 0) {
-          KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                       "entry");
-        } else {
-          pagetable->entries[i].D0 = dirty;
-          return;
-        }
-      } else {
-        if(pagetable->entries[i].V1 == 0) {
-          KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                       "entry");
-        } else {
-          pagetable->entries[i].D1 = dirty;
-          return;
-        }
-      }
-    }
-  }
-  /* No mapping was found */
+  if(entrylo == NULL || !(*entrylo & PAGETABLE_ENTRYLO_VALID))
+    KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+
+  if(dirty)
+    *entrylo |= PAGETABLE_ENTRYLO_DIRTY;
+  else
+    *entrylo &= ~PAGETABLE_ENTRYLO_DIRTY;
+
+  tlb_invalidate_page(pagetable->ASID, vaddr);
+}
 
-  KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+/**
+ * Fills in the pagetable statistics of info. Pagetables are allocated
+ * from the page frames, so there is no pool.
+ *
+ * @param info The statistics to fill in.
+ */
+void vm_meminfo(meminfo_t *info)
+{
+  info->pagetables_total = 0;
+  info->pagetables_used = vm_pagetable_pages;
 }
 
 /** @} */
@@ -9,18 +9,41 @@
 #define ADDR_IS_ON_ODD_PAGE(addr)  ((addr) & 0x00001000)
 #define ADDR_IS_ON_EVEN_PAGE(addr) (!((addr) & 0x00001000))
 
-/* Number of mapping entries in one pagetable. This is the number
-   of entries that fits on a single hardware memory page (4k). */
-#define PAGETABLE_ENTRIES 340
+/* The user segment (kuseg, 2GB) is mapped by a two-level page
+   table. The directory is indexed by bits 30..22 of the virtual
+   address and points to second-level tables of page pairs, which are
+   indexed by bits 21..13 (the low bits of VPN2). A second-level table
+   maps 4MB and fits on a single hardware memory page (4k). The TLB
+   refill handler in _tlb.S depends on this layout. */
+#define PAGETABLE_DIRECTORY_ENTRIES 512
+#define PAGETABLE_PAIRS 512
+
+#define PAGETABLE_DIRECTORY_INDEX(addr) (((addr) >> 22) & 0x1ff)
+#define PAGETABLE_PAIR_INDEX(addr)      (((addr) >> 13) & 0x1ff)
+
+/* Bits of an EntryLo register. */
+#define PAGETABLE_ENTRYLO_GLOBAL 0x00000001
+#define PAGETABLE_ENTRYLO_VALID  0x00000002
+#define PAGETABLE_ENTRYLO_DIRTY  0x00000004
+#define PAGETABLE_ENTRYLO_PFN_SHIFT 6
+
+/* Mappings of an even/odd page pair, in the format of the CP0
+   EntryLo0 and EntryLo1 registers. The refill handler copies them to
+   the TLB as they are. */
+typedef struct {
+    uint32_t entrylo0;
+    uint32_t entrylo1;
+} pagetable_pair_t;
 
 /* A pagetable. This structure fits on one physical page (4k). */
 typedef struct pagetable_struct_t{
     /* Address space identifier. We use Thread Ids in KUDOS. */
     uint32_t ASID;
-    /* Number of valid consecutive mappings in this pagetable. */
+    /* Number of pages mapped in this pagetable. */
     uint32_t valid_count;
-    /* Actual virtual memory mapping entries*/
-    tlb_entry_t entries[PAGETABLE_ENTRIES];
+    /* Second-level tables (kernel segment addresses), or NULL where
+       nothing is mapped. */
+    pagetable_pair_t *directory[PAGETABLE_DIRECTORY_ENTRIES];
 } pagetable_t;
 
 #endif // KUDOS_VM_MIPS32_PAGETABLE_H
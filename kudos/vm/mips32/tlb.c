@@ -6,6 +6,9 @@
 
 #include "kernel/panic.h"
 #include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
 #include <pagetable.h>
 #include <tlb.h>
 #include <types.h>
@@ -25,29 +28,163 @@ void tlb_store_exception(UNUSED bool in_userland)
   KERNEL_PANIC("Unhandled TLB store exception");
 }
 
+/* The pagetable used by the TLB refill handler in _tlb.S on each CPU,
+   or NULL when a kernel thread is running. */
+pagetable_t *tlb_pagetables[CONFIG_MAX_CPUS];
+
+/* Number of ASIDs, which are 8 bits wide. */
+#define TLB_ASIDS 256
+
+/* ASIDs whose entries must be removed from the TLB of each CPU before
+   the CPU next switches address spaces. The invalidate functions only
+   reach the TLB of the CPU they run on, but a thread may have run on
+   other CPUs too. An address space belongs to a single thread, so it
+   is never running on another CPU while it is being changed. */
+static uint32_t tlb_pending[CONFIG_MAX_CPUS][TLB_ASIDS / 32];
+static int tlb_pending_any[CONFIG_MAX_CPUS];
+static spinlock_t tlb_pending_slock;
+
+/* Overwrites TLB row index with an entry that can never match. Each
+   row gets its own VPN2 in the unmapped kernel segment, because
+   two matching rows would be an error. */
+static void tlb_clear_row(int index)
+{
+  tlb_entry_t entry;
+
+  memoryset(&entry, 0, sizeof(entry));
+  entry.VPN2 = (0x80000000 >> 13) + index;
+  _tlb_write(&entry, index, 1);
+}
+
+/* Marks asid to be removed from the TLBs of all CPUs but this one.
+   Must be called with interrupts disabled. */
+static void tlb_flush_others(uint32_t asid)
+{
+  int cpu, this_cpu = _interrupt_getcpu();
+
+  asid %= TLB_ASIDS;
+
+  spinlock_acquire(&tlb_pending_slock);
+  for(cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+    if(cpu != this_cpu) {
+      tlb_pending[cpu][asid / 32] |= 1u << (asid % 32);
+      tlb_pending_any[cpu] = 1;
+    }
+  }
+  spinlock_release(&tlb_pending_slock);
+}
+
+/* Removes the entries of the ASIDs marked for this CPU by
+   tlb_flush_others(). Must be called with interrupts disabled. */
+static void tlb_flush_pending(void)
+{
+  int this_cpu = _interrupt_getcpu();
+  tlb_entry_t entry;
+  uint32_t current_asid;
+  uint32_t i;
+
+  if(!tlb_pending_any[this_cpu])
+    return;
+
+  spinlock_acquire(&tlb_pending_slock);
+  current_asid = _tlb_get_asid();
+  for(i = 0; i <= _tlb_get_maxindex(); i++) {
+    _tlb_read(&entry, i, 1);
+    if(tlb_pending[this_cpu][entry.ASID / 32] & (1u << (entry.ASID % 32)))
+      tlb_clear_row(i);
+  }
+  memoryset(tlb_pending[this_cpu], 0, sizeof(tlb_pending[this_cpu]));
+  tlb_pending_any[this_cpu] = 0;
+  _tlb_set_asid(current_asid);
+  spinlock_release(&tlb_pending_slock);
+}
+
 /**
- * Fill TLB with given pagetable. This function is used to set memory
- * mappings in CP0's TLB before we have a proper TLB handling system.
- * This approach limits the maximum mapping size to 128kB.
+ * Switches the TLB to the address space of given pagetable. Only the
+ * ASID is changed; the TLB is filled from the pagetable on demand by
+ * the refill handler, and entries of other address spaces stay in the
+ * TLB until they are evicted. Entries invalidated on other CPUs are
+ * removed first. Must be called with interrupts disabled.
  *
- * @param pagetable Mappings to write to TLB.
+ * @param pagetable Mappings to use, or NULL for none (kernel threads).
  *
  */
 
-void tlb_fill(pagetable_t *pagetable)
+void tlb_set_pagetable(pagetable_t *pagetable)
 {
-  if(pagetable == NULL)
-    return;
-
-  /* Check that the pagetable can fit into TLB. This is needed until
-     we have proper VM system, because the whole pagetable must fit
-     into TLB. */
-  KERNEL_ASSERT(pagetable->valid_count <= (_tlb_get_maxindex()+1));
+  tlb_flush_pending();
 
-  _tlb_write(pagetable->entries, 0, pagetable->valid_count);
+  tlb_pagetables[_interrupt_getcpu()] = pagetable;
 
   /* Set ASID field in Co-Processor 0 to match thread ID so that
      only entries with the ASID of the current thread will match in
      the TLB hardware. */
-  _tlb_set_asid(pagetable->ASID);
+  if(pagetable != NULL)
+    _tlb_set_asid(pagetable->ASID);
+}
+
+/**
+ * Removes the TLB entry of the page pair containing vaddr in the
+ * address space asid, if there is one. This must be done whenever a
+ * mapping in the pagetable changes, since the refill handler only
+ * runs when the TLB has no entry. Other CPUs drop the entries of the
+ * address space when they next switch address spaces.
+ *
+ * @param asid The address space of the mapping.
+ *
+ * @param vaddr The virtual address whose entry is removed.
+ *
+ */
+
+void tlb_invalidate_page(uint32_t asid, virtaddr_t vaddr)
+{
+  interrupt_status_t intr_status;
+  tlb_entry_t entry;
+  uint32_t current_asid;
+  int index;
+
+  memoryset(&entry, 0, sizeof(entry));
+  entry.VPN2 = vaddr >> 13;
+  entry.ASID = asid;
+
+  /* Probing and writing the TLB change the ASID in EntryHi */
+  intr_status = _interrupt_disable();
+  current_asid = _tlb_get_asid();
+
+  index = _tlb_probe(&entry);
+  if(index >= 0)
+    tlb_clear_row(index);
+
+  _tlb_set_asid(current_asid);
+  tlb_flush_others(asid);
+  _interrupt_set_state(intr_status);
+}
+
+/**
+ * Removes all TLB entries of the address space asid. This must be
+ * done before an ASID is given to a new address space.
+ *
+ * @param asid The address space to remove.
+ *
+ */
+
+void tlb_invalidate_asid(uint32_t asid)
+{
+  interrupt_status_t intr_status;
+  tlb_entry_t entry;
+  uint32_t current_asid;
+  uint32_t i;
+
+  intr_status = _interrupt_disable();
+  current_asid = _tlb_get_asid();
+
+  for(i = 0; i <= _tlb_get_maxindex(); i++) {
+    _tlb_read(&entry, i, 1);
+    if(entry.ASID == asid)
+      tlb_clear_row(i);
+  }
+
+  _tlb_set_asid(current_asid);
+  tlb_flush_others(asid);
+  _interrupt_set_state(intr_status);
 }
@@ -67,11 +67,17 @@ void tlb_store_exception(bool in_userland);
 
 /* Forward declare pagetable_t (== struct pagetable_struct_t) */
 struct pagetable_struct_t;
-void tlb_fill(struct pagetable_struct_t *pagetable);
+void tlb_set_pagetable(struct pagetable_struct_t *pagetable);
+void tlb_invalidate_page(uint32_t asid, virtaddr_t vaddr);
+void tlb_invalidate_asid(uint32_t asid);
+
+/* Code to be inserted to the TLB refill vector */
+void _tlb_refill_vector_code(void);
 
 /* assembler function wrappers */
 void _tlb_get_exception_state(tlb_exception_state_t *state);
 void _tlb_set_asid(uint32_t asid);
+uint32_t _tlb_get_asid(void);
 uint32_t _tlb_get_maxindex(void);
 
 int _tlb_probe(tlb_entry_t *entry);
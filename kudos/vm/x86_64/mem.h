@@ -35,6 +35,42 @@ typedef struct memory_region
 } __attribute__((packed)) mem_region_t;
 
 void vmm_setcr3(uint64_t pdbr);
+uint64_t vmm_getcr3(void);
+uint64_t vmm_switch_cr3(uint64_t pml4);
 pagetable_t* vmm_get_kernel_pml4();
 
+/* 2 MiB page support */
+physaddr_t physmem_get_top(void);
+physaddr_t physmem_allochuge(void);
+void physmem_freehuge(physaddr_t ptr);
+
+/* Frames zeroed in the background by the idle thread */
+physaddr_t physmem_alloc_zeroed(void);
+void physmem_fill_zero_pool(void);
+
+/* Frame reference counts, for sharing frames between address spaces */
+void physmem_ref(physaddr_t ptr, uint32_t count);
+void physmem_unref(physaddr_t ptr, uint32_t count);
+uint32_t physmem_refcount(physaddr_t ptr);
+
+/* Number of frames that can still be allocated */
+uint64_t physmem_available(void);
+
+void vm_map_huge(pagetable_t *pml4, physaddr_t physaddr,
+                 virtaddr_t vaddr, int flags);
+int vm_is_huge_mapping(pagetable_t *pml4, virtaddr_t vaddr);
+void vm_split_huge(pagetable_t *pml4, virtaddr_t vaddr);
+
+/* Copy-on-write sharing of user mappings */
+void vm_share_range(pagetable_t *src, pagetable_t *dst,
+                    virtaddr_t start, uint64_t size);
+
+/* Swapping of user pages (see proc/swap.c) */
+virtaddr_t vm_find_page(pagetable_t *pml4, virtaddr_t start,
+                        virtaddr_t end, int swapped);
+int vm_clear_accessed(pagetable_t *pml4, virtaddr_t vaddr);
+physaddr_t vm_swap_out(pagetable_t *pml4, virtaddr_t vaddr, uint64_t slot);
+void vm_set_swapped(pagetable_t *pml4, virtaddr_t vaddr, uint64_t slot);
+uint64_t vm_get_swapped(pagetable_t *pml4, virtaddr_t vaddr);
+
 #endif // KUDOS_VM_X86_64_MEM_H
@@ -13,6 +13,8 @@
 
 /* PMM Defines */
 #define PMM_BLOCKS_PER_BYTE 0x8
+#define PMM_BLOCKS_PER_HUGE (PAGE_HUGE_SIZE / PMM_BLOCK_SIZE)
+#define PMM_ZERO_POOL_SIZE 64
 
 /* Memory Map */
 uint64_t *_mem_bitmap;
@@ -23,20 +25,29 @@ uint64_t used_blocks;
 uint64_t highest_page;
 spinlock_t *physmem_lock;
 
+/* Number of mappings of each frame. Frames are allocated with a count
+ * of one; copy-on-write sharing adds references. */
+uint16_t *_mem_refcount;
+
+/* Frames zeroed ahead of time by the idle thread. They are allocated
+ * (with a count of one) while they sit in the pool. */
+static physaddr_t zero_pool[PMM_ZERO_POOL_SIZE];
+static volatile int zero_pool_count;
+
 /* Memory Bitmap Helpers */
 void memmap_setbit(int64_t bit)
 {
-  _mem_bitmap[bit / 64] |= (1 << (bit % 64));
+  _mem_bitmap[bit / 64] |= (1ULL << (bit % 64));
 }
 
 void memmap_unsetbit(int64_t bit)
 {
-  _mem_bitmap[bit / 64] &= ~(1 << (bit % 64));
+  _mem_bitmap[bit / 64] &= ~(1ULL << (bit % 64));
 }
 
 int64_t memmap_testbit(int64_t bit)
 {
-  return _mem_bitmap[bit / 64] & (1 << (bit % 64));
+  return (_mem_bitmap[bit / 64] & (1ULL << (bit % 64))) != 0;
 }
 
 void physmem_freeregion(uint64_t start_address, uint64_t length)
@@ -45,8 +56,9 @@ void physmem_freeregion(uint64_t start_address, uint64_t length)
   int64_t Blocks = (int64_t)(length / PMM_BLOCK_SIZE);
   int64_t i = (int64_t)start_address;
 
-  /* Free Blocks */
-  for(; Blocks > 0; Blocks--, i += PMM_BLOCK_SIZE)
+  /* Free Blocks, ignoring anything beyond the bitmap */
+  for(; Blocks > 0 && (uint64_t)Align < total_blocks;
+      Blocks--, i += PMM_BLOCK_SIZE)
     {
       /* Free it */
       memmap_unsetbit(Align++);
@@ -66,13 +78,13 @@ int64_t physmem_getframe()
   uint64_t i, j;
 
   /* Loop through bitmap */
-  for(i = 0; i < total_blocks; i++)
+  for(i = 0; i < total_blocks / 64; i++)
     {
       if(_mem_bitmap[i] != 0xFFFFFFFFFFFFFFFF)
         {
           for(j = 0; j < 64; j++)
             {
-              int64_t bit = 1 << j;
+              uint64_t bit = 1ULL << j;
 
               if(!(_mem_bitmap[i] & bit))
                 return (int64_t)(i * 8 * 8 + j);
@@ -96,13 +108,13 @@ int64_t physmem_getframes(int64_t count)
     return physmem_getframe();
 
   /* Loop through bitmap */
-  for(i = 0; i < total_blocks; i++)
+  for(i = 0; i < total_blocks / 64; i++)
     {
       if(_mem_bitmap[i] != 0xFFFFFFFFFFFFFFFF)
         {
           for(j = 0; j < 64; j++)
             {
-              int64_t bit = 1 << j;
+              uint64_t bit = 1ULL << j;
               if(!(_mem_bitmap[i] & bit))
                 {
                   int64_t starting_bit = i * 64;
@@ -110,11 +122,13 @@ int64_t physmem_getframes(int64_t count)
                   starting_bit += j;
 
                   /* Get the free bit in qword at index i */
-                  for(k = 0; k < count; k++)
+                  for(k = 0; k < (uint64_t)count; k++)
                     {
-                      /* Test if it is free */
-                      if(memmap_testbit(starting_bit + k) == 0)
-                        free++;
+                      /* The run must be contiguous and inside the map */
+                      if(starting_bit + k >= total_blocks ||
+                         memmap_testbit(starting_bit + k))
+                        break;
+                      free++;
 
                       /* Did we have enough free blocks? */
                       if(free == count)
@@ -139,15 +153,21 @@ void physmem_init(void *boot_info)
   highest_page = 0;
   memory_size = mb_info->memory_high;
   memory_size += mb_info->memory_low;
-  total_blocks = (memory_size * 1024) / PAGE_SIZE;
+
+  /* memory_high counts from 1 MB, so the top of RAM is a bit above
+   * memory_size. Round the bitmap up to a whole number of qwords. */
+  total_blocks = ((mb_info->memory_high + 1024) * 1024) / PAGE_SIZE;
+  total_blocks = (total_blocks + 63) & ~63ULL;
   used_blocks = total_blocks;
   bitmap_size = total_blocks / PMM_BLOCKS_PER_BYTE;
   _mem_bitmap = (uint64_t*)stalloc(bitmap_size);
   physmem_lock = (spinlock_t*)stalloc(sizeof(spinlock_t));
   spinlock_reset(physmem_lock);
+  _mem_refcount = (uint16_t*)stalloc(total_blocks * sizeof(uint16_t));
+  memoryset(_mem_refcount, 0, total_blocks * sizeof(uint16_t));
 
   /* Set all memory as used, and use memory map to set free */
-  memoryset(_mem_bitmap, 0xF, bitmap_size);
+  memoryset(_mem_bitmap, (char)0xFF, bitmap_size);
 
   /* Physical Page Bitmap */
   kprintf("Memory size: %u Kb\n", (uint32_t)memory_size);
@@ -192,7 +212,7 @@ physaddr_t physmem_allocblock()
   spinlock_acquire(physmem_lock);
 
   /* Sanity */
-  if(used_blocks >= total_blocks)
+  if(used_blocks >= total_blocks && zero_pool_count == 0)
     {
       /* PANIC AT THE DISCO ! */
       KERNEL_PANIC("Physical Manager >> OUT OF MEMORY");
@@ -201,6 +221,15 @@ physaddr_t physmem_allocblock()
   /* Get a frame */
   int64_t frame = physmem_getframe();
 
+  /* Memory is tight, give back a pre-zeroed frame */
+  if(frame == -1 && zero_pool_count > 0)
+    {
+      addr = zero_pool[--zero_pool_count];
+      spinlock_release(physmem_lock);
+      _interrupt_set_state(intr_status);
+      return addr;
+    }
+
   if(frame == -1)
     {
       /* PANIC AT THE DISCO ! */
@@ -210,6 +239,8 @@ physaddr_t physmem_allocblock()
 
   /* Mark it used */
   memmap_setbit(frame);
+  _mem_refcount[frame] = 1;
+  used_blocks++;
 
   /* Release spinlock */
   spinlock_release(physmem_lock);
@@ -217,7 +248,6 @@ physaddr_t physmem_allocblock()
 
   /* Calculate Address */
   addr = (physaddr_t)(frame * PMM_BLOCK_SIZE);
-  used_blocks++;
 
   return addr;
 }
@@ -234,13 +264,12 @@ void physmem_freeblock(void *ptr)
 
   /* Free */
   memmap_unsetbit(frame);
+  _mem_refcount[frame] = 0;
+  used_blocks--;
 
   /* Release spinlock */
   spinlock_release(physmem_lock);
   _interrupt_set_state(intr_status);
-
-  /* Stats */
-  used_blocks--;
 }
 
 physaddr_t physmem_allocblocks(uint32_t count)
@@ -269,7 +298,11 @@ physaddr_t physmem_allocblocks(uint32_t count)
 
   /* Mark it used */
   for(i = 0; i < count; i++)
-    memmap_setbit(frame + i);
+    {
+      memmap_setbit(frame + i);
+      _mem_refcount[frame + i] = 1;
+    }
+  used_blocks += count;
 
   /* Release spinlock */
   spinlock_release(physmem_lock);
@@ -277,7 +310,6 @@ physaddr_t physmem_allocblocks(uint32_t count)
 
   /* Calculate Address */
   addr = (uint64_t)(frame * PMM_BLOCK_SIZE);
-  used_blocks += count;
 
   return addr;
 }
@@ -294,12 +326,250 @@ void physmem_freeblocks(void *ptr, uint32_t size)
 
   /* Free */
   for(i = 0; i < size; i++)
-    memmap_unsetbit(frame + i);
+    {
+      memmap_unsetbit(frame + i);
+      _mem_refcount[frame + i] = 0;
+    }
+  used_blocks -= size;
 
   /* Release spinlock */
   spinlock_release(physmem_lock);
   _interrupt_set_state(intr_status);
+}
 
-  /* Stats */
-  used_blocks -= size;
+/**
+ * Allocates a page frame filled with zeroes. A frame from the pool
+ * zeroed by the idle thread is used if there is one, otherwise the
+ * frame is zeroed here.
+ *
+ * @return The physical address of the frame.
+ */
+physaddr_t physmem_alloc_zeroed(void)
+{
+  physaddr_t addr = 0;
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(physmem_lock);
+
+  if(zero_pool_count > 0)
+    addr = zero_pool[--zero_pool_count];
+
+  spinlock_release(physmem_lock);
+  _interrupt_set_state(intr_status);
+
+  if(addr == 0)
+    {
+      addr = physmem_allocblock();
+      memoryset((void*)ADDR_PHYS_TO_KERNEL(addr), 0, PMM_BLOCK_SIZE);
+    }
+
+  return addr;
+}
+
+/**
+ * Zeroes free frames into the pool used by physmem_alloc_zeroed(),
+ * until the pool is full. Called by the idle thread with interrupts
+ * enabled, so the zeroing is preempted as soon as there is real work.
+ * Frames are only taken while plenty of memory is free.
+ */
+void physmem_fill_zero_pool(void)
+{
+  physaddr_t addr;
+  interrupt_status_t intr_status;
+
+  /* Only the idle thread adds to the pool, so the count can only
+   * shrink under us */
+  while(zero_pool_count < PMM_ZERO_POOL_SIZE)
+    {
+      if(used_blocks + 2 * PMM_ZERO_POOL_SIZE >= total_blocks)
+        return;
+
+      addr = physmem_allocblock();
+      memoryset((void*)ADDR_PHYS_TO_KERNEL(addr), 0, PMM_BLOCK_SIZE);
+
+      intr_status = _interrupt_disable();
+      spinlock_acquire(physmem_lock);
+      zero_pool[zero_pool_count++] = addr;
+      spinlock_release(physmem_lock);
+      _interrupt_set_state(intr_status);
+    }
+}
+
+/**
+ * Returns the physical address just above the highest usable page
+ * frame. Everything below it is identity mapped by vm_init().
+ */
+physaddr_t physmem_get_top(void)
+{
+  return highest_page + PMM_BLOCK_SIZE;
+}
+
+/**
+ * Allocates a naturally aligned run of page frames which can back a
+ * single 2 MiB page. Unlike physmem_allocblock() this does not panic
+ * when memory is tight; the caller is expected to fall back to 4 KiB
+ * pages.
+ *
+ * @return The physical address of the run, or 0 if no aligned run of
+ * free frames exists.
+ */
+physaddr_t physmem_allochuge(void)
+{
+  uint64_t i, j;
+  physaddr_t addr = 0;
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(physmem_lock);
+
+  /* A 2 MiB run is PMM_BLOCKS_PER_HUGE / 64 whole qwords of the bitmap,
+   * so whole-qword tests are enough. */
+  for(i = 0; i + PMM_BLOCKS_PER_HUGE / 64 <= total_blocks / 64;
+      i += PMM_BLOCKS_PER_HUGE / 64)
+    {
+      for(j = 0; j < PMM_BLOCKS_PER_HUGE / 64; j++)
+        if(_mem_bitmap[i + j] != 0)
+          break;
+
+      if(j == PMM_BLOCKS_PER_HUGE / 64)
+        {
+          for(j = 0; j < PMM_BLOCKS_PER_HUGE / 64; j++)
+            _mem_bitmap[i + j] = 0xFFFFFFFFFFFFFFFF;
+
+          for(j = 0; j < PMM_BLOCKS_PER_HUGE; j++)
+            _mem_refcount[i * 64 + j] = 1;
+
+          used_blocks += PMM_BLOCKS_PER_HUGE;
+          addr = (physaddr_t)(i * 64 * PMM_BLOCK_SIZE);
+          break;
+        }
+    }
+
+  spinlock_release(physmem_lock);
+  _interrupt_set_state(intr_status);
+
+  return addr;
+}
+
+/**
+ * Frees a run of page frames allocated with physmem_allochuge().
+ *
+ * @param ptr The physical address of the run.
+ */
+void physmem_freehuge(physaddr_t ptr)
+{
+  physmem_freeblocks((void*)ptr, PMM_BLOCKS_PER_HUGE);
+}
+
+/**
+ * Adds a reference to each frame in a run of allocated frames, so
+ * that it can be mapped into one more address space.
+ *
+ * @param ptr Physical address of the first frame.
+ *
+ * @param count Number of frames.
+ */
+void physmem_ref(physaddr_t ptr, uint32_t count)
+{
+  uint64_t frame = ptr / PMM_BLOCK_SIZE, i;
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(physmem_lock);
+
+  for(i = 0; i < count; i++)
+    {
+      if(_mem_refcount[frame + i] == 0xFFFF)
+        KERNEL_PANIC("Physical Manager >> Too many references");
+      _mem_refcount[frame + i]++;
+    }
+
+  spinlock_release(physmem_lock);
+  _interrupt_set_state(intr_status);
+}
+
+/**
+ * Drops a reference to each frame in a run of frames. Frames that are
+ * no longer referenced are freed.
+ *
+ * @param ptr Physical address of the first frame.
+ *
+ * @param count Number of frames.
+ */
+void physmem_unref(physaddr_t ptr, uint32_t count)
+{
+  uint64_t frame = ptr / PMM_BLOCK_SIZE, i;
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(physmem_lock);
+
+  for(i = 0; i < count; i++)
+    {
+      if(_mem_refcount[frame + i] == 0)
+        KERNEL_PANIC("Physical Manager >> Unreferencing a free frame");
+
+      if(--_mem_refcount[frame + i] == 0)
+        {
+          memmap_unsetbit(frame + i);
+          used_blocks--;
+        }
+    }
+
+  spinlock_release(physmem_lock);
+  _interrupt_set_state(intr_status);
+}
+
+/**
+ * Returns the number of references to a frame (0 if it is free).
+ */
+uint32_t physmem_refcount(physaddr_t ptr)
+{
+  return _mem_refcount[ptr / PMM_BLOCK_SIZE];
+}
+
+/**
+ * Returns the number of page frames that can still be allocated,
+ * counting the frames in the pool of zeroed frames.
+ */
+uint64_t physmem_available(void)
+{
+  uint64_t available;
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(physmem_lock);
+
+  available = total_blocks - used_blocks + zero_pool_count;
+
+  spinlock_release(physmem_lock);
+  _interrupt_set_state(intr_status);
+
+  return available;
+}
+
+/**
+ * Fills in the page frame statistics of info.
+ *
+ * @param info The statistics to fill in.
+ */
+void physmem_meminfo(meminfo_t *info)
+{
+  uint64_t i, run = 0, longest = 0, shared = 0;
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(physmem_lock);
+
+  for(i = 0; i < total_blocks; i++)
+    {
+      if(memmap_testbit(i))
+        {
+          run = 0;
+          if(_mem_refcount[i] > 1)
+            shared++;
+        }
+      else if(++run > longest)
+        longest = run;
+    }
+
+  info->page_size = PMM_BLOCK_SIZE;
+  info->total_frames = total_blocks;
+  info->used_frames = used_blocks - zero_pool_count;
+  info->free_frames = total_blocks - used_blocks + zero_pool_count;
+  info->zeroed_frames = zero_pool_count;
+  info->shared_frames = shared;
+  info->largest_free_run = longest;
+
+  spinlock_release(physmem_lock);
+  _interrupt_set_state(intr_status);
 }
@@ -2,6 +2,7 @@
  * Virtual Memory Manager for KUDOS
  */
 
+#include <arch.h>
 #include "vm/memory.h"
 #include "lib/libc.h"
 #include "kernel/panic.h"
@@ -25,17 +26,17 @@
 //Page mask
 #define VMM_PAGE_MASK 0xFFFFFFFFFFFFF000
 
-//Heap
-#define MM_HEAP_LOCATION 0x10000000
-#define MM_HEAP_END 0x20000000
+//Process-context identifiers
+#define VMM_CPUID_PCID     (1 << 17)   //CPUID.1:ECX
+#define VMM_CPUID_INVPCID  (1 << 10)   //CPUID.7:EBX
+#define VMM_CR4_PCIDE      (1 << 17)
+#define VMM_CR3_NOFLUSH    (1ULL << 63)
+#define VMM_PCID_MASK      0xFFF
 
 /* Extern variables */
 extern uint64_t KERNEL_ENDS_HERE;   //physical address of kernel end
 extern physaddr_t stalloced_total;  //Total bytes stalloced
 
-/* The virtual address for the next stalloc allocation */
-virtaddr_t kmalloc_addr;
-
 /* Page table space of 4mb*/
 pagetable_t pt_pool[VM_PTP_SIZE] __attribute__ ((aligned (4096)));
 /* Bitmap of free page tables */
@@ -46,20 +47,27 @@ uint64_t pt_bitmap[VM_PTP_SIZE/64];
 static pagetable_t *kernel_pml4;
 static spinlock_t vm_lock;
 
+/* Frames handed out by kmalloc */
+static uint64_t vmm_kmalloc_frames;
+
+/* Whether CR4.PCIDE is set, and whether INVPCID can be used */
+static int vmm_pcid_enabled;
+static int vmm_invpcid_supported;
+
 /* Page table Bitmap Helpers */
 void ptmap_setbit(int64_t bit)
 {
-  pt_bitmap[bit / 64] |= (1 << (bit % 64));
+  pt_bitmap[bit / 64] |= (1ULL << (bit % 64));
 }
 
 void ptmap_unsetbit(int64_t bit)
 {
-  pt_bitmap[bit / 64] &= ~(1 << (bit % 64));
+  pt_bitmap[bit / 64] &= ~(1ULL << (bit % 64));
 }
 
 int64_t ptmap_testbit(int64_t bit)
 {
-  return pt_bitmap[bit / 64] & (1 << (bit % 64));
+  return (pt_bitmap[bit / 64] & (1ULL << (bit % 64))) != 0;
 }
 
 /* Helpers */
@@ -110,23 +118,138 @@ void vmm_install_ptable(pagetable_t *target, uint64_t pt_index,
     target->pages[pt_index] = entry;
 }
 
-void __attribute((noinline)) vmm_reloadcr3()
+void vmm_invalidatepage(uint64_t virtual_addr)
+{
+  asm volatile("invlpg (%%rax)" : : "a"(virtual_addr));
+}
+
+uint64_t vmm_getcr3(void)
+{
+  uint64_t cr3;
+  asm volatile("mov %%cr3, %0" : "=r"(cr3));
+  return cr3;
+}
+
+/* The PCID of an address space is the index of its PML4 in the page
+ * table pool. The kernel PML4 is the first table allocated, so the
+ * kernel runs with PCID 0, and an index is never used by two live
+ * address spaces. */
+static uint64_t vmm_pcid(uint64_t pml4)
 {
-  /* Repoint CR3 */
-  asm volatile("mov %cr3, %rax\n\t"
-               "mov %rax, %cr3");
+  return ((pagetable_t*)(pml4 & PAGE_MASK) - pt_pool) & VMM_PCID_MASK;
+}
+
+/* Returns the value to load into CR3 to switch to pml4. With PCIDs the
+ * TLB entries of the address space are kept on the switch. */
+static uint64_t vmm_cr3_value(uint64_t pml4)
+{
+  pml4 &= PAGE_MASK & ~VMM_CR3_NOFLUSH;
+  if(!vmm_pcid_enabled)
+    return pml4;
+
+  return pml4 | vmm_pcid(pml4) | VMM_CR3_NOFLUSH;
 }
 
 void vmm_setcr3(uint64_t pdbr)
 {
   /* Set CR3 register to the new pdbr
    * it is physical address of pml4 */
-  asm volatile("mov %%rax, %%cr3" : : "a"(pdbr));
+  asm volatile("mov %%rax, %%cr3" : : "a"(vmm_cr3_value(pdbr)));
 }
 
-void vmm_invalidatepage(uint64_t virtual_addr)
+/**
+ * Returns the value that a context switch should load into CR3 to run
+ * in the address space pml4, or 0 if it is already loaded and CR3
+ * should be left alone.
+ *
+ * @param pml4 The page table of the thread being switched to.
+ */
+uint64_t vmm_switch_cr3(uint64_t pml4)
 {
-  asm volatile("invlpg (%%rax)" : : "a"(virtual_addr));
+  if((vmm_getcr3() & PAGE_MASK) == (pml4 & PAGE_MASK))
+    return 0;
+
+  return vmm_cr3_value(pml4);
+}
+
+static void vmm_cpuid(uint32_t leaf, uint32_t *ebx, uint32_t *ecx)
+{
+  uint32_t eax = leaf, edx;
+  asm volatile("cpuid"
+               : "+a"(eax), "=b"(*ebx), "=c"(*ecx), "=d"(edx)
+               : "c"(0));
+}
+
+/* Turns on process-context identifiers if the CPU has them. CR3 must
+ * hold the kernel PML4, which has PCID 0, when this is called. */
+static void vmm_enable_pcid(void)
+{
+  uint32_t ebx, ecx;
+
+  vmm_cpuid(1, &ebx, &ecx);
+  if(!(ecx & VMM_CPUID_PCID))
+    return;
+
+  vmm_cpuid(7, &ebx, &ecx);
+  vmm_invpcid_supported = (ebx & VMM_CPUID_INVPCID) != 0;
+
+  asm volatile("mov %%cr4, %%rax\n\t"
+               "or %0, %%rax\n\t"
+               "mov %%rax, %%cr4" : : "i"(VMM_CR4_PCIDE) : "rax");
+  vmm_pcid_enabled = 1;
+}
+
+/* Drops every non-global TLB entry tagged with the PCID of pml4. */
+static void vmm_flush_pcid(pagetable_t *pml4)
+{
+  struct {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc;
+  uint64_t cr3;
+
+  if(!vmm_pcid_enabled)
+    return;
+
+  if(vmm_invpcid_supported)
+    {
+      /* Type 1: single-context invalidation */
+      desc.pcid = vmm_pcid((uint64_t)pml4);
+      desc.addr = 0;
+      asm volatile("invpcid %0, %1" : : "m"(desc), "r"(1ULL) : "memory");
+      return;
+    }
+
+  /* Loading CR3 without the no-flush bit flushes the PCID loaded.
+   * pml4 only shares the kernel half with the current address space,
+   * and system calls run on the user stack, so nothing but registers
+   * may be touched before switching back: both loads are done in one
+   * asm statement. */
+  interrupt_status_t intr_status = _interrupt_disable();
+  cr3 = vmm_getcr3();
+  asm volatile("mov %0, %%cr3\n\t"
+               "mov %1, %%cr3"
+               : : "r"((uint64_t)pml4 | vmm_pcid((uint64_t)pml4)),
+                   "r"(cr3 | VMM_CR3_NOFLUSH)
+               : "memory");
+  _interrupt_set_state(intr_status);
+}
+
+/* Invalidates the TLB entry for vaddr in the address space pml4. */
+static void vmm_invalidate(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  if((vmm_getcr3() & PAGE_MASK) == (uint64_t)pml4)
+    vmm_invalidatepage(vaddr);
+  else
+    vmm_flush_pcid(pml4);
+}
+
+void vmm_enable_write_protect(void)
+{
+  /* CR0.WP makes read-only pages fault on supervisor writes */
+  asm volatile("mov %%cr0, %%rax\n\t"
+               "or $0x10000, %%rax\n\t"
+               "mov %%rax, %%cr0" : : : "rax");
 }
 
 pagetable_t* vmm_getptable(pagetable_t *pdir, virtaddr_t vaddr)
@@ -135,7 +258,8 @@ pagetable_t* vmm_getptable(pagetable_t *pdir, virtaddr_t vaddr)
   uint64_t pindex = VMM_INDEX_PDIR(vaddr);
   uint64_t ptr = pdir->pages[pindex];
 
-  if(ptr & PAGE_PRESENT)
+  /* A 2 MiB page has no page table below it */
+  if((ptr & PAGE_PRESENT) && !(ptr & PAGE_2MB))
     return (pagetable_t*)(ptr & PAGE_MASK);
   else
     return 0;
@@ -166,20 +290,22 @@ pagetable_t* vmm_getpdp(pagetable_t *pml4, virtaddr_t vaddr)
 }
 
 void vm_init(void){
-  uint64_t i, phys, virt;
-  physaddr_t indentity_bound;
+  physaddr_t phys;
+  physaddr_t identity_bound;
   pagetable_t *pml4;
   spinlock_reset(&vm_lock);
 
-  /* The boundary for the indentity mapping */
-  indentity_bound = ((physaddr_t)&KERNEL_ENDS_HERE)+stalloced_total;
-
-  if (indentity_bound % PMM_BLOCK_SIZE > 0) {
-    indentity_bound += PMM_BLOCK_SIZE - indentity_bound % PMM_BLOCK_SIZE;
+  /* Identity map all of physical memory, so that the kernel can
+   * reach every page frame (and kmalloc can hand out frames as they
+   * are). This always covers the kernel and the stalloc area. */
+  identity_bound = ((physaddr_t)&KERNEL_ENDS_HERE)+stalloced_total;
+  if (physmem_get_top() > identity_bound) {
+    identity_bound = physmem_get_top();
   }
 
-  /* initialize kmalloc allocation address */
-  kmalloc_addr = indentity_bound;
+  if (identity_bound % PAGE_HUGE_SIZE > 0) {
+    identity_bound += PAGE_HUGE_SIZE - identity_bound % PAGE_HUGE_SIZE;
+  }
 
   /* Clear page table bitmap */
   for(uint64_t i = 0; i < VM_PTP_SIZE; i++)
@@ -189,52 +315,56 @@ void vm_init(void){
   pml4 = vmm_new_pagetable();
   vmm_cleartable(pml4);
 
- /* Identity map from page 1 to KERNEL_ENDS_HERE */
-  for(i = 1, phys = virt = 0x1000; phys < indentity_bound;
-      i++, phys = virt += 0x1000)
+  /* The first 2 MiB use 4 KiB pages so that page 0 stays unmapped
+   * and NULL dereferences fault */
+  for(phys = PAGE_SIZE; phys < PAGE_HUGE_SIZE; phys += PAGE_SIZE)
+  {
+    vm_map(pml4, phys, phys, PAGE_WRITE | PAGE_CPU_GLOBAL);
+  }
+
+  /* Everything above that is mapped with 2 MiB pages, which needs
+   * one page directory per GiB instead of 512 page tables */
+  for(phys = PAGE_HUGE_SIZE; phys < identity_bound; phys += PAGE_HUGE_SIZE)
   {
-    vm_map(pml4, phys, virt, 0);
+    vm_map_huge(pml4, phys, phys, PAGE_WRITE | PAGE_CPU_GLOBAL);
   }
 
   kernel_pml4 = pml4;
   vmm_setcr3((uint64_t) pml4);
+
+  /* Honour read-only pages in ring 0 as well, which is where the
+   * kernel and user processes run */
+  vmm_enable_write_protect();
+
+  /* Tag TLB entries with the address space, so that switching between
+   * processes does not flush the TLB. The kernel half is the same in
+   * every address space and is mapped global instead. */
+  vmm_enable_pcid();
 }
 
 void* kmalloc(uint64_t size){
   physaddr_t frames;
-  virtaddr_t ret_addr;
-  uint64_t n_frames, i;
-  if(size+kmalloc_addr > VMM_KERNEL_SPACE)
-    KERNEL_PANIC("kmalloc: Out of virtual address space");
-
-  ret_addr = kmalloc_addr;
+  uint64_t n_frames;
 
   n_frames = size/PMM_BLOCK_SIZE;
   if(size%PMM_BLOCK_SIZE)
     n_frames++;
 
-  frames = physmem_getframes(n_frames);
-  for(i = 0; i < n_frames; i++){
-    vm_map(kernel_pml4, frames+(i*PMM_BLOCK_SIZE),
-        kmalloc_addr+(0x1000*i), 0);
-  }
-
-  kmalloc_addr += 0x1000*i;
+  /* All of physical memory is identity mapped, so the frames can be
+   * used directly */
+  frames = physmem_allocblocks(n_frames);
+  vmm_kmalloc_frames += n_frames;
 
-  return ret_addr;
+  return (void*)ADDR_PHYS_TO_KERNEL(frames);
 }
 
-void vm_map(pagetable_t *pml4,
-            physaddr_t physaddr, virtaddr_t vaddr, int flags)
+/* Returns the page directory covering vaddr, allocating the upper
+ * levels as needed. Must be called with vm_lock held. */
+static pagetable_t *vmm_walk_pdir(pagetable_t *pml4,
+                                  virtaddr_t vaddr, int flags)
 {
-  /* Get current paging structure */
   pagetable_t *pdp;
   pagetable_t *pdir;
-  pagetable_t *pt;
-
-  /* Get a lock & disable ints */
-  interrupt_status_t intr_status = _interrupt_disable();
-  spinlock_acquire(&vm_lock);
 
   /* Get appropriate pdp */
   pdp = vmm_getpdp(pml4, vaddr);
@@ -263,6 +393,22 @@ void vm_map(pagetable_t *pml4,
         (physaddr_t)pdir, PAGE_PRESENT | PAGE_WRITE | flags);
   }
 
+  return pdir;
+}
+
+/* Like vmm_walk_pdir(), but walks all the way down to the page
+ * table mapping vaddr. */
+static pagetable_t *vmm_walk_ptable(pagetable_t *pml4,
+                                    virtaddr_t vaddr, int flags)
+{
+  pagetable_t *pdir;
+  pagetable_t *pt;
+
+  pdir = vmm_walk_pdir(pml4, vaddr, flags);
+
+  if(pdir->pages[VMM_INDEX_PDIR(vaddr)] & PAGE_2MB)
+    KERNEL_PANIC("vm_map: Address is covered by a 2 MiB page");
+
   /* Get appropriate page directory */
   pt = vmm_getptable(pdir, vaddr);
   if(pt == 0)
@@ -276,46 +422,500 @@ void vm_map(pagetable_t *pml4,
         (physaddr_t)pt, PAGE_PRESENT | PAGE_WRITE | flags);
   }
 
+  return pt;
+}
+
+void vm_map(pagetable_t *pml4,
+            physaddr_t physaddr, virtaddr_t vaddr, int flags)
+{
+  /* Get current paging structure */
+  pagetable_t *pt;
+  page_t old;
+
+  /* Get a lock & disable ints */
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  pt = vmm_walk_ptable(pml4, vaddr, flags);
+
   /* NOW, FINALLY, Get the appropriate page */
-  pt->pages[VMM_INDEX_PTABLE(vaddr)] = physaddr |
-    PAGE_PRESENT | PAGE_WRITE | flags;
+  old = pt->pages[VMM_INDEX_PTABLE(vaddr)];
+  pt->pages[VMM_INDEX_PTABLE(vaddr)] = physaddr | PAGE_PRESENT | flags;
 
   /* Done, release lock */
   spinlock_release(&vm_lock);
   _interrupt_set_state(intr_status);
 
-  /* Invalidate page in TLB cache */
-  vmm_invalidatepage(vaddr);
-  vmm_reloadcr3();
+  /* Invalidate page in TLB cache. Non-present entries are never
+   * cached, so a fresh mapping needs no flush. */
+  if(old & PAGE_PRESENT)
+    vmm_invalidate(pml4, vaddr);
+}
+
+/**
+ * Maps a 2 MiB page. Both addresses must be 2 MiB aligned, and the
+ * range must not already be mapped with 4 KiB pages.
+ *
+ * @param pml4 The page table to map into.
+ *
+ * @param physaddr Physical start of the page (see physmem_allochuge()).
+ *
+ * @param vaddr Virtual start of the page.
+ *
+ * @param flags Page attributes, as for vm_map().
+ */
+void vm_map_huge(pagetable_t *pml4,
+                 physaddr_t physaddr, virtaddr_t vaddr, int flags)
+{
+  pagetable_t *pdir;
+  page_t *entry;
+  page_t old;
+
+  if((physaddr | vaddr) & ~PAGE_HUGE_MASK)
+    KERNEL_PANIC("vm_map_huge: Unaligned address");
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  pdir = vmm_walk_pdir(pml4, vaddr, flags);
+  entry = &pdir->pages[VMM_INDEX_PDIR(vaddr)];
+
+  if((*entry & PAGE_PRESENT) && !(*entry & PAGE_2MB))
+    KERNEL_PANIC("vm_map_huge: Address is mapped with 4 KiB pages");
+
+  old = *entry;
+  *entry = physaddr | PAGE_PRESENT | PAGE_2MB | flags;
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+
+  if(old & PAGE_PRESENT)
+    vmm_invalidate(pml4, vaddr);
+}
+
+/* Returns the entry mapping vaddr: the page directory entry for a
+ * 2 MiB page, otherwise the page table entry. NULL if no entry exists
+ * (the entry returned may still be non-present). */
+static page_t *vmm_getentry(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  pagetable_t *pdp;
+  pagetable_t *pdir;
+  pagetable_t *pt;
+  page_t *entry;
+
+  pdp = vmm_getpdp(pml4, vaddr);
+  if(pdp == 0)
+    return 0;
+
+  pdir = vmm_getpdir(pdp, vaddr);
+  if(pdir == 0)
+    return 0;
+
+  entry = &pdir->pages[VMM_INDEX_PDIR(vaddr)];
+  if((*entry & PAGE_PRESENT) && (*entry & PAGE_2MB))
+    return entry;
+
+  pt = vmm_getptable(pdir, vaddr);
+  if(pt == 0)
+    return 0;
+
+  return &pt->pages[VMM_INDEX_PTABLE(vaddr)];
+}
+
+/**
+ * Looks up the physical page that the given virtual address is mapped
+ * to, whether through a 4 KiB or a 2 MiB page.
+ *
+ * @param pml4 The page table to search.
+ *
+ * @param vaddr The virtual address.
+ *
+ * @return The physical address of the 4 KiB page containing vaddr,
+ * or 0 if vaddr is not mapped.
+ */
+physaddr_t vm_getmap(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  page_t *entry = vmm_getentry(pml4, vaddr);
+
+  if(entry == 0 || !(*entry & PAGE_PRESENT))
+    return 0;
+
+  if(*entry & PAGE_2MB)
+    return (*entry & PAGE_HUGE_MASK) + (vaddr & ~PAGE_HUGE_MASK & PAGE_MASK);
+
+  return *entry & PAGE_MASK;
+}
+
+/**
+ * Returns non-zero if vaddr is mapped by a 2 MiB page.
+ */
+int vm_is_huge_mapping(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  page_t *entry = vmm_getentry(pml4, vaddr);
+
+  return entry != 0 && (*entry & PAGE_PRESENT) && (*entry & PAGE_2MB);
 }
 
-void vm_unmap(pagetable_t *pagetable, virtaddr_t vaddr)
+/**
+ * Sets whether the given virtual page can be written. The page must
+ * already be mapped. For a 2 MiB mapping the whole page is changed.
+ *
+ * @param pml4 The page table where the mapping resides.
+ *
+ * @param vaddr The virtual address whose mapping is changed.
+ *
+ * @param dirty 1 to make the page writable, 0 to make it read-only.
+ */
+void vm_set_dirty(pagetable_t *pml4, virtaddr_t vaddr, int dirty)
 {
-  /* Unimplemented */
-  vaddr = vaddr;
+  page_t *entry = vmm_getentry(pml4, vaddr);
+
+  if(entry == 0 || !(*entry & PAGE_PRESENT))
+    KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+
+  if(dirty)
+    *entry |= PAGE_WRITE;
+  else
+    *entry &= ~PAGE_WRITE;
+
+  vmm_invalidate(pml4, vaddr);
+}
+
+/**
+ * Replaces the 2 MiB page mapping vaddr by a page table mapping the
+ * same frames with 4 KiB pages and the same attributes.
+ *
+ * @param pml4 The page table where the mapping resides.
+ *
+ * @param vaddr An address inside the 2 MiB page.
+ */
+void vm_split_huge(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  page_t *entry;
+  pagetable_t *pt;
+  physaddr_t frame;
+  uint64_t attribs, i;
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  entry = vmm_getentry(pml4, vaddr);
+  if(entry == 0 || !(*entry & PAGE_PRESENT) || !(*entry & PAGE_2MB))
+    KERNEL_PANIC("vm_split_huge: Address is not mapped by a 2 MiB page");
+
+  frame = *entry & PAGE_HUGE_MASK;
+  attribs = *entry & PAGE_ATTRIBS & ~(PAGE_2MB | PAGE_ACCESSED | PAGE_DIRTY);
+
+  pt = vmm_new_pagetable();
+  for(i = 0; i < PAGE_TABLE_ENTRIES; i++)
+    pt->pages[i] = (frame + i * PAGE_SIZE) | attribs;
+
+  /* The page table itself is writable; the leaves decide */
+  *entry = (physaddr_t)pt | PAGE_PRESENT | PAGE_WRITE | (attribs & PAGE_USER);
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+
+  vmm_invalidate(pml4, vaddr & PAGE_HUGE_MASK);
+}
+
+/**
+ * Shares every page mapped in [start, start + size) of src with dst,
+ * for copy-on-write. Each shared frame gets an extra reference, and
+ * the mappings in both page tables are made read-only, so the first
+ * write to a page in either address space faults and can be resolved
+ * by copying. The range must be page aligned and must not be mapped
+ * in dst. A 2 MiB page must lie entirely in the range.
+ *
+ * @param src The page table to share from.
+ *
+ * @param dst The page table to share into.
+ *
+ * @param start Start of the range.
+ *
+ * @param size Size of the range in bytes.
+ */
+void vm_share_range(pagetable_t *src, pagetable_t *dst,
+                    virtaddr_t start, uint64_t size)
+{
+  virtaddr_t vaddr = start, last = start + size - 1, next;
+  pagetable_t *pdp, *pdir, *pt;
+  page_t *entry;
+
+  if(size == 0)
+    return;
+
+  while(vaddr <= last)
+    {
+      pdp = vmm_getpdp(src, vaddr);
+      pdir = pdp ? vmm_getpdir(pdp, vaddr) : 0;
+      entry = pdir ? &pdir->pages[VMM_INDEX_PDIR(vaddr)] : 0;
+
+      /* Skip whole missing levels of the tree at once */
+      if(pdp == 0)
+        {
+          next = (vaddr | ((1ULL << 39) - 1)) + 1;
+        }
+      else if(pdir == 0)
+        {
+          next = (vaddr | ((1ULL << 30) - 1)) + 1;
+        }
+      else if((*entry & PAGE_PRESENT) && (*entry & PAGE_2MB))
+        {
+          physmem_ref(*entry & PAGE_HUGE_MASK,
+                      PAGE_HUGE_SIZE / PAGE_SIZE);
+          *entry &= ~PAGE_WRITE;
+          vmm_invalidate(src, vaddr);
+          vm_map_huge(dst, *entry & PAGE_HUGE_MASK, vaddr,
+                      *entry & PAGE_USER);
+          next = (vaddr | (PAGE_HUGE_SIZE - 1)) + 1;
+        }
+      else if((pt = vmm_getptable(pdir, vaddr)) == 0)
+        {
+          next = (vaddr | (PAGE_HUGE_SIZE - 1)) + 1;
+        }
+      else
+        {
+          entry = &pt->pages[VMM_INDEX_PTABLE(vaddr)];
+          if(*entry & PAGE_PRESENT)
+            {
+              physmem_ref(*entry & PAGE_MASK, 1);
+              *entry &= ~PAGE_WRITE;
+              vmm_invalidate(src, vaddr);
+              vm_map(dst, *entry & PAGE_MASK, vaddr, *entry & PAGE_USER);
+            }
+          next = vaddr + PAGE_SIZE;
+        }
+
+      /* Stop at the end of the address space */
+      if(next == 0)
+        break;
+      vaddr = next;
+    }
+}
+
+/**
+ * Finds the first page in [start, end) which is either mapped by a
+ * 4 KiB page, or swapped out. Pages mapped by 2 MiB pages are never
+ * returned.
+ *
+ * @param pml4 The page table to search.
+ *
+ * @param start Page aligned start of the range.
+ *
+ * @param end End of the range.
+ *
+ * @param swapped 0 to look for a mapped page, 1 for a swapped out one.
+ *
+ * @return The page, or end if there is no such page in the range.
+ */
+virtaddr_t vm_find_page(pagetable_t *pml4, virtaddr_t start,
+                        virtaddr_t end, int swapped)
+{
+  virtaddr_t vaddr = start, next;
+  pagetable_t *pdp, *pdir, *pt;
+  page_t entry;
+
+  while(vaddr < end)
+    {
+      pdp = vmm_getpdp(pml4, vaddr);
+      pdir = pdp ? vmm_getpdir(pdp, vaddr) : 0;
+
+      /* Skip whole missing levels of the tree at once */
+      if(pdp == 0)
+        next = (vaddr | ((1ULL << 39) - 1)) + 1;
+      else if(pdir == 0)
+        next = (vaddr | ((1ULL << 30) - 1)) + 1;
+      else if((pdir->pages[VMM_INDEX_PDIR(vaddr)] & PAGE_2MB)
+              || (pt = vmm_getptable(pdir, vaddr)) == 0)
+        next = (vaddr | (PAGE_HUGE_SIZE - 1)) + 1;
+      else
+        {
+          entry = pt->pages[VMM_INDEX_PTABLE(vaddr)];
+          if(swapped ? (entry & PAGE_SWAPPED) != 0
+             : (entry & PAGE_PRESENT) != 0)
+            return vaddr;
+          next = vaddr + PAGE_SIZE;
+        }
+
+      /* Stop at the end of the address space */
+      if(next == 0)
+        break;
+      vaddr = next;
+    }
+
+  return end;
+}
+
+/**
+ * Clears the accessed bit of the 4 KiB page mapping vaddr. The
+ * processor sets it again on the next access to the page.
+ *
+ * @param pml4 The page table where the mapping resides.
+ *
+ * @param vaddr The virtual address of the page.
+ *
+ * @return Non-zero if the page was accessed since the bit was last
+ * cleared.
+ */
+int vm_clear_accessed(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  page_t *entry = vmm_getentry(pml4, vaddr);
+
+  if(entry == 0 || !(*entry & PAGE_PRESENT) || !(*entry & PAGE_ACCESSED))
+    return 0;
+
+  *entry &= ~PAGE_ACCESSED;
+  vmm_invalidate(pml4, vaddr);
+  return 1;
+}
+
+/**
+ * Replaces the 4 KiB mapping of vaddr by a swap entry referring to
+ * the given swap slot, so that the next access to the page faults.
+ * The reference of the mapping to its frame is passed to the caller.
+ *
+ * @param pml4 The page table where the mapping resides.
+ *
+ * @param vaddr The virtual address of the page.
+ *
+ * @param slot The swap slot holding the contents of the page (not 0).
+ *
+ * @return The frame that was mapped, or 0 if the page was not mapped
+ * by a 4 KiB page.
+ */
+physaddr_t vm_swap_out(pagetable_t *pml4, virtaddr_t vaddr, uint64_t slot)
+{
+  page_t *entry;
+  physaddr_t frame = 0;
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  entry = vmm_getentry(pml4, vaddr);
+  if(entry != 0 && (*entry & PAGE_PRESENT) && !(*entry & PAGE_2MB))
+    {
+      frame = *entry & PAGE_MASK;
+      *entry = (slot << 12) | PAGE_SWAPPED;
+    }
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+
+  if(frame != 0)
+    vmm_invalidate(pml4, vaddr);
+
+  return frame;
+}
+
+/**
+ * Sets the swap entry of an unmapped page.
+ *
+ * @param pml4 The page table to change.
+ *
+ * @param vaddr The virtual address of the page.
+ *
+ * @param slot The swap slot holding the contents of the page, or 0 to
+ * clear the swap entry.
+ */
+void vm_set_swapped(pagetable_t *pml4, virtaddr_t vaddr, uint64_t slot)
+{
+  pagetable_t *pt;
+  page_t *entry;
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  pt = vmm_walk_ptable(pml4, vaddr, PAGE_USER);
+  entry = &pt->pages[VMM_INDEX_PTABLE(vaddr)];
+
+  if(*entry & PAGE_PRESENT)
+    KERNEL_PANIC("vm_set_swapped: Page is mapped");
+
+  *entry = slot ? (slot << 12) | PAGE_SWAPPED : 0;
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+}
+
+/**
+ * Returns the swap slot holding the contents of the page at vaddr, or
+ * 0 if the page is not swapped out.
+ */
+uint64_t vm_get_swapped(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  page_t *entry = vmm_getentry(pml4, vaddr);
+
+  if(entry == 0 || (*entry & PAGE_PRESENT) || !(*entry & PAGE_SWAPPED))
+    return 0;
+
+  return *entry >> 12;
+}
+
+/**
+ * Removes the mapping of the given virtual page and drops its
+ * reference to the mapped frame, freeing the frame if this was the
+ * last mapping. If vaddr is mapped by a 2 MiB page, the whole 2 MiB
+ * page is unmapped.
+ *
+ * @param pml4 The page table to remove the mapping from.
+ *
+ * @param vaddr The virtual address to unmap.
+ */
+void vm_unmap(pagetable_t *pml4, virtaddr_t vaddr)
+{
+  page_t *entry;
+  page_t old = 0;
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  entry = vmm_getentry(pml4, vaddr);
+  if(entry != 0 && (*entry & PAGE_PRESENT))
+    {
+      old = *entry;
+      *entry = 0;
+    }
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+
+  if(!(old & PAGE_PRESENT))
+    return;
+
+  vmm_invalidate(pml4, vaddr);
+
+  if(old & PAGE_2MB)
+    physmem_unref(old & PAGE_HUGE_MASK, PAGE_HUGE_SIZE / PAGE_SIZE);
+  else
+    physmem_unref(old & PAGE_MASK, 1);
 }
 
 pagetable_t *vm_create_pagetable(uint32_t asid){
+  pagetable_t *pml4;
   asid = asid;
 
   //Get page table from pool
-  pagetable_t *pml4 = vmm_new_pagetable();
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+  pml4 = vmm_new_pagetable();
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
 
   //copy the kernel mappings into the new page table
   memcopy(sizeof(pagetable_t), pml4, kernel_pml4);
 
+  //the PCID may have belonged to a destroyed address space, whose
+  //translations can still be in the TLB
+  vmm_flush_pcid(pml4);
+
   //every other level should be created under the first call to vm_map
   return pml4;
 }
 
-/**
- * Destroys given pagetable. Frees the memory allocated for
- * the pagetable.
- *
- * @param pagetable Page table to destroy
- *
- */
-void vm_destroy_pagetable(pagetable_t *pagetable)
+/* Returns a table to the page table pool. Must be called with
+ * vm_lock held. */
+static void vmm_free_pagetable(pagetable_t *pagetable)
 {
   /* Sanity check, is the pagetable pointer greater than the base
    * of the pagetable pool?
@@ -338,6 +938,99 @@ void vm_destroy_pagetable(pagetable_t *pagetable)
   ptmap_unsetbit(pt_index);
 }
 
+/**
+ * Destroys given pagetable. Every user page mapped in it drops its
+ * reference to its frame (freeing frames that are no longer shared),
+ * and all page tables of the user half, as well as the top level
+ * table, are returned to the page table pool. The kernel half is
+ * shared between all page tables and is left alone.
+ *
+ * The pagetable must not be the one currently loaded in CR3.
+ *
+ * @param pagetable Page table to destroy
+ *
+ */
+void vm_destroy_pagetable(pagetable_t *pagetable)
+{
+  pagetable_t *pdp, *pdir, *pt;
+  page_t entry;
+  uint64_t i, j, k, l;
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  /* User space starts right above VMM_KERNEL_SPACE, which is the
+   * upper half of the PML4 */
+  for(i = VMM_INDEX_PML4(VMM_KERNEL_SPACE) + 1; i < PAGE_TABLE_ENTRIES; i++)
+    {
+      if(!(pagetable->pages[i] & PAGE_PRESENT))
+        continue;
+      pdp = (pagetable_t*)(pagetable->pages[i] & PAGE_MASK);
+
+      for(j = 0; j < PAGE_TABLE_ENTRIES; j++)
+        {
+          if(!(pdp->pages[j] & PAGE_PRESENT))
+            continue;
+          pdir = (pagetable_t*)(pdp->pages[j] & PAGE_MASK);
+
+          for(k = 0; k < PAGE_TABLE_ENTRIES; k++)
+            {
+              entry = pdir->pages[k];
+              if(!(entry & PAGE_PRESENT))
+                continue;
+
+              if(entry & PAGE_2MB)
+                {
+                  physmem_unref(entry & PAGE_HUGE_MASK,
+                                PAGE_HUGE_SIZE / PAGE_SIZE);
+                  continue;
+                }
+
+              pt = (pagetable_t*)(entry & PAGE_MASK);
+              for(l = 0; l < PAGE_TABLE_ENTRIES; l++)
+                {
+                  if(pt->pages[l] & PAGE_PRESENT)
+                    physmem_unref(pt->pages[l] & PAGE_MASK, 1);
+                }
+              vmm_free_pagetable(pt);
+            }
+          vmm_free_pagetable(pdir);
+        }
+      vmm_free_pagetable(pdp);
+    }
+
+  vmm_free_pagetable(pagetable);
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+}
+
+/**
+ * Fills in the page table pool and kmalloc statistics of info.
+ *
+ * @param info The statistics to fill in.
+ */
+void vm_meminfo(meminfo_t *info)
+{
+  uint64_t i, bits, used = 0;
+
+  interrupt_status_t intr_status = _interrupt_disable();
+  spinlock_acquire(&vm_lock);
+
+  /* The kernel is not linked with libgcc, so count bits by hand. */
+  for(i = 0; i < VM_PTP_SIZE / 64; i++) {
+    for(bits = pt_bitmap[i]; bits != 0; bits &= bits - 1)
+      used++;
+  }
+
+  spinlock_release(&vm_lock);
+  _interrupt_set_state(intr_status);
+
+  info->pagetables_total = VM_PTP_SIZE;
+  info->pagetables_used = used;
+  info->kmalloc_frames = vmm_kmalloc_frames;
+}
+
 /* Compatability Functions */
 uintptr_t _tlb_get_maxindex(void)
 {
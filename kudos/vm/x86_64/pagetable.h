@@ -28,6 +28,14 @@
 #define PAGE_CPU_GLOBAL 0x100
 #define PAGE_LV4_GLOBAL 0x200
 
+/* A non-present page table entry with this (software) bit set belongs
+ * to a page that was swapped out; the address bits hold its swap slot */
+#define PAGE_SWAPPED    0x400
+
+/* A page directory entry with PAGE_2MB set maps a whole 2 MiB page */
+#define PAGE_HUGE_SIZE  0x200000
+#define PAGE_HUGE_MASK  0xFFFFFFFFFFE00000
+
 /* In x86_64, with 4 KB Pages we have 4 Level Page Directory */
 
 /* The lowest level, is a page, which contains a physical address */
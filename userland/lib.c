@@ -24,6 +24,14 @@ void syscall_halt(void)
 }
 
 
+/* Return the number of milliseconds elapsed since system startup.
+ */
+unsigned int syscall_time(void)
+{
+  return (unsigned int)_syscall(SYSCALL_TIME, 0, 0, 0);
+}
+
+
 /* Load the file indicated by 'pathname' as a new process and execute
  * it, passing the given argv. Returns the process ID of the created
  * process. Negative values are errors.
@@ -56,10 +64,11 @@ int syscall_join(int pid)
 }
 
 
-/* Create a new thread running in the same address space as the
- * caller. The thread is started at function 'func', and the thread
- * will end when 'func' returns. 'arg' is passed as an argument to
- * 'func'. Returns 0 on success or a negative value on error.
+/* Create a new process whose memory is a copy-on-write copy of the
+ * caller's. The process is started at function 'func' on a fresh
+ * stack, and will end when 'func' returns. 'arg' is passed as an
+ * argument to 'func'. Returns the PID of the new process on success
+ * or a negative value on error.
  */
 int syscall_fork(void (*func)(int), int arg)
 {
@@ -77,6 +86,67 @@ void *syscall_memlimit(void *heap_end)
 }
 
 
+/* Map the first 'length' bytes of the file 'pathname' read-only into
+ * memory. Pages are read from the file when first touched and are
+ * shared with other processes mapping the same file. Touching a page
+ * that lies wholly beyond the end of the file terminates the
+ * process. Returns the address of the mapping, or NULL on error.
+ */
+void *syscall_mmap(const char *pathname, int length)
+{
+  return (void*)_syscall(SYSCALL_MMAP, (uintptr_t)pathname, (uintptr_t)length, 0);
+}
+
+
+/* Remove the mapping starting at 'addr', made by syscall_mmap.
+ * Returns 0 on success, or a negative value on error.
+ */
+int syscall_munmap(void *addr)
+{
+  return (int)_syscall(SYSCALL_MUNMAP, (uintptr_t)addr, 0, 0);
+}
+
+
+/* Create a shared memory segment called 'name' (at most 15
+ * characters) of 'size' bytes and map it into memory. The memory is
+ * zero-filled. Other processes attach to the segment by name, and
+ * children created with syscall_fork share it as well. Returns the
+ * address of the segment, or NULL on error.
+ */
+void *syscall_shm_create(const char *name, int size)
+{
+  return (void*)_syscall(SYSCALL_SHM_CREATE, (uintptr_t)name, (uintptr_t)size, 0);
+}
+
+
+/* Map the existing shared memory segment called 'name' into
+ * memory. Returns the address of the segment, or NULL on error.
+ */
+void *syscall_shm_attach(const char *name)
+{
+  return (void*)_syscall(SYSCALL_SHM_ATTACH, (uintptr_t)name, 0, 0);
+}
+
+
+/* Unmap the shared memory segment starting at 'addr'. The segment is
+ * destroyed when no process has it mapped any longer. Returns 0 on
+ * success, or a negative value on error.
+ */
+int syscall_shm_detach(void *addr)
+{
+  return (int)_syscall(SYSCALL_SHM_DETACH, (uintptr_t)addr, 0, 0);
+}
+
+
+/* Fill in 'info' with statistics of the memory use of the whole
+ * system. Returns 0 on success, or a negative value on error.
+ */
+int syscall_meminfo(meminfo_t *info)
+{
+  return (int)_syscall(SYSCALL_MEMINFO, (uintptr_t)info, 0, 0);
+}
+
+
 /* Open the file identified by 'pathname' for reading and
  * writing. Returns the file handle of the opened file (positive
  * value), or a negative value on error.
@@ -164,12 +234,54 @@ int syscall_file(const char *pathname, int idx, char *buffer)
 
 #ifdef PROVIDE_STRING_FUNCTIONS
 
+/* The string and memory functions below work a machine word at a time
+   where they can. Words are only ever read from aligned addresses, so
+   reading past the end of a string never crosses into another page. */
+
+/* A machine word which may alias any other type. */
+typedef uintptr_t __attribute__((__may_alias__)) word_t;
+
+#define WORD_SIZE (sizeof(word_t))
+#define WORD_MASK (WORD_SIZE - 1)
+#define WORD_ALIGNED(p) (((uintptr_t)(p) & WORD_MASK) == 0)
+
+/* 0x0101...01 and 0x8080...80 */
+#define WORD_ONES ((word_t)-1 / 0xff)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/* Nonzero if some byte of w is zero. */
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+/* Buffers shorter than this are handled bytewise. */
+#define WORD_THRESHOLD (4 * WORD_SIZE)
+
+/* The word holding the bytes at offset off (1 to WORD_SIZE-1) of the
+   concatenation of the aligned words lo and hi in memory. */
+#if defined(__MIPSEB__) || (defined(__BYTE_ORDER__)                     \
+                            && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define WORD_MERGE(lo, hi, off)                                         \
+  (((lo) << (8 * (off))) | ((hi) >> (8 * (WORD_SIZE - (off)))))
+#else
+#define WORD_MERGE(lo, hi, off)                                         \
+  (((lo) >> (8 * (off))) | ((hi) << (8 * (WORD_SIZE - (off)))))
+#endif
+
 /* Return the length of the string pointed to by s. */
 size_t strlen(const char *s)
 {
-  size_t i;
-  for (i=0; s[i]; i++);
-  return i;
+  const char *p;
+  const word_t *w;
+
+  for (p = s; !WORD_ALIGNED(p); p++) {
+    if (*p == '\0') {
+      return p - s;
+    }
+  }
+
+  for (w = (const word_t *)p; !WORD_HAS_ZERO(*w); w++);
+
+  for (p = (const char *)w; *p != '\0'; p++);
+  return p - s;
 }
 
 /* Copy all of src to after dest and return dest.  Make sure there is
@@ -221,9 +333,33 @@ char *strncat(char *dest, const char *src, size_t n)
   return dest;
 }
 
+/* Compare the strings s1 and s2. Returns a negative value, zero or a
+   positive value if s1 is less than, equal to or greater than s2. */
 int strcmp(const char *s1, const char *s2)
 {
-  return strncmp(s1, s2, 0x7fffffff);
+  const word_t *w1, *w2;
+
+  /* Whole words can only be compared if both strings reach a word
+     boundary at the same time. */
+  if (((uintptr_t)s1 & WORD_MASK) == ((uintptr_t)s2 & WORD_MASK)) {
+    for (; !WORD_ALIGNED(s1); s1++, s2++) {
+      if (*s1 != *s2 || *s1 == '\0') {
+        return *(const byte *)s1 - *(const byte *)s2;
+      }
+    }
+
+    w1 = (const word_t *)s1;
+    w2 = (const word_t *)s2;
+    while (*w1 == *w2 && !WORD_HAS_ZERO(*w1)) {
+      w1++;
+      w2++;
+    }
+    s1 = (const char *)w1;
+    s2 = (const char *)w2;
+  }
+
+  for (; *s1 == *s2 && *s1 != '\0'; s1++, s2++);
+  return *(const byte *)s1 - *(const byte *)s2;
 }
 
 int strncmp(const char *s1, const char *s2, size_t n)
@@ -242,6 +378,28 @@ int strncmp(const char *s1, const char *s2, size_t n)
 int memcmp(const void* s1, const void* s2,size_t n)
 {
   const unsigned char *p1 = s1, *p2 = s2;
+  const word_t *w1, *w2;
+
+  if (n >= WORD_THRESHOLD
+      && ((uintptr_t)p1 & WORD_MASK) == ((uintptr_t)p2 & WORD_MASK)) {
+    for (; !WORD_ALIGNED(p1); n--) {
+      if (*p1 != *p2) {
+        return *p1 - *p2;
+      }
+      p1++;
+      p2++;
+    }
+
+    w1 = (const word_t *)p1;
+    w2 = (const word_t *)p2;
+    for (; n >= WORD_SIZE && *w1 == *w2; n -= WORD_SIZE) {
+      w1++;
+      w2++;
+    }
+    p1 = (const unsigned char *)w1;
+    p2 = (const unsigned char *)w2;
+  }
+
   while(n--) {
     if( *p1 != *p2 ) {
       return *p1 - *p2;
@@ -264,6 +422,27 @@ char *strstr(const char *s1, const char *s2)
 
 void *memset(void *s, int c, size_t n) {
   byte *p = s;
+  word_t *w, pattern;
+
+  if (n >= WORD_THRESHOLD) {
+    for (; !WORD_ALIGNED(p); n--) {
+      *(p++) = c;
+    }
+
+    pattern = WORD_ONES * (byte)c;
+    for (w = (word_t *)p; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE) {
+      w[0] = pattern;
+      w[1] = pattern;
+      w[2] = pattern;
+      w[3] = pattern;
+      w += 4;
+    }
+    for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+      *(w++) = pattern;
+    }
+    p = (byte *)w;
+  }
+
   while (n-- > 0) {
     *(p++) = c;
   }
@@ -273,6 +452,44 @@ void *memset(void *s, int c, size_t n) {
 void *memcpy(void *dest, const void *src, size_t n) {
   byte *d = dest;
   const byte *s = src;
+  word_t *dw, lo, hi;
+  const word_t *sw;
+  size_t off;
+
+  if (n >= WORD_THRESHOLD) {
+    for (; !WORD_ALIGNED(d); n--) {
+      *(d++) = *(s++);
+    }
+
+    dw = (word_t *)d;
+    off = (uintptr_t)s & WORD_MASK;
+    if (off == 0) {
+      for (sw = (const word_t *)s; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE) {
+        dw[0] = sw[0];
+        dw[1] = sw[1];
+        dw[2] = sw[2];
+        dw[3] = sw[3];
+        dw += 4;
+        sw += 4;
+      }
+      for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+        *(dw++) = *(sw++);
+      }
+      s = (const byte *)sw;
+    } else {
+      /* The source is misaligned relative to the target: read
+         aligned source words and shift them into place. */
+      sw = (const word_t *)(s - off);
+      for (lo = *(sw++); n >= WORD_SIZE; n -= WORD_SIZE) {
+        hi = *(sw++);
+        *(dw++) = WORD_MERGE(lo, hi, off);
+        lo = hi;
+      }
+      s = (const byte *)(sw - 1) + off;
+    }
+    d = (byte *)dw;
+  }
+
   while (n-- > 0) {
     *(d++) = *(s++);
   }
@@ -709,117 +926,232 @@ int snprintf(char *str, int size, const  char  *fmt, ...) {
 /* Heap allocation. */
 #ifdef PROVIDE_HEAP_ALLOCATOR
 
+/* Every block starts with this header. Block sizes include the header
+   and are multiples of its size, which keeps the memory returned by
+   malloc suitably aligned. The next pointer is only used while the
+   block is free. */
 typedef struct free_block {
   size_t size;
   struct free_block *next;
 } free_block_t;
 
-static const size_t MIN_ALLOC_SIZE = sizeof(free_block_t);
+#define BLOCK_ALIGN sizeof(free_block_t)
+
+/* Small blocks are kept in one free list per size, indexed by size /
+   BLOCK_ALIGN, so allocating and freeing them is O(1). Small blocks
+   are never merged; a list is refilled by carving up a chunk of at
+   least SMALL_CHUNK_SIZE bytes. */
+#define SMALL_CLASSES 64
+#define SMALL_MAX_SIZE ((SMALL_CLASSES - 1) * BLOCK_ALIGN)
+#define SMALL_CHUNK_SIZE 4096
 
-free_block_t *free_list;
+/* The heap is grown with syscall_memlimit in steps of at least this
+   many bytes. */
+#define HEAP_GROW_SIZE 0x10000
 
-byte heap[HEAP_SIZE];
+static free_block_t *small_free[SMALL_CLASSES];
 
-/* Initialise the heap - malloc et al won't work unless this is called
-   first. */
+/* Larger blocks are kept in a free list sorted by increasing address,
+   so that neighbouring free blocks can be merged. */
+static free_block_t *free_list;
+
+/* Current end of the heap. */
+static byte *heap_end;
+
+/* Initialise the heap. Calling this is optional: malloc et al
+   initialise the heap themselves on first use. */
 void heap_init()
 {
-  free_list = (free_block_t*) heap;
-  free_list->size = HEAP_SIZE;
-  free_list->next = NULL;
+  uintptr_t end;
+
+  if (heap_end != NULL) {
+    return;
+  }
+
+  /* Start the heap at an aligned address */
+  end = (uintptr_t)syscall_memlimit(NULL);
+  end = (end + BLOCK_ALIGN - 1) & ~(uintptr_t)(BLOCK_ALIGN - 1);
+  heap_end = syscall_memlimit((void*)end);
+}
+
+/* Insert block into the large free list, merging it with its
+   neighbours. */
+static void free_large(free_block_t *block)
+{
+  free_block_t *cur_block;
+  free_block_t *prev_block;
+
+  /* Iterate through the free list, which is sorted by increasing
+     address, and insert the newly freed block at the proper
+     position. */
+  for (cur_block = free_list, prev_block = NULL;
+       cur_block != NULL && cur_block < block;
+       prev_block = cur_block, cur_block = cur_block->next);
+
+  if (prev_block == NULL) {
+    free_list = block;
+  } else {
+    prev_block->next = block;
+  }
+  block->next = cur_block;
+
+  if (prev_block != NULL &&
+      (size_t)((byte*)block - (byte*)prev_block) == prev_block->size) {
+    /* Merge with previous. */
+    prev_block->size += block->size;
+    prev_block->next = cur_block;
+    block = prev_block;
+  }
+
+  if (cur_block != NULL &&
+      (size_t)((byte*)cur_block - (byte*)block) == block->size) {
+    /* Merge with next. */
+    block->size += cur_block->size;
+    block->next = cur_block->next;
+  }
+}
+
+/* Grow the heap by at least size bytes and add the new memory to the
+   large free list. Returns 0 on success, or -1 if the kernel refused
+   to grow the heap. */
+static int heap_grow(size_t size)
+{
+  free_block_t *block;
+  byte *new_end;
+
+  heap_init();
+  if (heap_end == NULL) {
+    return -1;
+  }
+
+  size = MAX(size, HEAP_GROW_SIZE);
+  new_end = syscall_memlimit(heap_end + size);
+  if (new_end == NULL) {
+    return -1;
+  }
+
+  block = (free_block_t*)heap_end;
+  block->size = size;
+  heap_end = new_end;
+  free_large(block);
+  return 0;
+}
+
+/* Return a block of exactly size bytes (including the header) from the
+   large free list, using the first free block that is big enough, and
+   growing the heap if none is. */
+static free_block_t *malloc_large(size_t size)
+{
+  free_block_t *block;
+  free_block_t **prev_p; /* Previous link so we can remove an element */
+
+  for (;;) {
+    for (block = free_list, prev_p = &free_list;
+         block;
+         prev_p = &(block->next), block = block->next) {
+      if (block->size >= size + 2 * BLOCK_ALIGN) {
+        /* Block is too big, but can be split. */
+        block->size -= size;
+        block = (free_block_t*)(((byte*)block) + block->size);
+        block->size = size;
+        return block;
+      } else if (block->size >= size) {
+        /* Block is big enough, but not so big that we can split
+           it, so just return it */
+        *prev_p = block->next;
+        return block;
+      }
+      /* Else, check the next block. */
+    }
+
+    if (heap_grow(size) < 0) {
+      /* No heap space left. */
+      return NULL;
+    }
+  }
 }
 
+/* Refill the free list of small blocks of the given size by splitting
+   up a chunk from the large free list. Returns 0 on success. */
+static int refill_small(size_t size)
+{
+  size_t chunk_size = MAX(SMALL_CHUNK_SIZE, 4 * size);
+  free_block_t *chunk = malloc_large(chunk_size);
+  free_block_t *block;
+  byte *pos;
+
+  if (chunk == NULL) {
+    return -1;
+  }
+
+  /* The chunk may be larger than requested if it was not split */
+  chunk_size = chunk->size;
+  for (pos = (byte*)chunk; pos + size <= (byte*)chunk + chunk_size;
+       pos += size) {
+    block = (free_block_t*)pos;
+    block->size = size;
+    block->next = small_free[size / BLOCK_ALIGN];
+    small_free[size / BLOCK_ALIGN] = block;
+  }
+  return 0;
+}
 
 /* Return a block of at least size bytes, or NULL if no such block
    can be found.  */
-void *malloc(size_t size) {
+void *malloc(size_t size)
+{
   free_block_t *block;
-  free_block_t **prev_p; /* Previous link so we can remove an element */
-  if (size == 0) {
+  size_t class;
+
+  if (size == 0 || size > (size_t)-1 / 2) {
     return NULL;
   }
 
-  /* Ensure block is big enough for bookkeeping. */
-  size=MAX(MIN_ALLOC_SIZE,size);
-  /* Word-align */
-  if (size % 4 != 0) {
-    size &= ~3;
-    size += 4;
-  }
-
-  /* Iterate through list of free blocks, using the first that is
-     big enough for the request. */
-  for (block = free_list, prev_p = &free_list;
-       block;
-       prev_p = &(block->next), block = block->next) {
-    if ( (int)( block->size - size - sizeof(size_t) ) >=
-         (int)( MIN_ALLOC_SIZE+sizeof(size_t) ) ) {
-      /* Block is too big, but can be split. */
-      block->size -= size+sizeof(size_t);
-      free_block_t *new_block =
-        (free_block_t*)(((byte*)block)+block->size);
-      new_block->size = size+sizeof(size_t);
-      return ((byte*)new_block)+sizeof(size_t);
-    } else if (block->size >= size + sizeof(size_t)) {
-      /* Block is big enough, but not so big that we can split
-         it, so just return it */
-      *prev_p = block->next;
-      return ((byte*)block)+sizeof(size_t);
-    }
-    /* Else, check the next block. */
+  /* Make room for the header, and align. */
+  size = (size + 2 * BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+
+  if (size > SMALL_MAX_SIZE) {
+    block = malloc_large(size);
+    return block == NULL ? NULL : ((byte*)block) + BLOCK_ALIGN;
   }
 
-  /* No heap space left. */
-  return NULL;
+  class = size / BLOCK_ALIGN;
+  if (small_free[class] == NULL && refill_small(size) < 0) {
+    return NULL;
+  }
+  block = small_free[class];
+  small_free[class] = block->next;
+  return ((byte*)block) + BLOCK_ALIGN;
 }
 
 /* Return the block pointed to by ptr to the free pool. */
 void free(void *ptr)
 {
-  if (ptr != NULL) { /* Freeing NULL is a no-op */
-    free_block_t *block = (free_block_t*)((byte*)ptr-sizeof(size_t));
-    free_block_t *cur_block;
-    free_block_t *prev_block;
-
-    /* Iterate through the free list, which is sorted by
-       increasing address, and insert the newly freed block at the
-       proper position. */
-    for (cur_block = free_list, prev_block = NULL;
-         ;
-         prev_block = cur_block, cur_block = cur_block->next) {
-      if (cur_block > block || cur_block == NULL) {
-        /* Insert block here. */
-        if (prev_block == NULL) {
-          free_list = block;
-        } else {
-          prev_block->next = block;
-        }
-        block->next = cur_block;
-
-        if (prev_block != NULL &&
-            (size_t)((byte*)block - (byte*)prev_block) == prev_block->size) {
-          /* Merge with previous. */
-          prev_block->size += block->size;
-          prev_block->next = cur_block;
-          block = prev_block;
-        }
+  free_block_t *block;
 
-        if (cur_block != NULL &&
-            (size_t)((byte*)cur_block - (byte*)block) == block->size) {
-          /* Merge with next. */
-          block->size += cur_block->size;
-          block->next = cur_block->next;
-        }
-        return;
-      }
-    }
+  if (ptr == NULL) { /* Freeing NULL is a no-op */
+    return;
+  }
+
+  block = (free_block_t*)((byte*)ptr - BLOCK_ALIGN);
+  if (block->size <= SMALL_MAX_SIZE) {
+    block->next = small_free[block->size / BLOCK_ALIGN];
+    small_free[block->size / BLOCK_ALIGN] = block;
+  } else {
+    free_large(block);
   }
 }
 
 void *calloc(size_t nmemb, size_t size)
 {
   size_t i;
-  byte *ptr = malloc(nmemb*size);
+  byte *ptr;
+
+  if (size != 0 && nmemb > (size_t)-1 / size) {
+    return NULL;
+  }
+
+  ptr = malloc(nmemb*size);
   if (ptr != NULL) {
     for (i = 0; i < nmemb*size; i++) {
       ptr[i] = 0;
@@ -831,6 +1163,7 @@ void *calloc(size_t nmemb, size_t size)
 void *realloc(void *ptr, size_t size)
 {
   byte *new_ptr;
+  size_t old_size;
   size_t i;
   if (ptr == NULL) {
     return malloc(size);
@@ -841,12 +1174,16 @@ void *realloc(void *ptr, size_t size)
     return NULL;
   }
 
-  /* Simple implementation: allocate new space and copy the contents
-     over.  Exercise: Improve this by searching through the free
-     list and seeing whether an actual enlargement is possible. */
+  /* Shrinking, or growing within the slack of the block, is free. */
+  old_size = ((free_block_t*)((byte*)ptr - BLOCK_ALIGN))->size
+    - BLOCK_ALIGN;
+  if (size <= old_size) {
+    return ptr;
+  }
+
   new_ptr = malloc(size);
   if (new_ptr != NULL) {
-    for (i = 0; i < size; i++) {
+    for (i = 0; i < old_size; i++) {
       new_ptr[i] = ((byte*)ptr)[i];
     }
     free(ptr);
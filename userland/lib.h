@@ -17,6 +17,7 @@
 #define PROVIDE_MISC
 
 #include "lib/types.h"
+#include "vm/meminfo.h"
 
 #define MIN(arg1,arg2) ((arg1) > (arg2) ? (arg2) : (arg1))
 #define MAX(arg1,arg2) ((arg1) > (arg2) ? (arg1) : (arg2))
@@ -34,11 +35,12 @@ typedef int pid_t;
 #define BUFSIZE 64
 
 // Makes the syscall 'syscall_num' with the arguments 'a1', 'a2' and 'a3'.
-uint32_t _syscall(uint64_t syscall_num, uint64_t a1, uint64_t a2, uint64_t a3);
+uintptr_t _syscall(uint64_t syscall_num, uint64_t a1, uint64_t a2, uint64_t a3);
 
 /* The library functions which are just wrappers to the _syscall function. */
 
 void syscall_halt(void);
+unsigned int syscall_time(void);
 
 int syscall_spawn(const char *filename, const char **argv);
 int syscall_join(int pid);
@@ -56,6 +58,12 @@ int syscall_file(const char *pathname, int index, char *buffer);
 
 int syscall_fork(void (*func)(int), int arg);
 void *syscall_memlimit(void *heap_end);
+void *syscall_mmap(const char *pathname, int length);
+int syscall_munmap(void *addr);
+void *syscall_shm_create(const char *name, int size);
+void *syscall_shm_attach(const char *name);
+int syscall_shm_detach(void *addr);
+int syscall_meminfo(meminfo_t *info);
 
 #ifdef PROVIDE_STRING_FUNCTIONS
 size_t strlen(const char *s);
@@ -66,6 +74,7 @@ char *strncat(char *dest, const char *src, size_t n);
 int strcmp(const char *s1, const char *s2);
 int strncmp(const char *s1, const char *s2, size_t n);
 char *strstr(const char *s1, const char *s2);
+int memcmp(const void *s1, const void *s2, size_t n);
 
 void *memset(void *s, int c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
@@ -86,7 +95,6 @@ int snprintf(char *, int, const char *, ...);
 #endif
 
 #ifdef PROVIDE_HEAP_ALLOCATOR
-#define HEAP_SIZE 256 /* 256 byte heap - puny! */
 void heap_init();
 void *calloc(size_t nmemb, size_t size);
 void *malloc(size_t size);
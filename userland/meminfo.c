@@ -0,0 +1,37 @@
+/*
+ * Print the memory statistics of the system.
+ */
+
+#include "lib.h"
+
+static void show(const char *what, uint64_t pages, uint64_t page_size)
+{
+  printf("%s %d pages (%d KiB)\n", what, (int)pages,
+         (int)(pages * (page_size / 1024)));
+}
+
+int main(void)
+{
+  meminfo_t info;
+
+  if (syscall_meminfo(&info) < 0) {
+    puts("meminfo: system call failed\n");
+    return 1;
+  }
+
+  show("Total frames:      ", info.total_frames, info.page_size);
+  show("Used frames:       ", info.used_frames, info.page_size);
+  show("Free frames:       ", info.free_frames, info.page_size);
+  show("  zeroed:          ", info.zeroed_frames, info.page_size);
+  show("  largest run:     ", info.largest_free_run, info.page_size);
+  show("Shared frames:     ", info.shared_frames, info.page_size);
+  show("kmalloc since boot:", info.kmalloc_frames, info.page_size);
+  printf("Page tables:        %d used of %d\n",
+         (int)info.pagetables_used, (int)info.pagetables_total);
+  if (info.swap_total > 0) {
+    show("Swap used:         ", info.swap_used, info.page_size);
+    show("Swap total:        ", info.swap_total, info.page_size);
+  }
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Benchmark of the string and memory functions of the userland
+ * library, compared with plain byte-at-a-time loops.
+ *
+ * Usage: strbench [kilobytes per test]
+ */
+
+#include "lib.h"
+
+#define BUFFER_SIZE 4096
+
+static void *byte_memcpy(void *dest, const void *src, size_t n)
+{
+  byte *d = dest;
+  const byte *s = src;
+  while (n-- > 0) {
+    *(d++) = *(s++);
+  }
+  return dest;
+}
+
+static void *byte_memset(void *s, int c, size_t n)
+{
+  byte *p = s;
+  while (n-- > 0) {
+    *(p++) = c;
+  }
+  return s;
+}
+
+static int byte_memcmp(const void *s1, const void *s2, size_t n)
+{
+  const byte *p1 = s1, *p2 = s2;
+  for (; n > 0; n--, p1++, p2++) {
+    if (*p1 != *p2) {
+      return *p1 - *p2;
+    }
+  }
+  return 0;
+}
+
+static size_t byte_strlen(const char *s)
+{
+  size_t i;
+  for (i = 0; s[i]; i++);
+  return i;
+}
+
+static int byte_strcmp(const char *s1, const char *s2)
+{
+  for (; *s1 == *s2 && *s1 != '\0'; s1++, s2++);
+  return *(const byte *)s1 - *(const byte *)s2;
+}
+
+typedef enum {
+  BENCH_MEMCPY, BENCH_MEMSET, BENCH_MEMCMP, BENCH_STRLEN, BENCH_STRCMP
+} bench_t;
+
+static const char *bench_names[] = {
+  "memcpy", "memset", "memcmp", "strlen", "strcmp"
+};
+
+static char *src, *dst;
+
+/* Keeps the results of the comparisons from being optimized away. */
+static volatile int sink;
+
+/* Runs one benchmark over buffers of the given size, misaligned by
+   offset bytes, until total bytes have been processed. Returns the
+   elapsed time in milliseconds. */
+static unsigned int run(bench_t bench, int bytewise, int size, int offset,
+                        int total)
+{
+  /* The strings end at the end of the buffers. */
+  const char *s_str = src + BUFFER_SIZE - size;
+  const char *d_str = dst + BUFFER_SIZE - size;
+  unsigned int start;
+  int i;
+
+  /* Restore the contents the previous benchmark overwrote. */
+  memcpy(dst, src, BUFFER_SIZE + 1);
+
+  start = syscall_time();
+
+  for (i = 0; i < total / size; i++) {
+    switch (bench) {
+    case BENCH_MEMCPY:
+      if (bytewise) {
+        byte_memcpy(dst, src + offset, size);
+      } else {
+        memcpy(dst, src + offset, size);
+      }
+      break;
+    case BENCH_MEMSET:
+      if (bytewise) {
+        byte_memset(dst + offset, i, size);
+      } else {
+        memset(dst + offset, i, size);
+      }
+      break;
+    case BENCH_MEMCMP:
+      /* Equal buffers, misaligned alike, so that the whole size is
+         compared. */
+      if (bytewise) {
+        sink += byte_memcmp(dst + offset, src + offset, size);
+      } else {
+        sink += memcmp(dst + offset, src + offset, size);
+      }
+      break;
+    case BENCH_STRLEN:
+      if (bytewise) {
+        sink += byte_strlen(s_str);
+      } else {
+        sink += strlen(s_str);
+      }
+      break;
+    case BENCH_STRCMP:
+      if (bytewise) {
+        sink += byte_strcmp(d_str, s_str);
+      } else {
+        sink += strcmp(d_str, s_str);
+      }
+      break;
+    }
+  }
+
+  return syscall_time() - start;
+}
+
+int main(int argc, char **argv)
+{
+  static const int sizes[] = { 16, 256, 4096 };
+  int total = 1024 * 1024;
+  int bench, i;
+
+  if (argc > 1) {
+    total = atoi(argv[1]) * 1024;
+  }
+
+  src = malloc(BUFFER_SIZE + 1);
+  dst = malloc(BUFFER_SIZE + 1);
+  if (src == NULL || dst == NULL || total <= 0) {
+    puts("strbench: out of memory\n");
+    return 1;
+  }
+
+  /* Equal strings, so that strcmp and memcmp run to the end. */
+  for (i = 0; i < BUFFER_SIZE; i++) {
+    src[i] = dst[i] = 'a' + i % 26;
+  }
+  src[BUFFER_SIZE] = dst[BUFFER_SIZE] = '\0';
+
+  printf("%d KiB per test, times in ms (bytewise/library)\n",
+         total / 1024);
+  printf("function    bytes   aligned  misaligned\n");
+  for (bench = BENCH_MEMCPY; bench <= BENCH_STRCMP; bench++) {
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+      printf("%s  %d\t%d/%d\t%d/%d\n", bench_names[bench], sizes[i],
+             run(bench, 1, sizes[i], 0, total),
+             run(bench, 0, sizes[i], 0, total),
+             run(bench, 1, sizes[i] - 1, 1, total),
+             run(bench, 0, sizes[i] - 1, 1, total));
+    }
+  }
+
+  return 0;
+}